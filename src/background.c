@@ -17,14 +17,18 @@
  */
  
 #include "background.h"
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include <glib/gstdio.h>
+#include <math.h>
 
 struct _GrapheneWMBackground
 {
 	ClutterActor parent;
 	MetaScreen *screen;
 	guint monitor;
-	MetaBackgroundActor *actor;
-	GSettings *settings;
+	MetaBackgroundActor *actor; // Not refed; a child of this actor
+	MetaBackground *background; // Most recent background, shown or fading in
+	gchar *wantedKey; // Key of the background this should be showing
 };
 
 enum
@@ -35,12 +39,14 @@ enum
 };
 
 static GParamSpec *properties[PROP_LAST];
+static GList *instances = NULL; // All GrapheneWMBackgrounds, not refed
 
 static void graphene_wm_background_constructed(GObject *self);
 static void graphene_wm_background_dispose(GObject *gobject);
 static void graphene_wm_background_set_property(GObject *self, guint propertyId, const GValue *value, GParamSpec *pspec);
 static void graphene_wm_background_get_property(GObject *self, guint propertyId, GValue *value, GParamSpec *pspec);
 static void update(GrapheneWMBackground *backgroundGroup);
+static void init_shared(void);
 
 G_DEFINE_TYPE (GrapheneWMBackground, graphene_wm_background, CLUTTER_TYPE_ACTOR);
 
@@ -70,17 +76,19 @@ static void graphene_wm_background_init(UNUSED GrapheneWMBackground *self) {}
 static void graphene_wm_background_constructed(GObject *self_)
 {
 	GrapheneWMBackground *self = GRAPHENE_WM_BACKGROUND(self_);
-	self->settings = g_settings_new("org.gnome.desktop.background");
-	g_signal_connect_swapped(self->settings, "changed", G_CALLBACK(update), self);
+	init_shared();
+	instances = g_list_prepend(instances, self);
 	update(self);
 }
 
 static void graphene_wm_background_dispose(GObject *gobject)
 {
 	GrapheneWMBackground *self = GRAPHENE_WM_BACKGROUND(gobject);
+	instances = g_list_remove(instances, self);
 	g_clear_object(&self->screen);
-	g_clear_object(&self->actor);
-	g_clear_object(&self->settings);
+	self->actor = NULL;
+	g_clear_object(&self->background);
+	g_clear_pointer(&self->wantedKey, g_free);
 	G_OBJECT_CLASS(graphene_wm_background_parent_class)->dispose(gobject);
 }
 
@@ -95,45 +103,450 @@ static void graphene_wm_background_set_property(GObject *self, guint propertyId,
 
 static void graphene_wm_background_get_property(UNUSED GObject *self, UNUSED guint propertyId, UNUSED GValue *value, UNUSED GParamSpec *pspec) {}
 
+/*
+ * All monitors show the same wallpaper, so they share one GSettings and one
+ * MetaBackground for each distinct wallpaper configuration and monitor size.
+ * Settings apps tend to write several keys back to back, so updates are
+ * delayed slightly to apply them all at once, and skipped if nothing that
+ * affects the wallpaper actually changed.
+ *
+ * Before a wallpaper is handed to Mutter, a worker thread scales it down to
+ * the size of the monitor (applying the picture-options style) and saves the
+ * result in the user's cache directory. The next time the same image is
+ * shown on a monitor of the same size, the scaled copy is loaded directly.
+ * This way a huge wallpaper only has to be decoded at full size once, and
+ * Mutter never holds more than a screenful of pixels for it. The cache is
+ * capped in bytes, and the least recently used copies are dropped first.
+ */
+
+#define BACKGROUND_SETTINGS_SCHEMA "org.gnome.desktop.background"
+#define BACKGROUND_UPDATE_DELAY 100 // ms
+#define BACKGROUND_CACHE_MAX_BYTES (64*1024*1024) // The newest file is kept even if larger
+#define BACKGROUND_JPEG_QUALITY "95"
+
+static const gchar *relevantKeys[] = {
+	"picture-uri",
+	"picture-options",
+	"primary-color",
+	"secondary-color",
+	"color-shading-type",
+	NULL
+};
+
+typedef struct
+{
+	gchar *uri;
+	GDesktopBackgroundStyle style;
+	gint width, height;
+} ScaleJob;
+
+static GSettings *settings = NULL;
+static GHashTable *backgroundCache = NULL; // Background key to MetaBackground *
+static GHashTable *pendingScales = NULL; // Set of background keys being scaled
+static gchar *currentKey = NULL; // Settings part of the background key
+static guint updateSourceId = 0;
+
+// Describes everything in the settings that goes into a MetaBackground
+static gchar * build_key(void)
+{
+	gchar *uri = g_settings_get_string(settings, "picture-uri");
+	gchar *primary = g_settings_get_string(settings, "primary-color");
+	gchar *secondary = g_settings_get_string(settings, "secondary-color");
+	gchar *key = g_strdup_printf("%s\n%i\n%s\n%s\n%i",
+		uri,
+		g_settings_get_enum(settings, "picture-options"),
+		primary,
+		secondary,
+		g_settings_get_enum(settings, "color-shading-type"));
+	g_free(uri);
+	g_free(primary);
+	g_free(secondary);
+	return key;
+}
+
+// Only these styles depend on the size of a single monitor
+static gboolean style_is_scalable(GDesktopBackgroundStyle style)
+{
+	return style == G_DESKTOP_BACKGROUND_STYLE_CENTERED
+		|| style == G_DESKTOP_BACKGROUND_STYLE_SCALED
+		|| style == G_DESKTOP_BACKGROUND_STYLE_STRETCHED
+		|| style == G_DESKTOP_BACKGROUND_STYLE_ZOOM;
+}
+
+static gchar * get_cache_dir(void)
+{
+	return g_build_filename(g_get_user_cache_dir(), "graphene", "backgrounds", NULL);
+}
+
+/*
+ * Keeps only the most recently used scaled wallpapers that fit in
+ * BACKGROUND_CACHE_MAX_BYTES. Runs in the worker thread after adding a
+ * new one.
+ */
+static gint compare_mtime_desc(gconstpointer a, gconstpointer b)
+{
+	gint64 ma = ((const gint64 *)a)[0], mb = ((const gint64 *)b)[0];
+	return (ma < mb) - (ma > mb);
+}
+
+static void prune_cache(const gchar *dir)
+{
+	GDir *d = g_dir_open(dir, 0, NULL);
+	if(!d)
+		return;
+
+	GArray *files = g_array_new(FALSE, FALSE, sizeof(gint64) * 3);
+	GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+	const gchar *name;
+	while((name = g_dir_read_name(d)))
+	{
+		// Other workers' files that are still being written
+		if(g_str_has_suffix(name, ".tmp"))
+			continue;
+		gchar *path = g_build_filename(dir, name, NULL);
+		GStatBuf st;
+		if(g_stat(path, &st) != 0)
+		{
+			g_free(path);
+			continue;
+		}
+		gint64 entry[3] = {st.st_mtime, paths->len, st.st_size};
+		g_array_append_vals(files, entry, 1);
+		g_ptr_array_add(paths, path);
+	}
+	g_dir_close(d);
+
+	g_array_sort(files, compare_mtime_desc);
+	gint64 total = 0;
+	for(guint i = 0; i < files->len; ++i)
+	{
+		gint64 *entry = (gint64 *)files->data + i * 3;
+		total += entry[2];
+		if(i > 0 && total > BACKGROUND_CACHE_MAX_BYTES)
+			g_unlink(g_ptr_array_index(paths, entry[1]));
+	}
+
+	g_array_unref(files);
+	g_ptr_array_unref(paths);
+}
+
+/*
+ * Worker thread. Returns the URI of a copy of the job's image scaled for the
+ * monitor, or the original URI if it doesn't need (or can't be) scaled.
+ */
+static void scale_thread(GTask *task, UNUSED gpointer source, gpointer taskData, UNUSED GCancellable *cancellable)
+{
+	ScaleJob *job = taskData;
+	gchar *path = g_filename_from_uri(job->uri, NULL, NULL);
+	GStatBuf st;
+	gint srcW = 0, srcH = 0;
+	if(!path || g_stat(path, &st) != 0 || !gdk_pixbuf_get_file_info(path, &srcW, &srcH) || srcW <= 0 || srcH <= 0)
+	{
+		g_free(path);
+		g_task_return_pointer(task, g_strdup(job->uri), g_free);
+		return;
+	}
+
+	// Size to scale the whole image to, and the part of that to keep
+	gint scaledW = srcW, scaledH = srcH;
+	gdouble sx = (gdouble)job->width / srcW, sy = (gdouble)job->height / srcH;
+	if(job->style == G_DESKTOP_BACKGROUND_STYLE_ZOOM && MAX(sx, sy) < 1)
+	{
+		scaledW = MAX(job->width, (gint)ceil(srcW * MAX(sx, sy)));
+		scaledH = MAX(job->height, (gint)ceil(srcH * MAX(sx, sy)));
+	}
+	else if(job->style == G_DESKTOP_BACKGROUND_STYLE_SCALED && MIN(sx, sy) < 1)
+	{
+		scaledW = MAX(1, (gint)round(srcW * MIN(sx, sy)));
+		scaledH = MAX(1, (gint)round(srcH * MIN(sx, sy)));
+	}
+	else if(job->style == G_DESKTOP_BACKGROUND_STYLE_STRETCHED && (sx < 1 || sy < 1))
+	{
+		scaledW = MIN(srcW, job->width);
+		scaledH = MIN(srcH, job->height);
+	}
+	gint cropW = MIN(scaledW, job->width), cropH = MIN(scaledH, job->height);
+
+	if(cropW == srcW && cropH == srcH)
+	{
+		// Already no larger than the monitor
+		g_free(path);
+		g_task_return_pointer(task, g_strdup(job->uri), g_free);
+		return;
+	}
+
+	gchar *dir = get_cache_dir();
+	gchar *id = g_strdup_printf("%s\n%" G_GINT64_FORMAT "\n%i\n%i\n%i", path, (gint64)st.st_mtime, job->style, job->width, job->height);
+	gchar *hash = g_compute_checksum_for_string(G_CHECKSUM_SHA1, id, -1);
+	gchar *basePath = g_build_filename(dir, hash, NULL);
+	g_free(id);
+	g_free(hash);
+
+	// Opaque wallpapers are cached as JPEG, the rest as PNG
+	gchar *cachePath = g_strconcat(basePath, ".jpg", NULL);
+	if(!g_file_test(cachePath, G_FILE_TEST_IS_REGULAR))
+	{
+		g_free(cachePath);
+		cachePath = g_strconcat(basePath, ".png", NULL);
+	}
+
+	if(g_file_test(cachePath, G_FILE_TEST_IS_REGULAR))
+	{
+		// Mark as recently used for prune_cache
+		g_utime(cachePath, NULL);
+	}
+	else
+	{
+		GError *error = NULL;
+		GdkPixbuf *scaled = gdk_pixbuf_new_from_file_at_scale(path, scaledW, scaledH, FALSE, &error);
+		GdkPixbuf *cropped = NULL;
+		if(scaled)
+			cropped = gdk_pixbuf_new_subpixbuf(scaled,
+				(gdk_pixbuf_get_width(scaled) - cropW) / 2,
+				(gdk_pixbuf_get_height(scaled) - cropH) / 2,
+				cropW, cropH);
+
+		// A screenful of pixels is tens of megabytes as a fast-compressed
+		// PNG, but a fraction of that as JPEG at a quality that's hard to
+		// tell from the original
+		gboolean opaque = cropped && !gdk_pixbuf_get_has_alpha(cropped);
+		g_free(cachePath);
+		cachePath = g_strconcat(basePath, opaque ? ".jpg" : ".png", NULL);
+
+		// Write to a temporary file first so that a half-written image
+		// never ends up in the cache
+		gchar *tmpPath = g_strconcat(cachePath, ".tmp", NULL);
+		gboolean saved = cropped
+			&& g_mkdir_with_parents(dir, 0700) == 0
+			&& (opaque
+				? gdk_pixbuf_save(cropped, tmpPath, "jpeg", &error, "quality", BACKGROUND_JPEG_QUALITY, NULL)
+				: gdk_pixbuf_save(cropped, tmpPath, "png", &error, NULL))
+			&& g_rename(tmpPath, cachePath) == 0;
+
+		if(!saved)
+		{
+			g_warning("Failed to scale wallpaper '%s': %s", path, error ? error->message : "could not write cache");
+			g_unlink(tmpPath);
+			g_clear_pointer(&cachePath, g_free);
+		}
+		g_clear_error(&error);
+		g_free(tmpPath);
+		g_clear_object(&cropped);
+		g_clear_object(&scaled);
+		if(saved)
+			prune_cache(dir);
+	}
+
+	gchar *uri = cachePath ? g_filename_to_uri(cachePath, NULL, NULL) : NULL;
+	g_task_return_pointer(task, uri ? uri : g_strdup(job->uri), g_free);
+	g_free(cachePath);
+	g_free(basePath);
+	g_free(dir);
+	g_free(path);
+}
+
+static void scale_job_free(ScaleJob *job)
+{
+	g_free(job->uri);
+	g_free(job);
+}
+
+static MetaBackground * create_background(MetaScreen *screen, const gchar *imageURI)
+{
+	MetaBackground *background = meta_background_new(screen);
+
+	ClutterColor primaryColor = {255, 255, 255, 255};
+	ClutterColor secondaryColor = {255, 255, 255, 255};
+	gchar *primary = g_settings_get_string(settings, "primary-color");
+	gchar *secondary = g_settings_get_string(settings, "secondary-color");
+	clutter_color_from_string(&primaryColor, primary);
+	clutter_color_from_string(&secondaryColor, secondary);
+	g_free(primary);
+	g_free(secondary);
+	GDesktopBackgroundShading shading = g_settings_get_enum(settings, "color-shading-type");
+	meta_background_set_gradient(background, shading, &primaryColor, &secondaryColor);
+	
+	GDesktopBackgroundStyle style = g_settings_get_enum(settings, "picture-options");
+	GFile *imageFile = g_file_new_for_uri(imageURI);
+	meta_background_set_file(background, imageFile, style);
+	g_object_unref(imageFile);
+	return background;
+}
+
+static void on_scale_done(MetaScreen *screen, GAsyncResult *res, gchar *key)
+{
+	gchar *imageURI = g_task_propagate_pointer(G_TASK(res), NULL);
+	g_hash_table_remove(pendingScales, key);
+
+	// Settings may have changed while scaling, in which case nobody wants
+	// this wallpaper anymore
+	gboolean wanted = FALSE;
+	for(GList *it = instances; it != NULL; it = it->next)
+		wanted = wanted || g_strcmp0(GRAPHENE_WM_BACKGROUND(it->data)->wantedKey, key) == 0;
+
+	if(wanted && imageURI)
+	{
+		g_hash_table_insert(backgroundCache, g_strdup(key), create_background(screen, imageURI));
+		for(GList *it = instances; it != NULL; it = it->next)
+			if(g_strcmp0(GRAPHENE_WM_BACKGROUND(it->data)->wantedKey, key) == 0)
+				update(GRAPHENE_WM_BACKGROUND(it->data));
+	}
+
+	g_free(imageURI);
+	g_free(key);
+}
+
+/*
+ * Returns the (unowned) MetaBackground for the current settings and the
+ * background's monitor size, or NULL if it's still being prepared. In that
+ * case update() gets called again once it's ready.
+ */
+static MetaBackground * get_background(GrapheneWMBackground *self)
+{
+	if(!currentKey)
+		currentKey = build_key();
+
+	GDesktopBackgroundStyle style = g_settings_get_enum(settings, "picture-options");
+	MetaRectangle rect = meta_rect(0,0,0,0);
+	meta_screen_get_monitor_geometry(self->screen, self->monitor, &rect);
+
+	g_free(self->wantedKey);
+	if(style_is_scalable(style))
+		self->wantedKey = g_strdup_printf("%s\n%ix%i", currentKey, rect.width, rect.height);
+	else
+		self->wantedKey = g_strdup(currentKey);
+
+	MetaBackground *background = g_hash_table_lookup(backgroundCache, self->wantedKey);
+	if(background)
+		return background;
+
+	gchar *imageURI = g_settings_get_string(settings, "picture-uri");
+	if(!style_is_scalable(style) || !imageURI || !*imageURI)
+	{
+		background = create_background(self->screen, imageURI);
+		g_hash_table_insert(backgroundCache, g_strdup(self->wantedKey), background);
+		g_free(imageURI);
+		return background;
+	}
+
+	if(!g_hash_table_contains(pendingScales, self->wantedKey))
+	{
+		g_hash_table_add(pendingScales, g_strdup(self->wantedKey));
+
+		ScaleJob *job = g_new0(ScaleJob, 1);
+		job->uri = g_strdup(imageURI);
+		job->style = style;
+		job->width = rect.width;
+		job->height = rect.height;
+
+		GTask *task = g_task_new(self->screen, NULL, (GAsyncReadyCallback)on_scale_done, g_strdup(self->wantedKey));
+		g_task_set_task_data(task, job, (GDestroyNotify)scale_job_free);
+		g_task_run_in_thread(task, scale_thread);
+		g_object_unref(task);
+	}
+	g_free(imageURI);
+	return NULL;
+}
+
+static gboolean on_update_timeout(UNUSED gpointer userdata)
+{
+	updateSourceId = 0;
+
+	gchar *key = build_key();
+	if(g_strcmp0(key, currentKey) == 0)
+	{
+		g_free(key);
+		return G_SOURCE_REMOVE;
+	}
+	g_free(currentKey);
+	currentKey = key;
+
+	// Monitors still showing or fading from the old wallpaper keep their
+	// own refs to it
+	g_hash_table_remove_all(backgroundCache);
+	for(GList *it = instances; it != NULL; it = it->next)
+		update(GRAPHENE_WM_BACKGROUND(it->data));
+	return G_SOURCE_REMOVE;
+}
+
+static void on_settings_changed(UNUSED GSettings *settings_, const gchar *key)
+{
+	if(!g_strv_contains(relevantKeys, key) || updateSourceId)
+		return;
+	updateSourceId = g_timeout_add(BACKGROUND_UPDATE_DELAY, on_update_timeout, NULL);
+}
+
+static void init_shared(void)
+{
+	if(settings)
+		return;
+	settings = g_settings_new(BACKGROUND_SETTINGS_SCHEMA);
+	g_signal_connect(settings, "changed", G_CALLBACK(on_settings_changed), NULL);
+	backgroundCache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_object_unref);
+	pendingScales = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+}
+
 static void update_done(ClutterActor *newActor, GrapheneWMBackground *self)
 {
 	clutter_actor_remove_all_transitions(newActor);
 	clutter_actor_set_opacity(newActor, 255);
-	g_signal_handlers_disconnect_by_func(newActor, update_done, NULL);
+	g_signal_handlers_disconnect_by_func(newActor, update_done, self);
 
 	if(self->actor)
 		clutter_actor_remove_child(CLUTTER_ACTOR(self), CLUTTER_ACTOR(self->actor));
 	self->actor = META_BACKGROUND_ACTOR(newActor);
 }
 
-static void update(GrapheneWMBackground *self)
+static ClutterActor * create_actor(GrapheneWMBackground *self, MetaBackground *background)
 {
-	ClutterActor *newActor = meta_background_actor_new(self->screen, self->monitor);
-	MetaBackground *newBackground = meta_background_new(self->screen);
-	meta_background_actor_set_background(META_BACKGROUND_ACTOR(newActor), newBackground);
-	
+	ClutterActor *actor = meta_background_actor_new(self->screen, self->monitor);
+	meta_background_actor_set_background(META_BACKGROUND_ACTOR(actor), background);
+
 	MetaRectangle rect = meta_rect(0,0,0,0);
 	meta_screen_get_monitor_geometry(self->screen, self->monitor, &rect);
 	
-	clutter_actor_set_position(newActor, rect.x, rect.y);
-	clutter_actor_set_size(newActor, rect.width, rect.height);
+	clutter_actor_set_position(actor, rect.x, rect.y);
+	clutter_actor_set_size(actor, rect.width, rect.height);
+	return actor;
+}
+
+/*
+ * Moves the background to a different monitor index, or updates it after
+ * its monitor was resized or moved. The current wallpaper is reused without
+ * fading until one scaled for the new size is ready.
+ */
+void graphene_wm_background_set_monitor(GrapheneWMBackground *self, guint monitor)
+{
+	g_return_if_fail(GRAPHENE_IS_WM_BACKGROUND(self));
+	self->monitor = monitor;
+	if(self->background)
+	{
+		// Also cuts short any crossfade in progress
+		clutter_actor_destroy_all_children(CLUTTER_ACTOR(self));
+		ClutterActor *actor = create_actor(self, self->background);
+		clutter_actor_insert_child_at_index(CLUTTER_ACTOR(self), actor, -1);
+		clutter_actor_show(actor);
+		self->actor = META_BACKGROUND_ACTOR(actor);
+	}
+
+	// A monitor of a different size needs a differently scaled wallpaper,
+	// which fades in once it's ready
+	update(self);
+}
+
+static void update(GrapheneWMBackground *self)
+{
+	MetaBackground *newBackground = get_background(self);
+	if(!newBackground || newBackground == self->background)
+		return;
+
+	ClutterActor *newActor = create_actor(self, newBackground);
+	g_clear_object(&self->background);
+	self->background = g_object_ref(newBackground);
+
 	clutter_actor_set_opacity(newActor, 0);
 	clutter_actor_insert_child_at_index(CLUTTER_ACTOR(self), newActor, -1);
 	
-	ClutterColor *primaryColor = clutter_color_new(255, 255, 255, 255);
-	ClutterColor *secondaryColor = clutter_color_new(255, 255, 255, 255);
-	clutter_color_from_string(primaryColor, g_settings_get_string(self->settings, "primary-color"));
-	clutter_color_from_string(secondaryColor, g_settings_get_string(self->settings, "secondary-color"));
-	GDesktopBackgroundShading shading = g_settings_get_enum(self->settings, "color-shading-type");
-	meta_background_set_gradient(newBackground, shading, primaryColor, secondaryColor);
-	
-	char *imageURI = g_settings_get_string(self->settings, "picture-uri");
-	GDesktopBackgroundStyle style = g_settings_get_enum(self->settings, "picture-options");
-	GFile *imageFile = g_file_new_for_uri(imageURI);
-	meta_background_set_file(newBackground, imageFile, style);
-	g_object_unref(imageFile);
-	g_free(imageURI);
-	
 	clutter_actor_show(newActor);
 	g_signal_connect(newActor, "transitions_completed", G_CALLBACK(update_done), self);
 	clutter_actor_save_easing_state(newActor);
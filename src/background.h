@@ -33,6 +33,7 @@ G_BEGIN_DECLS
 G_DECLARE_FINAL_TYPE(GrapheneWMBackground, graphene_wm_background, GRAPHENE, WM_BACKGROUND, ClutterActor)
 
 GrapheneWMBackground * graphene_wm_background_new(MetaScreen *screen, guint monitor);
+void graphene_wm_background_set_monitor(GrapheneWMBackground *background, guint monitor);
 
 G_END_DECLS
 
@@ -17,12 +17,18 @@
 
 #include <glib/gprintf.h>
 #include <sys/wait.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <session-dbus-iface.h>
 #include "client.h"
 #include "util.h"
 
 #define CLIENT_OBJECT_PATH "/org/gnome/SessionManager/Client"
 #define MAX_RESTARTS 5
+#define RESOURCE_SAMPLE_COUNT 8 // Number of samples kept per client
+
+typedef DBusIoVeltSessionManagerClientResources DBusClientResources;
 
 typedef struct
 {
@@ -31,6 +37,13 @@ typedef struct
 	guint flags;
 } Inhibition;
 
+typedef struct
+{
+	gint64 time; // Monotonic time of the sample in microseconds
+	guint64 cpuTicks; // utime + stime from /proc/<pid>/stat, in clock ticks
+	guint64 rss; // Resident set size in bytes
+} ResourceSample;
+
 struct _GrapheneSessionClient
 {
 	GObject parent;
@@ -73,6 +86,14 @@ struct _GrapheneSessionClient
 	gboolean alive, ready, failed, complete;
 
 	GArray *inhibitions;
+
+	// Resource accounting (see graphene_session_client_sample_resources)
+	ResourceSample samples[RESOURCE_SAMPLE_COUNT]; // Ring buffer, samples[sampleHead] is the next slot
+	guint sampleHead, sampleCount;
+	GPid samplePid; // Process the samples belong to
+	gdouble cpuUsage, peakCpuUsage; // Percent of one core
+	guint64 peakRss;
+	DBusClientResources *dbusResourcesSkeleton;
 };
 
 enum
@@ -569,6 +590,7 @@ void graphene_session_client_register(GrapheneSessionClient *self, const gchar *
 	
 	self->dbusClientSkeleton = dbus_session_manager_client_skeleton_new();
 	self->dbusPClientSkeleton = dbus_session_manager_client_private_skeleton_new();
+	self->dbusResourcesSkeleton = dbus_io_velt_session_manager_client_resources_skeleton_new();
 	connect_dbus_methods(self);
 	
 	if(!self->connection)
@@ -603,6 +625,13 @@ void graphene_session_client_register(GrapheneSessionClient *self, const gchar *
 		return;
 	}
 
+	// Resource info is only informational, so failing to export it isn't fatal
+	if(!g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(self->dbusResourcesSkeleton), self->connection, self->objectPath, &error))
+	{
+		g_warning("Failed to export resource info for client '%s': %s", graphene_session_client_get_best_name(self), error->message);
+		g_clear_error(&error);
+	}
+
 	if(!self->processId && self->dbusName)
 	{
 		GVariant *vpid = g_dbus_connection_call_sync(self->connection,
@@ -662,6 +691,10 @@ static void graphene_session_client_unregister_internal(GrapheneSessionClient *s
 		g_dbus_interface_skeleton_unexport(G_DBUS_INTERFACE_SKELETON(self->dbusPClientSkeleton));
 	g_clear_object(&self->dbusPClientSkeleton);
 
+	if(self->connection && self->dbusResourcesSkeleton && g_dbus_interface_skeleton_get_connection(G_DBUS_INTERFACE_SKELETON(self->dbusResourcesSkeleton)) != NULL)
+		g_dbus_interface_skeleton_unexport(G_DBUS_INTERFACE_SKELETON(self->dbusResourcesSkeleton));
+	g_clear_object(&self->dbusResourcesSkeleton);
+
 	g_clear_pointer(&self->objectPath, g_free);
 	g_clear_pointer(&self->appId, g_free);
 	g_clear_pointer(&self->dbusName, g_free);
@@ -723,6 +756,7 @@ static void destroy_client_info(GrapheneSessionClient *self)
 		g_source_remove(self->childWatchId);
 	self->childWatchId = 0;
 	self->processId = 0;
+	self->sampleCount = 0;
 	set_alive(self, FALSE);
 }
  
@@ -974,6 +1008,126 @@ gboolean graphene_session_client_get_is_complete(GrapheneSessionClient *self)
 
 
 
+/*
+ * Resource accounting
+ */
+
+/*
+ * Reads /proc/<pid>/<name> into buf (NUL-terminated). Uses a plain read
+ * into a stack buffer since this runs for every client on every sample.
+ */
+static gboolean read_proc_file(GPid pid, const gchar *name, gchar *buf, gsize size)
+{
+	gchar path[64];
+	g_snprintf(path, sizeof(path), "/proc/%i/%s", pid, name);
+	gint fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return FALSE;
+	gssize n = read(fd, buf, size - 1);
+	close(fd);
+	if(n <= 0)
+		return FALSE;
+	buf[n] = '\0';
+	return TRUE;
+}
+
+static gboolean read_process_sample(GPid pid, ResourceSample *sample)
+{
+	gchar buf[1024];
+
+	// The process name (field 2) is in parentheses and may contain spaces,
+	// so start after the last ')'. utime and stime are fields 14 and 15.
+	if(!read_proc_file(pid, "stat", buf, sizeof(buf)))
+		return FALSE;
+	gchar *field = strrchr(buf, ')');
+	if(!field)
+		return FALSE;
+	for(guint i=2;i<14 && field;++i)
+		field = strchr(field + 1, ' ');
+	if(!field)
+		return FALSE;
+	gchar *end = NULL;
+	guint64 utime = g_ascii_strtoull(field, &end, 10);
+	guint64 stime = g_ascii_strtoull(end, NULL, 10);
+	sample->cpuTicks = utime + stime;
+
+	// statm: size resident shared ... (in pages)
+	if(!read_proc_file(pid, "statm", buf, sizeof(buf)))
+		return FALSE;
+	g_ascii_strtoull(buf, &end, 10);
+	sample->rss = g_ascii_strtoull(end, NULL, 10) * (guint64)sysconf(_SC_PAGESIZE);
+	return TRUE;
+}
+
+/*
+ * Takes a CPU time and resident memory sample of the client's process and
+ * updates the client's ClientResources DBus properties. Current CPU usage is
+ * averaged over the samples in the ring; peaks are kept for the lifetime of
+ * the process. Does nothing if the client has no known process.
+ */
+void graphene_session_client_sample_resources(GrapheneSessionClient *self)
+{
+	g_return_if_fail(GRAPHENE_IS_SESSION_CLIENT(self));
+	if(!self->processId)
+		return;
+
+	if(self->samplePid != self->processId)
+	{
+		self->samplePid = self->processId;
+		self->sampleCount = 0;
+	}
+	if(self->sampleCount == 0)
+	{
+		self->sampleHead = 0;
+		self->cpuUsage = self->peakCpuUsage = 0;
+		self->peakRss = 0;
+	}
+
+	ResourceSample sample = {g_get_monotonic_time(), 0, 0};
+	if(!read_process_sample(self->processId, &sample))
+		return;
+
+	static gdouble ticksPerSec = 0;
+	if(ticksPerSec <= 0)
+		ticksPerSec = sysconf(_SC_CLK_TCK);
+
+	if(self->sampleCount > 0)
+	{
+		// Usage over the most recent interval, for the peak
+		ResourceSample *prev = &self->samples[(self->sampleHead + RESOURCE_SAMPLE_COUNT - 1) % RESOURCE_SAMPLE_COUNT];
+		gint64 elapsed = sample.time - prev->time;
+		if(elapsed > 0 && sample.cpuTicks >= prev->cpuTicks)
+		{
+			gdouble usage = (sample.cpuTicks - prev->cpuTicks) / ticksPerSec * G_USEC_PER_SEC / elapsed * 100;
+			self->peakCpuUsage = MAX(self->peakCpuUsage, usage);
+		}
+
+		// Usage over the whole ring, for the current value
+		guint oldestIndex = (self->sampleCount < RESOURCE_SAMPLE_COUNT) ? 0 : self->sampleHead;
+		ResourceSample *oldest = &self->samples[oldestIndex];
+		elapsed = sample.time - oldest->time;
+		if(elapsed > 0 && sample.cpuTicks >= oldest->cpuTicks)
+			self->cpuUsage = (sample.cpuTicks - oldest->cpuTicks) / ticksPerSec * G_USEC_PER_SEC / elapsed * 100;
+	}
+
+	self->samples[self->sampleHead] = sample;
+	self->sampleHead = (self->sampleHead + 1) % RESOURCE_SAMPLE_COUNT;
+	if(self->sampleCount < RESOURCE_SAMPLE_COUNT)
+		self->sampleCount++;
+	self->peakRss = MAX(self->peakRss, sample.rss);
+
+	// The generated setters only emit PropertiesChanged for values that changed
+	if(self->dbusResourcesSkeleton)
+	{
+		dbus_io_velt_session_manager_client_resources_set_cpu_usage(self->dbusResourcesSkeleton, self->cpuUsage);
+		dbus_io_velt_session_manager_client_resources_set_peak_cpu_usage(self->dbusResourcesSkeleton, self->peakCpuUsage);
+		dbus_io_velt_session_manager_client_resources_set_resident_memory(self->dbusResourcesSkeleton, sample.rss);
+		dbus_io_velt_session_manager_client_resources_set_peak_resident_memory(self->dbusResourcesSkeleton, self->peakRss);
+	}
+}
+
+
+
 /*
  * Other DBus Commands
  */
@@ -1105,3 +1259,12 @@ gboolean graphene_session_client_is_inhibited(GrapheneSessionClient *self)
 	g_return_val_if_fail(GRAPHENE_IS_SESSION_CLIENT(self), FALSE);
 	return self->inhibitions->len > 0;
 }
+
+guint graphene_session_client_get_inhibited_flags(GrapheneSessionClient *self)
+{
+	g_return_val_if_fail(GRAPHENE_IS_SESSION_CLIENT(self), 0);
+	guint flags = 0;
+	for(guint i=0;i<self->inhibitions->len;++i)
+		flags |= g_array_index(self->inhibitions, Inhibition, i).flags;
+	return flags;
+}
@@ -98,6 +98,14 @@ gboolean      graphene_session_client_get_is_complete(GrapheneSessionClient *sel
 guint graphene_session_client_add_inhibition(GrapheneSessionClient *self, const gchar *reason, guint flags);
 void graphene_session_client_remove_inhibition(GrapheneSessionClient *self, guint cookie);
 gboolean graphene_session_client_is_inhibited(GrapheneSessionClient *self);
+guint graphene_session_client_get_inhibited_flags(GrapheneSessionClient *self); // All inhibition flags OR'd together
+
+/*
+ * Samples the CPU time and resident memory of the client's process from
+ * /proc. Call periodically; the results are exposed as properties of the
+ * io.velt.SessionManager.ClientResources interface on the client's object.
+ */
+void graphene_session_client_sample_resources(GrapheneSessionClient *self);
 
 G_END_DECLS
 
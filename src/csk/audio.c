@@ -5,11 +5,23 @@
  */
 
 #include "audio.h"
+#include "../util.h"
 #include <pulse/pulseaudio.h>
 #include <pulse/glib-mainloop.h>
+#include <pulse/thread-mainloop.h>
+#include <math.h>
 
 #define MAX_DEVICE_NAME_LENGTH 75 // These include NULL terminator
 #define MAX_DEVICE_DESCRIPTION_LENGTH 100
+#define DEVICE_TYPE_COUNT (CSK_AUDIO_DEVICE_TYPE_INPUT_CLIENT + 1)
+#define PEAK_RATE 25 // Hz, peaks PulseAudio sends for metering
+#define PEAK_RING_SIZE 32
+#define PEAK_NOTIFY_INTERVAL 16 // ms, about one frame
+#define PENDING_FLUSH_INTERVAL 16 // ms, about one frame
+
+#ifndef GRAPHENE_DEBUG
+#define GRAPHENE_DEBUG FALSE
+#endif
 
 struct _CskAudioDevice
 {
@@ -22,11 +34,33 @@ struct _CskAudioDevice
 	char *name;
 	char *hname; // "human readable" name
 	char *description;
+	char *iconName;
 	float volume;
 	float balance;
 	gboolean mute;
 
 	pa_cvolume cvolume;
+
+	// Changes requested by the user that PulseAudio hasn't reported back
+	// yet. At most one operation of each kind is sent at a time; newer
+	// requests replace whatever is waiting to be sent after it.
+	float targetVolume; // Negative if none
+	gint targetMute; // Negative if none
+	pa_operation *volumeOp;
+	pa_operation *muteOp;
+	gboolean volumeQueued;
+	gboolean muteQueued;
+
+	// Peak meter. The ring is filled by the stream's read callback and
+	// drained on the main loop, at most once per PEAK_NOTIFY_INTERVAL.
+	char *monitorName; // Source to record for output devices
+	guint peakListeners;
+	pa_stream *peakStream;
+	float peakRing[PEAK_RING_SIZE];
+	gint peakHead; // Written only by the producer
+	gint peakTail; // Written only by the consumer
+	gint peakDrainScheduled;
+	float peak;
 };
 
 struct _CskAudioDeviceManager
@@ -35,26 +69,59 @@ struct _CskAudioDeviceManager
 
 	pa_proplist *contextProps;
 	pa_glib_mainloop *mainloop;
+	pa_threaded_mainloop *threadedMainloop; // Used instead of mainloop if CSK_AUDIO_THREADED is set
 	pa_mainloop_api *mainloopAPI;
   	pa_context *context;
 	gboolean ready;
+
+	// With the threaded mainloop, updates from the PulseAudio thread are
+	// collected here and applied on the main loop about once per frame.
+	GMutex pendingLock;
+	GHashTable *pendingDevices; // gint64 (type, index) to DeviceSnapshot *
+	gboolean pendingServer;
+	char *pendingSinkName;
+	char *pendingSourceName;
+	guint flushSourceId;
 	
-	GList *devices;
+	// Per device type. PulseAudio indices and names are only unique
+	// within sinks or sources, and each change event comes with an index.
+	GHashTable *devicesByIndex[DEVICE_TYPE_COUNT]; // guint32 to CskAudioDevice *, owns a ref
+	GHashTable *devicesByName[DEVICE_TYPE_COUNT]; // PulseAudio name to CskAudioDevice *
+	GList *deviceList; // Built on demand for csk_audio_device_manager_get_devices
 	char *defaultSinkName;
 	char *defaultSourceName;
-	CskAudioDevice *defaultOutput; // Pointers to items in devices list,
+	CskAudioDevice *defaultOutput; // Pointers to registered devices,
 	CskAudioDevice *defaultInput;  // may be NULL.
 };
 
+/*
+ * With the threaded mainloop, PulseAudio objects may only be used from
+ * other threads while holding its lock. Without it these do nothing.
+ * The lock is recursive.
+ */
+static void manager_lock(CskAudioDeviceManager *manager)
+{
+	if(manager && manager->threadedMainloop)
+		pa_threaded_mainloop_lock(manager->threadedMainloop);
+}
+
+static void manager_unlock(CskAudioDeviceManager *manager)
+{
+	if(manager && manager->threadedMainloop)
+		pa_threaded_mainloop_unlock(manager->threadedMainloop);
+}
+
 enum
 {
 	PROP_TYPE = 1,
 	PROP_NAME,
 	PROP_DESCRIPTION,
+	PROP_ICON_NAME,
 	PROP_VOLUME,
 	PROP_BALANCE,
 	PROP_MUTED,
 	PROP_IS_DEFAULT_DEVICE,
+	PROP_PEAK,
 	PROPD_LAST
 };
 
@@ -74,23 +141,58 @@ static void csk_audio_device_class_init(CskAudioDeviceClass *class)
 	propertiesD[PROP_TYPE] = g_param_spec_int("type", "type", "type", 0, 4, 0, G_PARAM_READABLE);
 	propertiesD[PROP_NAME] = g_param_spec_string("name", "name", "name", NULL, G_PARAM_READABLE);
 	propertiesD[PROP_DESCRIPTION] = g_param_spec_string("description", "description", "description", NULL, G_PARAM_READABLE);
+	propertiesD[PROP_ICON_NAME] = g_param_spec_string("icon-name", "icon name", "icon name", NULL, G_PARAM_READABLE);
 	propertiesD[PROP_VOLUME] = g_param_spec_float("volume", "volume", "volume", 0, 2, 0, G_PARAM_READABLE);
 	propertiesD[PROP_BALANCE] = g_param_spec_float("balance", "balance", "balance", -1, 1, 0, G_PARAM_READABLE);
 	propertiesD[PROP_MUTED] = g_param_spec_boolean("muted", "muted", "muted", FALSE, G_PARAM_READABLE);
 	propertiesD[PROP_IS_DEFAULT_DEVICE] = g_param_spec_boolean("is-default-device", "is default device", "is default device", FALSE, G_PARAM_READABLE);
+	propertiesD[PROP_PEAK] = g_param_spec_float("peak", "peak", "peak level while watched", 0, 1, 0, G_PARAM_READABLE);
 	g_object_class_install_properties(base, PROPD_LAST, propertiesD);
 }
 
-static void csk_audio_device_init(UNUSED CskAudioDevice *self)
+static void csk_audio_device_init(CskAudioDevice *self)
 {
+	self->targetVolume = -1;
+	self->targetMute = -1;
 }
 
+/*
+ * Drops all requested changes, for when the device is going away. Cancelled
+ * operations don't call their callbacks.
+ */
+static void device_cancel_operations(CskAudioDevice *device)
+{
+	manager_lock(device->manager);
+	if(device->volumeOp)
+	{
+		pa_operation_cancel(device->volumeOp);
+		pa_operation_unref(device->volumeOp);
+		device->volumeOp = NULL;
+	}
+	if(device->muteOp)
+	{
+		pa_operation_cancel(device->muteOp);
+		pa_operation_unref(device->muteOp);
+		device->muteOp = NULL;
+	}
+	manager_unlock(device->manager);
+	device->volumeQueued = device->muteQueued = FALSE;
+	device->targetVolume = -1;
+	device->targetMute = -1;
+}
+
+static void device_stop_peak_stream(CskAudioDevice *device);
+
 static void csk_audio_device_dispose(GObject *self_)
 {
 	CskAudioDevice *self = CSK_AUDIO_DEVICE(self_);
+	device_cancel_operations(self);
+	device_stop_peak_stream(self);
+	g_clear_pointer(&self->monitorName, g_free);
 	g_free(self->name);
 	g_free(self->hname);
 	g_free(self->description);
+	g_clear_pointer(&self->iconName, g_free);
 	self->name = NULL;
 	self->hname = NULL;
 	self->description = NULL;
@@ -115,6 +217,9 @@ static void csk_audio_device_get_property(GObject *self_, guint propertyId, GVal
 	case PROP_DESCRIPTION:
 		g_value_set_string(value, csk_audio_device_get_description(self));
 		break;
+	case PROP_ICON_NAME:
+		g_value_set_string(value, csk_audio_device_get_icon_name(self));
+		break;
 	case PROP_VOLUME:
 		g_value_set_float(value, csk_audio_device_get_volume(self));
 		break;
@@ -127,6 +232,9 @@ static void csk_audio_device_get_property(GObject *self_, guint propertyId, GVal
 	case PROP_IS_DEFAULT_DEVICE:
 		g_value_set_boolean(value, csk_audio_device_is_default(self));
 		break;
+	case PROP_PEAK:
+		g_value_set_float(value, csk_audio_device_get_peak(self));
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID(self, propertyId, pspec);
 		break;
@@ -158,11 +266,117 @@ const char * csk_audio_device_get_description(CskAudioDevice *device)
 	return device->description;
 }
 
+const char * csk_audio_device_get_icon_name(CskAudioDevice *device)
+{
+	g_return_val_if_fail(CSK_IS_AUDIO_DEVICE(device), NULL);
+	g_return_val_if_fail(audio_device_valid(device), NULL);
+	return device->iconName;
+}
+
 float csk_audio_device_get_volume(CskAudioDevice *device)
 {
 	g_return_val_if_fail(CSK_IS_AUDIO_DEVICE(device), 0);
 	g_return_val_if_fail(audio_device_valid(device), 0);
-	return device->volume;
+	return (device->targetVolume >= 0) ? device->targetVolume : device->volume;
+}
+
+/*
+ * Operation callbacks run on the PulseAudio thread when it's used, so
+ * they're passed on to the main loop along with the operation that finished.
+ * This always goes through an idle source: g_main_context_invoke would run
+ * them right here whenever the main thread isn't inside the main loop.
+ */
+typedef void (*OpFinishedFunc)(CskAudioDevice *device, pa_operation *op, gboolean success);
+
+typedef struct
+{
+	CskAudioDevice *device;
+	pa_operation *op;
+	gboolean success;
+	OpFinishedFunc func;
+} OpFinished;
+
+static gboolean op_finished_main(OpFinished *data)
+{
+	data->func(data->device, data->op, data->success);
+	return G_SOURCE_REMOVE;
+}
+
+static void op_finished_free(OpFinished *data)
+{
+	CskAudioDeviceManager *manager = data->device->manager;
+	manager_lock(manager);
+	pa_operation_unref(data->op);
+	manager_unlock(manager);
+	g_object_unref(data->device);
+	g_free(data);
+}
+
+static void device_op_done(CskAudioDevice *device, pa_operation *op, gboolean success, OpFinishedFunc func)
+{
+	if(!device->manager->threadedMainloop)
+	{
+		func(device, op, success);
+		return;
+	}
+
+	OpFinished *data = g_new(OpFinished, 1);
+	data->device = g_object_ref(device);
+	data->op = pa_operation_ref(op);
+	data->success = success;
+	data->func = func;
+	g_idle_add_full(G_PRIORITY_DEFAULT, (GSourceFunc)op_finished_main, data, (GDestroyNotify)op_finished_free);
+}
+
+static void device_send_volume(CskAudioDevice *device);
+
+static void device_volume_op_finished(CskAudioDevice *device, pa_operation *op, gboolean success)
+{
+	// It may have been cancelled, and another sent, in the meantime
+	if(op != device->volumeOp)
+		return;
+	manager_lock(device->manager);
+	pa_operation_unref(device->volumeOp);
+	device->volumeOp = NULL;
+	manager_unlock(device->manager);
+	if(device->volumeQueued)
+		device_send_volume(device);
+	else if(!success)
+	{
+		// No new volume is coming from PulseAudio, so stop reporting
+		// the one that failed
+		device->targetVolume = -1;
+		g_object_notify_by_pspec(G_OBJECT(device), propertiesD[PROP_VOLUME]);
+	}
+	// Otherwise targetVolume stays until PulseAudio sends the new volume
+}
+
+static void on_device_volume_op_done(UNUSED pa_context *context, int success, CskAudioDevice *device)
+{
+	device_op_done(device, device->volumeOp, success, device_volume_op_finished);
+}
+
+static void device_send_volume(CskAudioDevice *device)
+{
+	pa_volume_t newVol = (pa_volume_t)(device->targetVolume * (PA_VOLUME_NORM - PA_VOLUME_MUTED) + PA_VOLUME_MUTED);
+	pa_cvolume cvolume = device->cvolume;
+	pa_cvolume_scale(&cvolume, newVol);
+
+	manager_lock(device->manager);
+	pa_context *context = device->manager->context;
+	pa_context_success_cb_t cb = (pa_context_success_cb_t)on_device_volume_op_done;
+	if(device->type == CSK_AUDIO_DEVICE_TYPE_OUTPUT)
+		device->volumeOp = pa_context_set_sink_volume_by_index(context, device->index, &cvolume, cb, device);
+	else if(device->type == CSK_AUDIO_DEVICE_TYPE_INPUT)
+		device->volumeOp = pa_context_set_source_volume_by_index(context, device->index, &cvolume, cb, device);
+	else if(device->type == CSK_AUDIO_DEVICE_TYPE_OUTPUT_CLIENT)
+		device->volumeOp = pa_context_set_sink_input_volume(context, device->index, &cvolume, cb, device);
+	else if(device->type == CSK_AUDIO_DEVICE_TYPE_INPUT_CLIENT)
+		device->volumeOp = pa_context_set_source_output_volume(context, device->index, &cvolume, cb, device);
+	manager_unlock(device->manager);
+	device->volumeQueued = FALSE;
+	if(!device->volumeOp)
+		device->targetVolume = -1;
 }
 
 void csk_audio_device_set_volume(CskAudioDevice *device, float volume)
@@ -171,11 +385,16 @@ void csk_audio_device_set_volume(CskAudioDevice *device, float volume)
 	g_return_if_fail(CSK_IS_AUDIO_DEVICE_MANAGER(device->manager));
 	g_return_if_fail(audio_device_valid(device));
 
-	pa_volume_t newVol = (pa_volume_t)(volume * (PA_VOLUME_NORM - PA_VOLUME_MUTED) + PA_VOLUME_MUTED);
-	pa_cvolume_scale(&device->cvolume, newVol);
-	pa_operation *o = pa_context_set_sink_volume_by_index(device->manager->context, device->index, &device->cvolume, NULL, NULL);
-	//gboolean success = (o != NULL);
-	if(o) pa_operation_unref(o);
+	volume = MAX(volume, 0);
+	if(volume == csk_audio_device_get_volume(device))
+		return;
+
+	device->targetVolume = volume;
+	if(device->volumeOp)
+		device->volumeQueued = TRUE;
+	else
+		device_send_volume(device);
+	g_object_notify_by_pspec(G_OBJECT(device), propertiesD[PROP_VOLUME]);
 }
 
 float csk_audio_device_get_balance(CskAudioDevice *device)
@@ -196,7 +415,50 @@ gboolean csk_audio_device_get_muted(CskAudioDevice *device)
 {
 	g_return_val_if_fail(CSK_IS_AUDIO_DEVICE(device), FALSE);
 	g_return_val_if_fail(audio_device_valid(device), FALSE);
-	return device->mute;
+	return (device->targetMute >= 0) ? device->targetMute : device->mute;
+}
+
+static void device_send_mute(CskAudioDevice *device);
+
+static void device_mute_op_finished(CskAudioDevice *device, pa_operation *op, gboolean success)
+{
+	if(op != device->muteOp)
+		return;
+	manager_lock(device->manager);
+	pa_operation_unref(device->muteOp);
+	device->muteOp = NULL;
+	manager_unlock(device->manager);
+	if(device->muteQueued)
+		device_send_mute(device);
+	else if(!success)
+	{
+		device->targetMute = -1;
+		g_object_notify_by_pspec(G_OBJECT(device), propertiesD[PROP_MUTED]);
+	}
+}
+
+static void on_device_mute_op_done(UNUSED pa_context *context, int success, CskAudioDevice *device)
+{
+	device_op_done(device, device->muteOp, success, device_mute_op_finished);
+}
+
+static void device_send_mute(CskAudioDevice *device)
+{
+	manager_lock(device->manager);
+	pa_context *context = device->manager->context;
+	pa_context_success_cb_t cb = (pa_context_success_cb_t)on_device_mute_op_done;
+	if(device->type == CSK_AUDIO_DEVICE_TYPE_OUTPUT)
+		device->muteOp = pa_context_set_sink_mute_by_index(context, device->index, device->targetMute, cb, device);
+	else if(device->type == CSK_AUDIO_DEVICE_TYPE_INPUT)
+		device->muteOp = pa_context_set_source_mute_by_index(context, device->index, device->targetMute, cb, device);
+	else if(device->type == CSK_AUDIO_DEVICE_TYPE_OUTPUT_CLIENT)
+		device->muteOp = pa_context_set_sink_input_mute(context, device->index, device->targetMute, cb, device);
+	else if(device->type == CSK_AUDIO_DEVICE_TYPE_INPUT_CLIENT)
+		device->muteOp = pa_context_set_source_output_mute(context, device->index, device->targetMute, cb, device);
+	manager_unlock(device->manager);
+	device->muteQueued = FALSE;
+	if(!device->muteOp)
+		device->targetMute = -1;
 }
 
 void csk_audio_device_set_muted(CskAudioDevice *device, gboolean muted)
@@ -205,9 +467,17 @@ void csk_audio_device_set_muted(CskAudioDevice *device, gboolean muted)
 	g_return_if_fail(CSK_IS_AUDIO_DEVICE_MANAGER(device->manager));
 	g_return_if_fail(audio_device_valid(device));
 
-	pa_operation *o = pa_context_set_sink_mute_by_index(device->manager->context, device->index, muted, NULL, NULL);
-	//gboolean success = (o != NULL);
-	if(o) pa_operation_unref(o);
+	// Volume keys unmute on every press, which is usually a no-op
+	muted = !!muted;
+	if(muted == csk_audio_device_get_muted(device))
+		return;
+
+	device->targetMute = muted;
+	if(device->muteOp)
+		device->muteQueued = TRUE;
+	else
+		device_send_mute(device);
+	g_object_notify_by_pspec(G_OBJECT(device), propertiesD[PROP_MUTED]);
 }
 
 gboolean csk_audio_device_is_default(CskAudioDevice *device)
@@ -231,6 +501,154 @@ gboolean csk_audio_device_set_default(CskAudioDevice *device)
 }
 
 
+/*
+ * Peak metering
+ *
+ * PulseAudio does the peak detection itself (PA_STREAM_PEAK_DETECT), and
+ * sends a single peak value PEAK_RATE times per second. The read callback
+ * only passes these on through a single-producer single-consumer ring, so
+ * it doesn't matter which thread PulseAudio calls it from.
+ */
+
+static gboolean peak_ring_push(CskAudioDevice *device, float value)
+{
+	gint head = g_atomic_int_get(&device->peakHead);
+	gint next = (head + 1) % PEAK_RING_SIZE;
+	if(next == g_atomic_int_get(&device->peakTail))
+		return FALSE; // Full, the UI isn't keeping up
+	device->peakRing[head] = value;
+	g_atomic_int_set(&device->peakHead, next);
+	return TRUE;
+}
+
+static gboolean peak_ring_pop(CskAudioDevice *device, float *value)
+{
+	gint tail = g_atomic_int_get(&device->peakTail);
+	if(tail == g_atomic_int_get(&device->peakHead))
+		return FALSE;
+	*value = device->peakRing[tail];
+	g_atomic_int_set(&device->peakTail, (tail + 1) % PEAK_RING_SIZE);
+	return TRUE;
+}
+
+static gboolean on_peak_drain(CskAudioDevice *device)
+{
+	g_atomic_int_set(&device->peakDrainScheduled, 0);
+
+	float peak = -1, value;
+	while(peak_ring_pop(device, &value))
+		peak = MAX(peak, value);
+
+	if(peak >= 0 && device->peakStream && peak != device->peak)
+	{
+		device->peak = peak;
+		g_object_notify_by_pspec(G_OBJECT(device), propertiesD[PROP_PEAK]);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+static void on_peak_stream_read(pa_stream *stream, size_t length, CskAudioDevice *device)
+{
+	const void *data;
+	if(pa_stream_peek(stream, &data, &length) < 0)
+		return;
+
+	// data is NULL if there's a hole in the stream
+	if(data && length >= sizeof(float))
+	{
+		const float *samples = data;
+		float peak = 0;
+		for(size_t i = 0; i < length / sizeof(float); ++i)
+			peak = MAX(peak, fabsf(samples[i]));
+		peak_ring_push(device, MIN(peak, 1));
+	}
+	if(length)
+		pa_stream_drop(stream);
+
+	if(g_atomic_int_compare_and_exchange(&device->peakDrainScheduled, 0, 1))
+		g_timeout_add_full(G_PRIORITY_DEFAULT, PEAK_NOTIFY_INTERVAL,
+			(GSourceFunc)on_peak_drain, g_object_ref(device), g_object_unref);
+}
+
+static void device_start_peak_stream(CskAudioDevice *device)
+{
+	const char *source = NULL;
+	if(device->type == CSK_AUDIO_DEVICE_TYPE_OUTPUT)
+		source = device->monitorName;
+	else if(device->type == CSK_AUDIO_DEVICE_TYPE_INPUT)
+		source = device->name;
+	if(!source || !device->manager->ready)
+		return;
+
+	pa_sample_spec spec = {
+		.format = PA_SAMPLE_FLOAT32NE,
+		.rate = PEAK_RATE,
+		.channels = 1
+	};
+	pa_buffer_attr attr = {
+		.maxlength = (uint32_t)-1,
+		.fragsize = sizeof(float)
+	};
+
+	manager_lock(device->manager);
+	device->peakStream = pa_stream_new(device->manager->context, "Peak detect", &spec, NULL);
+	if(device->peakStream)
+	{
+		pa_stream_set_read_callback(device->peakStream, (pa_stream_request_cb_t)on_peak_stream_read, device);
+		if(pa_stream_connect_record(device->peakStream, source, &attr,
+			PA_STREAM_DONT_MOVE | PA_STREAM_PEAK_DETECT | PA_STREAM_ADJUST_LATENCY | PA_STREAM_DONT_INHIBIT_AUTO_SUSPEND) < 0)
+		{
+			g_warning("Failed to start peak detection on '%s'", source);
+			device_stop_peak_stream(device);
+		}
+	}
+	manager_unlock(device->manager);
+}
+
+static void device_stop_peak_stream(CskAudioDevice *device)
+{
+	if(!device->peakStream)
+		return;
+	manager_lock(device->manager);
+	pa_stream_set_read_callback(device->peakStream, NULL, NULL);
+	pa_stream_disconnect(device->peakStream);
+	pa_stream_unref(device->peakStream);
+	device->peakStream = NULL;
+	manager_unlock(device->manager);
+
+	// Nothing writes to the ring anymore
+	g_atomic_int_set(&device->peakHead, 0);
+	g_atomic_int_set(&device->peakTail, 0);
+	if(device->peak != 0)
+	{
+		device->peak = 0;
+		g_object_notify_by_pspec(G_OBJECT(device), propertiesD[PROP_PEAK]);
+	}
+}
+
+void csk_audio_device_watch_peak(CskAudioDevice *device)
+{
+	g_return_if_fail(CSK_IS_AUDIO_DEVICE(device));
+	g_return_if_fail(audio_device_valid(device));
+	if(device->peakListeners++ == 0)
+		device_start_peak_stream(device);
+}
+
+void csk_audio_device_unwatch_peak(CskAudioDevice *device)
+{
+	g_return_if_fail(CSK_IS_AUDIO_DEVICE(device));
+	g_return_if_fail(device->peakListeners > 0);
+	if(--device->peakListeners == 0)
+		device_stop_peak_stream(device);
+}
+
+float csk_audio_device_get_peak(CskAudioDevice *device)
+{
+	g_return_val_if_fail(CSK_IS_AUDIO_DEVICE(device), 0);
+	return device->peak;
+}
+
+
 
 enum
 {
@@ -243,14 +661,33 @@ enum
 enum
 {
 	SIGNAL_DEVICE_ADDED = 1,
-	SIGNAL_DEVICE_REMOVED = 1,
+	SIGNAL_DEVICE_REMOVED,
 	SIGNAL_LAST
 };
 
 static GParamSpec *propertiesM[PROP_LAST];
 static guint signalsM[SIGNAL_LAST];
 
+// A copy of everything the PulseAudio thread learned about a device, or
+// that it was removed
+typedef struct
+{
+	gint64 key; // Type and index
+	CskAudioDeviceType type;
+	guint32 index;
+	gboolean removed;
+	char *name;
+	char *hname;
+	char *monitorName;
+	char *activePortDescription;
+	pa_proplist *proplist;
+	pa_cvolume volume;
+	pa_channel_map channelMap;
+	gboolean mute;
+} DeviceSnapshot;
+
 static void csk_audio_device_manager_dispose(GObject *self_);
+static void csk_audio_device_manager_finalize(GObject *self_);
 static void csk_audio_device_manager_get_property(GObject *self_, guint propertyId, GValue *value, GParamSpec *pspec);
 static void unref_all_devices(CskAudioDeviceManager *self);
 static void on_manager_pa_state_change(pa_context *context, CskAudioDeviceManager *self);
@@ -258,7 +695,18 @@ static void on_manager_pa_event(pa_context *context, pa_subscription_event_type_
 static void on_manager_server_get_info(pa_context *context, const pa_server_info *server, CskAudioDeviceManager *self);
 static void on_manager_sink_get_info(pa_context *context, const pa_sink_info *sink, int eol, CskAudioDeviceManager *self);
 static void on_manager_source_get_info(pa_context *context, const pa_source_info *source, int eol, CskAudioDeviceManager *self);
+static void on_manager_sink_input_get_info(pa_context *context, const pa_sink_input_info *input, int eol, CskAudioDeviceManager *self);
+static void on_manager_source_output_get_info(pa_context *context, const pa_source_output_info *output, int eol, CskAudioDeviceManager *self);
 static CskAudioDevice * get_device(CskAudioDeviceManager *self, guint32 index, CskAudioDeviceType type, gboolean create, gboolean *created);
+static void snapshot_free(DeviceSnapshot *snapshot);
+static void queue_snapshot(CskAudioDeviceManager *self, DeviceSnapshot *snapshot);
+static void queue_server_info(CskAudioDeviceManager *self, const char *sinkName, const char *sourceName);
+static void clear_pending(CskAudioDeviceManager *self);
+#if GRAPHENE_DEBUG
+static void event_stats_received(CskAudioDeviceType type, guint32 index);
+static void event_stats_applied(CskAudioDeviceType type, guint32 index, gint64 start);
+static void log_event_stats(void);
+#endif
 
 G_DEFINE_TYPE(CskAudioDeviceManager, csk_audio_device_manager, G_TYPE_OBJECT)
 
@@ -275,6 +723,7 @@ static void csk_audio_device_manager_class_init(CskAudioDeviceManagerClass *clas
 {
 	GObjectClass *base = G_OBJECT_CLASS(class);
 	base->dispose = csk_audio_device_manager_dispose;
+	base->finalize = csk_audio_device_manager_finalize;
 	base->get_property = csk_audio_device_manager_get_property;
 
 	propertiesM[PROP_READY] = g_param_spec_boolean("ready", "ready", "ready", FALSE, G_PARAM_READABLE);
@@ -288,14 +737,34 @@ static void csk_audio_device_manager_class_init(CskAudioDeviceManagerClass *clas
 
 static void csk_audio_device_manager_init(CskAudioDeviceManager *self)
 {
+	for(guint i = 0; i < DEVICE_TYPE_COUNT; ++i)
+	{
+		self->devicesByIndex[i] = g_hash_table_new(g_direct_hash, g_direct_equal);
+		self->devicesByName[i] = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	}
+
+	g_mutex_init(&self->pendingLock);
+	self->pendingDevices = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, (GDestroyNotify)snapshot_free);
+
 	self->contextProps = pa_proplist_new();
 	//pa_proplist_sets(proplist, PA_PROP_APPLICATION_NAME, "graphene-window-manager");
 	// pa_proplist_sets(proplist, PA_PROP_APPLICATION_ID, g_application_get_application_id(g_application_get_default()));
 	//pa_proplist_sets(proplist, PA_PROP_APPLICATION_ICON_NAME, "multimedia-volume-control-symbolic");
 	//pa_proplist_sets(proplist, PA_PROP_APPLICATION_VERSION, WM_VERSION_STRING);
 	
-	self->mainloop = pa_glib_mainloop_new(g_main_context_default());
-	self->mainloopAPI = pa_glib_mainloop_get_api(self->mainloop);
+	// Optionally keep PulseAudio's event processing off the main loop, for
+	// systems where bursts of device changes would cost frames
+	const gchar *threaded = g_getenv("CSK_AUDIO_THREADED");
+	if(threaded && *threaded && g_strcmp0(threaded, "0") != 0)
+	{
+		self->threadedMainloop = pa_threaded_mainloop_new();
+		self->mainloopAPI = pa_threaded_mainloop_get_api(self->threadedMainloop);
+	}
+	else
+	{
+		self->mainloop = pa_glib_mainloop_new(g_main_context_default());
+		self->mainloopAPI = pa_glib_mainloop_get_api(self->mainloop);
+	}
 	self->context = pa_context_new_with_proplist(self->mainloopAPI, NULL, self->contextProps);
 	
 	pa_context_set_state_callback(self->context, (pa_context_notify_cb_t)on_manager_pa_state_change, self);
@@ -304,18 +773,40 @@ static void csk_audio_device_manager_init(CskAudioDeviceManager *self)
 	// NOFAIL: Instead of failing if the PulseAudio daemon is unavailable, enter
 	// the "connecting" state and wait for it to appear.
 	pa_context_connect(self->context, NULL, PA_CONTEXT_NOFAIL, NULL);
+
+	if(self->threadedMainloop)
+		pa_threaded_mainloop_start(self->threadedMainloop);
 }
 
 static void csk_audio_device_manager_dispose(GObject *self_)
 {
 	CskAudioDeviceManager *self = CSK_AUDIO_DEVICE_MANAGER(self_);
-	
-	unref_all_devices(self);
+
+#if GRAPHENE_DEBUG
+	log_event_stats();
+#endif
 
 	if(self->context)
 	{
+		manager_lock(self);
 		pa_context_set_subscribe_callback(self->context, NULL, NULL);
 		pa_context_set_state_callback(self->context, NULL, NULL);
+		manager_unlock(self);
+	}
+	
+	unref_all_devices(self);
+	for(guint i = 0; i < DEVICE_TYPE_COUNT; ++i)
+	{
+		g_clear_pointer(&self->devicesByIndex[i], g_hash_table_unref);
+		g_clear_pointer(&self->devicesByName[i], g_hash_table_unref);
+	}
+
+	// After this, nothing else touches the context or the pending updates
+	if(self->threadedMainloop)
+		pa_threaded_mainloop_stop(self->threadedMainloop);
+
+	if(self->context)
+	{
 		pa_context_disconnect(self->context);
 		pa_context_unref(self->context);
 		self->context = NULL;
@@ -327,6 +818,19 @@ static void csk_audio_device_manager_dispose(GObject *self_)
 		self->mainloop = NULL;
 	}
 
+	if(self->threadedMainloop)
+	{
+		pa_threaded_mainloop_free(self->threadedMainloop);
+		self->threadedMainloop = NULL;
+	}
+
+	if(self->flushSourceId)
+		g_source_remove(self->flushSourceId);
+	self->flushSourceId = 0;
+	g_clear_pointer(&self->pendingDevices, g_hash_table_unref);
+	g_clear_pointer(&self->pendingSinkName, g_free);
+	g_clear_pointer(&self->pendingSourceName, g_free);
+
 	if(self->contextProps)
 	{
 		pa_proplist_free(self->contextProps);
@@ -343,6 +847,12 @@ static void csk_audio_device_manager_dispose(GObject *self_)
 	G_OBJECT_CLASS(csk_audio_device_manager_parent_class)->dispose(self_);
 }
 
+static void csk_audio_device_manager_finalize(GObject *self_)
+{
+	g_mutex_clear(&CSK_AUDIO_DEVICE_MANAGER(self_)->pendingLock);
+	G_OBJECT_CLASS(csk_audio_device_manager_parent_class)->finalize(self_);
+}
+
 static void csk_audio_device_manager_get_property(GObject *self_, guint propertyId, GValue *value, GParamSpec *pspec)
 {
 	CskAudioDeviceManager *self = CSK_AUDIO_DEVICE_MANAGER(self_);
@@ -382,23 +892,77 @@ CskAudioDevice * csk_audio_device_manager_get_default_input(CskAudioDeviceManage
 	return self->defaultInput;
 }
 
-static void unref_all_devices(CskAudioDeviceManager *self)
+GList * csk_audio_device_manager_get_devices(CskAudioDeviceManager *self)
 {
-	for(GList *it=self->devices; it!=NULL; it=self->devices)
-	{
-		CskAudioDevice *device = CSK_AUDIO_DEVICE(it->data);
+	g_return_val_if_fail(CSK_IS_AUDIO_DEVICE_MANAGER(self), NULL);
+	if(!self->deviceList && self->devicesByIndex[0])
+		for(guint i = 0; i < DEVICE_TYPE_COUNT; ++i)
+			self->deviceList = g_list_concat(self->deviceList, g_hash_table_get_values(self->devicesByIndex[i]));
+	return self->deviceList;
+}
 
-		device->type = CSK_AUDIO_DEVICE_TYPE_INVALID;
-		self->devices = g_list_delete_link(self->devices, it);
+static void set_default_device(CskAudioDeviceManager *self, CskAudioDevice **field, CskAudioDevice *device, guint propertyId)
+{
+	CskAudioDevice *prev = *field;
+	if(prev == device)
+		return;
+	*field = device;
+	if(prev)
+		g_object_notify_by_pspec(G_OBJECT(prev), propertiesD[PROP_IS_DEFAULT_DEVICE]);
+	if(device)
+		g_object_notify_by_pspec(G_OBJECT(device), propertiesD[PROP_IS_DEFAULT_DEVICE]);
+	g_object_notify_by_pspec(G_OBJECT(self), propertiesM[propertyId]);
+}
+
+static void update_default_devices(CskAudioDeviceManager *self)
+{
+	CskAudioDevice *output = NULL, *input = NULL;
+	if(self->defaultSinkName)
+		output = g_hash_table_lookup(self->devicesByName[CSK_AUDIO_DEVICE_TYPE_OUTPUT], self->defaultSinkName);
+	if(self->defaultSourceName)
+		input = g_hash_table_lookup(self->devicesByName[CSK_AUDIO_DEVICE_TYPE_INPUT], self->defaultSourceName);
+	set_default_device(self, &self->defaultOutput, output, PROP_DEFAULT_OUTPUT);
+	set_default_device(self, &self->defaultInput, input, PROP_DEFAULT_INPUT);
+}
+
+static void remove_device(CskAudioDeviceManager *self, CskAudioDevice *device)
+{
+#if GRAPHENE_DEBUG
+	gint64 start = g_get_monotonic_time();
+#endif
+	CskAudioDeviceType type = device->type;
+	guint32 index = device->index;
+	g_hash_table_remove(self->devicesByIndex[type], GUINT_TO_POINTER(index));
+	if(device->name && g_hash_table_lookup(self->devicesByName[type], device->name) == device)
+		g_hash_table_remove(self->devicesByName[type], device->name);
+	g_clear_pointer(&self->deviceList, g_list_free);
+
+	if(self->defaultOutput == device)
+		set_default_device(self, &self->defaultOutput, NULL, PROP_DEFAULT_OUTPUT);
+	if(self->defaultInput == device)
+		set_default_device(self, &self->defaultInput, NULL, PROP_DEFAULT_INPUT);
+
+	device_cancel_operations(device);
+	device_stop_peak_stream(device);
+	device->type = CSK_AUDIO_DEVICE_TYPE_INVALID;
+	g_object_notify_by_pspec(G_OBJECT(device), propertiesD[PROP_TYPE]);
+	g_signal_emit(self, signalsM[SIGNAL_DEVICE_REMOVED], 0, device);
+	g_object_unref(device);
+#if GRAPHENE_DEBUG
+	event_stats_applied(type, index, start);
+#endif
+}
 
-		g_object_notify_by_pspec(G_OBJECT(device), propertiesD[PROP_TYPE]);
-		g_signal_emit(self, signalsM[SIGNAL_DEVICE_REMOVED], 0, device);
-		g_object_unref(device);
-		
-		if(self->defaultOutput == device)
-			self->defaultOutput = NULL;
-		if(self->defaultInput == device)
-			self->defaultInput = NULL;
+static void unref_all_devices(CskAudioDeviceManager *self)
+{
+	for(guint i = 0; i < DEVICE_TYPE_COUNT; ++i)
+	{
+		if(!self->devicesByIndex[i])
+			continue;
+		GList *devices = g_hash_table_get_values(self->devicesByIndex[i]);
+		for(GList *it = devices; it != NULL; it = it->next)
+			remove_device(self, CSK_AUDIO_DEVICE(it->data));
+		g_list_free(devices);
 	}
 }
 
@@ -407,6 +971,7 @@ static gboolean reconnect(CskAudioDeviceManager *self)
 	g_return_val_if_fail(CSK_IS_AUDIO_DEVICE_MANAGER(self), G_SOURCE_REMOVE);
 	unref_all_devices(self);
 
+	manager_lock(self);
 	if(self->context)
 	{
 		pa_context_set_subscribe_callback(self->context, NULL, NULL);
@@ -415,28 +980,32 @@ static gboolean reconnect(CskAudioDeviceManager *self)
 		pa_context_unref(self->context);
 		self->context = NULL;
 	}
+	clear_pending(self);
 
 	self->context = pa_context_new_with_proplist(self->mainloopAPI, NULL, self->contextProps);
 	
 	pa_context_set_state_callback(self->context, (pa_context_notify_cb_t)on_manager_pa_state_change, self);
 	pa_context_set_subscribe_callback(self->context, (pa_context_subscribe_cb_t)on_manager_pa_event, self);
 	pa_context_connect(self->context, NULL, PA_CONTEXT_NOFAIL, NULL);
+	manager_unlock(self);
 
 	return G_SOURCE_REMOVE;
 }
 
-static void on_manager_pa_state_change(pa_context *context, CskAudioDeviceManager *self)
+static gboolean manager_update_state(CskAudioDeviceManager *self)
 {
 	gboolean prevReady = self->ready;
 
-	int state = pa_context_get_state(context);
+	manager_lock(self);
+	int state = pa_context_get_state(self->context);
 	switch(state)
 	{
 	case PA_CONTEXT_READY:
 	{
 		pa_operation *o = pa_context_subscribe(
 			self->context,
-			PA_SUBSCRIPTION_MASK_SINK | PA_SUBSCRIPTION_MASK_SOURCE | PA_SUBSCRIPTION_MASK_SERVER,
+			PA_SUBSCRIPTION_MASK_SINK | PA_SUBSCRIPTION_MASK_SOURCE | PA_SUBSCRIPTION_MASK_SERVER
+				| PA_SUBSCRIPTION_MASK_SINK_INPUT | PA_SUBSCRIPTION_MASK_SOURCE_OUTPUT,
 			NULL, NULL);
 		if(o) pa_operation_unref(o);
 		o = pa_context_get_server_info(self->context,
@@ -451,6 +1020,17 @@ static void on_manager_pa_state_change(pa_context *context, CskAudioDeviceManage
 			(pa_source_info_cb_t)on_manager_source_get_info,
 			self);
 		if(o) pa_operation_unref(o);
+		// Streams are only listed once; after that they're tracked by
+		// index from subscription events
+		o = pa_context_get_sink_input_info_list(self->context,
+			(pa_sink_input_info_cb_t)on_manager_sink_input_get_info,
+			self);
+		if(o) pa_operation_unref(o);
+		o = pa_context_get_source_output_info_list(self->context,
+			(pa_source_output_info_cb_t)on_manager_source_output_get_info,
+			self);
+		if(o) pa_operation_unref(o);
+		manager_unlock(self);
 
 		self->ready = TRUE;
 		break;
@@ -458,7 +1038,9 @@ static void on_manager_pa_state_change(pa_context *context, CskAudioDeviceManage
 	case PA_CONTEXT_FAILED:
 		// Failed state?
 	default:
+		manager_unlock(self);
 		self->ready = FALSE;
+		clear_pending(self);
 		unref_all_devices(self);
 		// Reconnect
 		if(state == PA_CONTEXT_FAILED)
@@ -468,13 +1050,45 @@ static void on_manager_pa_state_change(pa_context *context, CskAudioDeviceManage
 
 	if(self->ready != prevReady)
 		g_object_notify_by_pspec(G_OBJECT(self), propertiesM[PROP_READY]);
+	return G_SOURCE_REMOVE;
+}
+
+static void on_manager_pa_state_change(UNUSED pa_context *context, CskAudioDeviceManager *self)
+{
+	if(self->threadedMainloop)
+		g_idle_add_full(G_PRIORITY_DEFAULT, (GSourceFunc)manager_update_state, g_object_ref(self), g_object_unref);
+	else
+		manager_update_state(self);
+}
+
+static CskAudioDeviceType facility_device_type(pa_subscription_event_type_t facility)
+{
+	switch(facility)
+	{
+	case PA_SUBSCRIPTION_EVENT_SINK:
+		return CSK_AUDIO_DEVICE_TYPE_OUTPUT;
+	case PA_SUBSCRIPTION_EVENT_SOURCE:
+		return CSK_AUDIO_DEVICE_TYPE_INPUT;
+	case PA_SUBSCRIPTION_EVENT_SINK_INPUT:
+		return CSK_AUDIO_DEVICE_TYPE_OUTPUT_CLIENT;
+	case PA_SUBSCRIPTION_EVENT_SOURCE_OUTPUT:
+		return CSK_AUDIO_DEVICE_TYPE_INPUT_CLIENT;
+	default:
+		return CSK_AUDIO_DEVICE_TYPE_INVALID;
+	}
 }
 
 static void on_manager_pa_event(UNUSED pa_context *context, pa_subscription_event_type_t type, uint32_t index, CskAudioDeviceManager *self)
 {
 	pa_subscription_event_type_t eFacility = (type & PA_SUBSCRIPTION_EVENT_FACILITY_MASK);
 	pa_subscription_event_type_t eType = (type & PA_SUBSCRIPTION_EVENT_TYPE_MASK);
+	CskAudioDeviceType dt = facility_device_type(eFacility);
 	pa_operation *o = NULL;
+
+#if GRAPHENE_DEBUG
+	if(dt != CSK_AUDIO_DEVICE_TYPE_INVALID)
+		event_stats_received(dt, index);
+#endif
 	
 	if(eFacility == PA_SUBSCRIPTION_EVENT_SERVER)
 	{
@@ -486,30 +1100,26 @@ static void on_manager_pa_event(UNUSED pa_context *context, pa_subscription_even
 			o = pa_context_get_sink_info_by_index(self->context, index, (pa_sink_info_cb_t)on_manager_sink_get_info, self);
 		else if(eFacility == PA_SUBSCRIPTION_EVENT_SOURCE)
 			o = pa_context_get_source_info_by_index(self->context, index, (pa_source_info_cb_t)on_manager_source_get_info, self);
+		else if(eFacility == PA_SUBSCRIPTION_EVENT_SINK_INPUT)
+			o = pa_context_get_sink_input_info(self->context, index, (pa_sink_input_info_cb_t)on_manager_sink_input_get_info, self);
+		else if(eFacility == PA_SUBSCRIPTION_EVENT_SOURCE_OUTPUT)
+			o = pa_context_get_source_output_info(self->context, index, (pa_source_output_info_cb_t)on_manager_source_output_get_info, self);
 	}
 	else if(eType == PA_SUBSCRIPTION_EVENT_REMOVE)
 	{
-		CskAudioDeviceType dt = CSK_AUDIO_DEVICE_TYPE_INVALID;
-		if(eFacility == PA_SUBSCRIPTION_EVENT_SINK)
-			dt = CSK_AUDIO_DEVICE_TYPE_OUTPUT;
-		else if(eFacility == PA_SUBSCRIPTION_EVENT_SOURCE)
-			dt = CSK_AUDIO_DEVICE_TYPE_INPUT;
-
-		if(dt != CSK_AUDIO_DEVICE_TYPE_INVALID)
+		if(dt != CSK_AUDIO_DEVICE_TYPE_INVALID && self->threadedMainloop)
+		{
+			DeviceSnapshot *snapshot = g_new0(DeviceSnapshot, 1);
+			snapshot->type = dt;
+			snapshot->index = index;
+			snapshot->removed = TRUE;
+			queue_snapshot(self, snapshot);
+		}
+		else if(dt != CSK_AUDIO_DEVICE_TYPE_INVALID)
 		{
 			CskAudioDevice *device = get_device(self, index, dt, FALSE, NULL);
 			if(device)
-			{
-				device->type = CSK_AUDIO_DEVICE_TYPE_INVALID;
-				self->devices = g_list_remove(self->devices, device);
-				g_object_notify_by_pspec(G_OBJECT(device), propertiesD[PROP_TYPE]);
-				g_signal_emit(self, signalsM[SIGNAL_DEVICE_REMOVED], 0, device);
-				g_object_unref(device);
-				if(self->defaultOutput == device)
-					self->defaultOutput = NULL;
-				if(self->defaultInput == device)
-					self->defaultInput = NULL;
-			}
+				remove_device(self, device);
 		}
 	}
 
@@ -520,20 +1130,19 @@ static void on_manager_server_get_info(UNUSED pa_context *context, const pa_serv
 {
 	if(!server || !self)
 		return;
+
+	if(self->threadedMainloop)
+	{
+		queue_server_info(self, server->default_sink_name, server->default_source_name);
+		return;
+	}
 	
 	g_free(self->defaultSinkName);
 	g_free(self->defaultSourceName);
 	self->defaultSinkName = g_strdup(server->default_sink_name);
 	self->defaultSourceName = g_strdup(server->default_source_name);
 	
-	for(GList *it=self->devices; it!=NULL; it=it->next)
-	{
-		CskAudioDevice *device = CSK_AUDIO_DEVICE(it->data);
-		if(g_strcmp0(device->name, self->defaultSinkName))
-			self->defaultOutput = device;
-		else if(g_strcmp0(device->name, self->defaultSourceName))
-			self->defaultInput = device;
-	}
+	update_default_devices(self);
 
 	// todo: There aren't that many server updates, but refreshing all the sinks and sources each time might be too laggy
 	//       Avoid if possible
@@ -551,22 +1160,39 @@ static void manager_set_device_info(
 	gboolean created,
 	const char *name,
 	const char *hname,
+	const char *monitorName,
 	const char *activePortDescription,
 	pa_proplist *proplist,
 	pa_cvolume volume,
 	pa_channel_map channelMap,
 	gboolean mute)
 {
-	float prevVolume = device->volume;
+#if GRAPHENE_DEBUG
+	gint64 start = g_get_monotonic_time();
+#endif
+	float prevVolume = csk_audio_device_get_volume(device);
 	float prevBalance = device->balance;	
-	gboolean prevMute = device->mute;
+	gboolean prevMute = csk_audio_device_get_muted(device);
 	gboolean hnameChanged = FALSE;
 	gboolean descriptionChanged = FALSE;
 	
 	if(g_strcmp0(device->name, name) != 0)
 	{
+		// Stream names aren't unique, and are never looked up
+		gboolean client = (device->type == CSK_AUDIO_DEVICE_TYPE_OUTPUT_CLIENT || device->type == CSK_AUDIO_DEVICE_TYPE_INPUT_CLIENT);
+		GHashTable *byName = self->devicesByName[device->type];
+		if(!client && device->name && g_hash_table_lookup(byName, device->name) == device)
+			g_hash_table_remove(byName, device->name);
 		g_free(device->name);
 		device->name = g_strdup(name);
+		if(!client && name)
+			g_hash_table_insert(byName, g_strdup(name), device);
+	}
+
+	if(g_strcmp0(device->monitorName, monitorName) != 0)
+	{
+		g_free(device->monitorName);
+		device->monitorName = g_strdup(monitorName);
 	}
 
 	if(g_strcmp0(device->hname, hname) != 0)
@@ -591,15 +1217,35 @@ static void manager_set_device_info(
 		descriptionChanged = TRUE;
 	}
 
+	const char *iconName = NULL;
+	if(proplist && pa_proplist_contains(proplist, PA_PROP_APPLICATION_ICON_NAME))
+		iconName = pa_proplist_gets(proplist, PA_PROP_APPLICATION_ICON_NAME);
+	else if(proplist && pa_proplist_contains(proplist, PA_PROP_DEVICE_ICON_NAME))
+		iconName = pa_proplist_gets(proplist, PA_PROP_DEVICE_ICON_NAME);
+
+	gboolean iconNameChanged = FALSE;
+	if(g_strcmp0(device->iconName, iconName) != 0)
+	{
+		g_free(device->iconName);
+		device->iconName = g_strdup(iconName);
+		iconNameChanged = TRUE;
+	}
+
 	device->volume = ((float)(pa_cvolume_max(&volume) - PA_VOLUME_MUTED))/(PA_VOLUME_NORM - PA_VOLUME_MUTED);
 	device->balance = pa_cvolume_get_balance(&volume, &channelMap);
 	device->mute = mute;
 	device->cvolume = volume;
 
-	gboolean wasDefault = (self->defaultOutput == device);
-	if(g_strcmp0(device->name, self->defaultSinkName) == 0)
-		self->defaultOutput = device;
-	
+	// Once all requested changes have gone through, this is their result
+	if(!device->volumeOp && !device->volumeQueued)
+		device->targetVolume = -1;
+	if(!device->muteOp && !device->muteQueued)
+		device->targetMute = -1;
+
+	// Devices that were watched before the manager was ready
+	if(device->peakListeners && !device->peakStream)
+		device_start_peak_stream(device);
+
 	if(created)
 	{
 		g_signal_emit(self, signalsM[SIGNAL_DEVICE_ADDED], 0, device);
@@ -610,40 +1256,88 @@ static void manager_set_device_info(
 			g_object_notify_by_pspec(G_OBJECT(device), propertiesD[PROP_NAME]);
 		if(descriptionChanged)
 			g_object_notify_by_pspec(G_OBJECT(device), propertiesD[PROP_DESCRIPTION]);
-		if(prevVolume != device->volume)
+		if(iconNameChanged)
+			g_object_notify_by_pspec(G_OBJECT(device), propertiesD[PROP_ICON_NAME]);
+		if(prevVolume != csk_audio_device_get_volume(device))
 			g_object_notify_by_pspec(G_OBJECT(device), propertiesD[PROP_VOLUME]);
 		if(prevBalance != device->balance)
 			g_object_notify_by_pspec(G_OBJECT(device), propertiesD[PROP_BALANCE]);
-		if(prevMute != device->mute)
+		if(prevMute != csk_audio_device_get_muted(device))
 			g_object_notify_by_pspec(G_OBJECT(device), propertiesD[PROP_MUTED]);
-		if((self->defaultOutput == device) != wasDefault)
-			g_object_notify_by_pspec(G_OBJECT(device), propertiesD[PROP_IS_DEFAULT_DEVICE]);
 	}
 
-	if((self->defaultOutput == device) != wasDefault)
-		g_object_notify_by_pspec(G_OBJECT(self), propertiesM[PROP_DEFAULT_OUTPUT]);
+	// Also notifies is-default-device when it changes. Done after
+	// device-added, so that a new default is never announced before
+	// the device itself.
+	update_default_devices(self);
+
+#if GRAPHENE_DEBUG
+	event_stats_applied(device->type, device->index, start);
+#endif
 }
 
-static void on_manager_sink_get_info(UNUSED pa_context *context, const pa_sink_info *sink, UNUSED int eol, CskAudioDeviceManager *self)
+/*
+ * Applies new information about a device, or with the threaded mainloop,
+ * queues it to be applied on the main loop.
+ */
+static void manager_update_device(
+	CskAudioDeviceManager *self,
+	CskAudioDeviceType type,
+	guint32 index,
+	const char *name,
+	const char *hname,
+	const char *monitorName,
+	const char *activePortDescription,
+	pa_proplist *proplist,
+	pa_cvolume volume,
+	pa_channel_map channelMap,
+	gboolean mute)
 {
-	if(!sink || !self)
-		return; // When listing devices, a final NULL device will be sent (with eol = 1)
-  
-	gboolean created = FALSE;
-	CskAudioDevice *device = get_device(self, sink->index, CSK_AUDIO_DEVICE_TYPE_OUTPUT, TRUE, &created);
-
-	if(!device)
+	if(self->threadedMainloop)
 	{
-		g_warning("Could not find or create audio sink device.");
+		DeviceSnapshot *snapshot = g_new0(DeviceSnapshot, 1);
+		snapshot->type = type;
+		snapshot->index = index;
+		snapshot->name = g_strdup(name);
+		snapshot->hname = g_strdup(hname);
+		snapshot->monitorName = g_strdup(monitorName);
+		snapshot->activePortDescription = g_strdup(activePortDescription);
+		snapshot->proplist = proplist ? pa_proplist_copy(proplist) : NULL;
+		snapshot->volume = volume;
+		snapshot->channelMap = channelMap;
+		snapshot->mute = mute;
+		queue_snapshot(self, snapshot);
 		return;
 	}
-	
+
+	gboolean created = FALSE;
+	CskAudioDevice *device = get_device(self, index, type, TRUE, &created);
 	manager_set_device_info(
 		self,
 		device,
 		created,
+		name,
+		hname,
+		monitorName,
+		activePortDescription,
+		proplist,
+		volume,
+		channelMap,
+		mute);
+}
+
+static void on_manager_sink_get_info(UNUSED pa_context *context, const pa_sink_info *sink, UNUSED int eol, CskAudioDeviceManager *self)
+{
+	if(!sink || !self)
+		return; // When listing devices, a final NULL device will be sent (with eol = 1)
+	
+	manager_update_device(
+		self,
+		CSK_AUDIO_DEVICE_TYPE_OUTPUT,
+		sink->index,
 		sink->name,
 		sink->description,
+		sink->monitor_source_name,
 		sink->active_port ? sink->active_port->description : NULL,
 		sink->proplist,
 		sink->volume,
@@ -655,22 +1349,14 @@ static void on_manager_source_get_info(UNUSED pa_context *context, const pa_sour
 {
 	if(!source || !self)
 		return; // When listing devices, a final NULL device will be sent (with eol = 1)
-
-	gboolean created = FALSE;
-	CskAudioDevice *device = get_device(self, source->index, CSK_AUDIO_DEVICE_TYPE_INPUT, TRUE, &created);
-
-	if(!device)
-	{
-		g_warning("Could not find or create audio source device.");
-		return;
-	}
 	
-	manager_set_device_info(
+	manager_update_device(
 		self,
-		device,
-		created,
+		CSK_AUDIO_DEVICE_TYPE_INPUT,
+		source->index,
 		source->name,
 		source->description,
+		NULL,
 		source->active_port ? source->active_port->description : NULL,
 		source->proplist,
 		source->volume,
@@ -678,29 +1364,308 @@ static void on_manager_source_get_info(UNUSED pa_context *context, const pa_sour
 		source->mute);
 }
 
+/*
+ * Streams are shown as client "devices", named after the application that
+ * owns them and described by what they're playing or recording.
+ */
+static void manager_set_stream_info(
+	CskAudioDeviceManager *self,
+	guint32 index,
+	CskAudioDeviceType type,
+	const char *name,
+	pa_proplist *proplist,
+	pa_cvolume volume,
+	pa_channel_map channelMap,
+	gboolean mute)
+{
+	const char *hname = name;
+	if(proplist && pa_proplist_contains(proplist, PA_PROP_APPLICATION_NAME))
+		hname = pa_proplist_gets(proplist, PA_PROP_APPLICATION_NAME);
+	const char *mediaName = NULL;
+	if(proplist && pa_proplist_contains(proplist, PA_PROP_MEDIA_NAME))
+		mediaName = pa_proplist_gets(proplist, PA_PROP_MEDIA_NAME);
+
+	manager_update_device(
+		self,
+		type,
+		index,
+		name,
+		hname,
+		NULL,
+		mediaName,
+		proplist,
+		volume,
+		channelMap,
+		mute);
+}
+
+static void on_manager_sink_input_get_info(UNUSED pa_context *context, const pa_sink_input_info *input, UNUSED int eol, CskAudioDeviceManager *self)
+{
+	if(!input || !self)
+		return;
+
+	manager_set_stream_info(
+		self,
+		input->index,
+		CSK_AUDIO_DEVICE_TYPE_OUTPUT_CLIENT,
+		input->name,
+		input->proplist,
+		input->volume,
+		input->channel_map,
+		input->mute);
+}
+
+static void on_manager_source_output_get_info(UNUSED pa_context *context, const pa_source_output_info *output, UNUSED int eol, CskAudioDeviceManager *self)
+{
+	if(!output || !self)
+		return;
+
+	// Skip our own peak detection streams
+	if(output->client != PA_INVALID_INDEX && output->client == pa_context_get_index(self->context))
+		return;
+
+	manager_set_stream_info(
+		self,
+		output->index,
+		CSK_AUDIO_DEVICE_TYPE_INPUT_CLIENT,
+		output->name,
+		output->proplist,
+		output->volume,
+		output->channel_map,
+		output->mute);
+}
+
+/*
+ * Threaded mainloop updates. Only the latest snapshot of each device is
+ * kept, so a burst of events for one device is applied once.
+ */
+
+static void snapshot_free(DeviceSnapshot *snapshot)
+{
+	g_free(snapshot->name);
+	g_free(snapshot->hname);
+	g_free(snapshot->monitorName);
+	g_free(snapshot->activePortDescription);
+	if(snapshot->proplist)
+		pa_proplist_free(snapshot->proplist);
+	g_free(snapshot);
+}
+
+static gboolean flush_pending(CskAudioDeviceManager *self)
+{
+	g_mutex_lock(&self->pendingLock);
+	self->flushSourceId = 0;
+	GHashTable *devices = self->pendingDevices;
+	self->pendingDevices = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, (GDestroyNotify)snapshot_free);
+	gboolean server = self->pendingServer;
+	char *sinkName = self->pendingSinkName;
+	char *sourceName = self->pendingSourceName;
+	self->pendingServer = FALSE;
+	self->pendingSinkName = self->pendingSourceName = NULL;
+	g_mutex_unlock(&self->pendingLock);
+
+	GHashTableIter iter;
+	DeviceSnapshot *snapshot;
+	g_hash_table_iter_init(&iter, devices);
+	while(g_hash_table_iter_next(&iter, NULL, (gpointer *)&snapshot))
+	{
+		if(snapshot->removed)
+		{
+			CskAudioDevice *device = get_device(self, snapshot->index, snapshot->type, FALSE, NULL);
+			if(device)
+				remove_device(self, device);
+			continue;
+		}
+
+		gboolean created = FALSE;
+		CskAudioDevice *device = get_device(self, snapshot->index, snapshot->type, TRUE, &created);
+		manager_set_device_info(
+			self,
+			device,
+			created,
+			snapshot->name,
+			snapshot->hname,
+			snapshot->monitorName,
+			snapshot->activePortDescription,
+			snapshot->proplist,
+			snapshot->volume,
+			snapshot->channelMap,
+			snapshot->mute);
+	}
+	g_hash_table_unref(devices);
+
+	if(server)
+	{
+		g_free(self->defaultSinkName);
+		g_free(self->defaultSourceName);
+		self->defaultSinkName = sinkName;
+		self->defaultSourceName = sourceName;
+		update_default_devices(self);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+// Call with pendingLock held
+static void schedule_flush(CskAudioDeviceManager *self)
+{
+	if(!self->flushSourceId)
+		self->flushSourceId = g_timeout_add(PENDING_FLUSH_INTERVAL, (GSourceFunc)flush_pending, self);
+}
+
+static void queue_snapshot(CskAudioDeviceManager *self, DeviceSnapshot *snapshot)
+{
+	snapshot->key = ((gint64)snapshot->type << 32) | snapshot->index;
+	g_mutex_lock(&self->pendingLock);
+	g_hash_table_replace(self->pendingDevices, &snapshot->key, snapshot);
+	schedule_flush(self);
+	g_mutex_unlock(&self->pendingLock);
+}
+
+static void queue_server_info(CskAudioDeviceManager *self, const char *sinkName, const char *sourceName)
+{
+	g_mutex_lock(&self->pendingLock);
+	g_free(self->pendingSinkName);
+	g_free(self->pendingSourceName);
+	self->pendingSinkName = g_strdup(sinkName);
+	self->pendingSourceName = g_strdup(sourceName);
+	self->pendingServer = TRUE;
+	schedule_flush(self);
+	g_mutex_unlock(&self->pendingLock);
+}
+
+// Drops updates from a context that is going away
+static void clear_pending(CskAudioDeviceManager *self)
+{
+	g_mutex_lock(&self->pendingLock);
+	if(self->pendingDevices)
+		g_hash_table_remove_all(self->pendingDevices);
+	self->pendingServer = FALSE;
+	g_clear_pointer(&self->pendingSinkName, g_free);
+	g_clear_pointer(&self->pendingSourceName, g_free);
+	g_mutex_unlock(&self->pendingLock);
+}
+
 static CskAudioDevice * get_device(CskAudioDeviceManager *self, guint32 index, CskAudioDeviceType type, gboolean create, gboolean *created)
 {
 	if(created)
 		*created = FALSE;
 	
-	// Find an existing device
-	for(GList *it=self->devices; it!=NULL; it=it->next)
-	{
-		CskAudioDevice *device = CSK_AUDIO_DEVICE(it->data);
-		if(device->type == type && device->index == index)
-			return device;
-	}
-	
-	if(!create)
-		return NULL;
+	CskAudioDevice *device = g_hash_table_lookup(self->devicesByIndex[type], GUINT_TO_POINTER(index));
+	if(device || !create)
+		return device;
 	if(created)
 		*created = TRUE;
 	
-	CskAudioDevice *device = CSK_AUDIO_DEVICE(g_object_new(CSK_TYPE_AUDIO_DEVICE, NULL));
+	device = CSK_AUDIO_DEVICE(g_object_new(CSK_TYPE_AUDIO_DEVICE, NULL));
 	device->manager = self;
 	device->type = type;
 	device->index = index;
 	
-	self->devices = g_list_prepend(self->devices, device);
+	g_hash_table_insert(self->devicesByIndex[type], GUINT_TO_POINTER(index), device);
+	g_clear_pointer(&self->deviceList, g_list_free);
 	return device;
 }
+
+
+
+#if GRAPHENE_DEBUG
+/*
+ * Event statistics (debug builds only)
+ * For every sink, source or stream event, measures the time from PulseAudio
+ * reporting it to the device's signals having been emitted, and the main
+ * loop time spent applying it. Logged by csk_audio_device_manager_log_stats
+ * and when the manager is disposed.
+ * Events that arrive while an earlier one for the same device is still
+ * pending count from the earliest.
+ */
+
+#define EVENT_STATS_MAX_SAMPLES 10000
+
+G_LOCK_DEFINE_STATIC(eventStats);
+static GHashTable *eventReceived = NULL; // (type << 32 | index) -> gint64 microseconds
+static GArray *eventLatencies = NULL; // gint64 microseconds
+static GArray *eventApplyTimes = NULL; // gint64 microseconds
+static guint64 eventCount = 0;
+
+static void event_stats_sample(GArray *samples, gint64 value)
+{
+	if(samples->len < EVENT_STATS_MAX_SAMPLES)
+		g_array_append_val(samples, value);
+	else
+	{
+		guint64 i = ((guint64)g_random_int() << 32 | g_random_int()) % eventCount;
+		if(i < EVENT_STATS_MAX_SAMPLES)
+			g_array_index(samples, gint64, i) = value;
+	}
+}
+
+static void event_stats_received(CskAudioDeviceType type, guint32 index)
+{
+	gint64 key = ((gint64)type << 32) | index;
+	gint64 now = g_get_monotonic_time();
+	G_LOCK(eventStats);
+	if(!eventReceived)
+	{
+		eventReceived = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, g_free);
+		eventLatencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+		eventApplyTimes = g_array_new(FALSE, FALSE, sizeof(gint64));
+	}
+	if(!g_hash_table_contains(eventReceived, &key))
+	{
+		gint64 *k = g_new(gint64, 1);
+		gint64 *v = g_new(gint64, 1);
+		*k = key;
+		*v = now;
+		g_hash_table_insert(eventReceived, k, v);
+	}
+	G_UNLOCK(eventStats);
+}
+
+static void event_stats_applied(CskAudioDeviceType type, guint32 index, gint64 start)
+{
+	gint64 key = ((gint64)type << 32) | index;
+	gint64 now = g_get_monotonic_time();
+	G_LOCK(eventStats);
+	gint64 *received = eventReceived ? g_hash_table_lookup(eventReceived, &key) : NULL;
+	if(received)
+	{
+		eventCount++;
+		event_stats_sample(eventLatencies, now - *received);
+		event_stats_sample(eventApplyTimes, now - start);
+		g_hash_table_remove(eventReceived, &key);
+	}
+	G_UNLOCK(eventStats);
+}
+
+static void log_samples(const gchar *name, GArray *samples)
+{
+	gchar *percentiles = latency_percentiles(samples);
+	if(!percentiles)
+		return;
+	g_message("Audio %-20s %8lu events  %s", name, (gulong)eventCount, percentiles);
+	g_free(percentiles);
+}
+
+// Events still in flight are kept, so they're counted in the next log
+static void log_event_stats(void)
+{
+	G_LOCK(eventStats);
+	if(eventReceived)
+	{
+		log_samples("event-to-notify", eventLatencies);
+		log_samples("main loop per event", eventApplyTimes);
+		g_array_set_size(eventLatencies, 0);
+		g_array_set_size(eventApplyTimes, 0);
+		eventCount = 0;
+	}
+	G_UNLOCK(eventStats);
+}
+#endif
+
+void csk_audio_device_manager_log_stats(CskAudioDeviceManager *manager)
+{
+	g_return_if_fail(CSK_IS_AUDIO_DEVICE_MANAGER(manager));
+#if GRAPHENE_DEBUG
+	log_event_stats();
+#endif
+}
@@ -41,6 +41,12 @@ const char * csk_audio_device_get_name(CskAudioDevice *device);
  */
 const char * csk_audio_device_get_description(CskAudioDevice *device);
 
+/*
+ * Gets the name of an icon for the device, or for client devices, the
+ * application's icon. May be NULL.
+ */
+const char * csk_audio_device_get_icon_name(CskAudioDevice *device);
+
 /*
  * Returns the volume of the device, a range from 0 to +infinity, where 1 is
  * "100%" and larger values are amplified. Returns 0 on failure.
@@ -48,7 +54,10 @@ const char * csk_audio_device_get_description(CskAudioDevice *device);
 float csk_audio_device_get_volume(CskAudioDevice *device);
 
 /*
- * Sets the volume of the device, 0 to +infinity, where 1 is "100%"
+ * Sets the volume of the device, 0 to +infinity, where 1 is "100%".
+ * PulseAudio is updated asynchronously, but csk_audio_device_get_volume
+ * returns the new value immediately. Calls made while a previous change
+ * is still being sent are combined, so this is cheap to call repeatedly.
  */
 void csk_audio_device_set_volume(CskAudioDevice *device, float volume);
 
@@ -72,10 +81,32 @@ void csk_audio_device_set_balance(CskAudioDevice *device, float balance);
 gboolean csk_audio_device_get_muted(CskAudioDevice *device);
 
 /*
- * Sets if the device is muted.
+ * Sets if the device is muted. Like csk_audio_device_set_volume, this
+ * takes effect immediately for csk_audio_device_get_muted.
  */
 void csk_audio_device_set_muted(CskAudioDevice *device, gboolean muted);
 
+/*
+ * Starts measuring the device's peak level (see csk_audio_device_get_peak).
+ * Each call must be matched by a call to csk_audio_device_unwatch_peak.
+ * Measuring runs only while at least one caller is watching, and costs
+ * nothing otherwise.
+ */
+void csk_audio_device_watch_peak(CskAudioDevice *device);
+
+/*
+ * Stops a csk_audio_device_watch_peak.
+ */
+void csk_audio_device_unwatch_peak(CskAudioDevice *device);
+
+/*
+ * Returns the device's recent peak level in the range [0, 1], or 0 if it
+ * isn't being watched. For output devices this is the level of what is
+ * being played. The "peak" property is notified at most about once per
+ * frame.
+ */
+float csk_audio_device_get_peak(CskAudioDevice *device);
+
 /*
  * Returns TRUE if this device is the default output or input device.
  * This is always FALSE for client devices.
@@ -98,6 +129,10 @@ G_DECLARE_FINAL_TYPE(CskAudioDeviceManager, csk_audio_device_manager, CSK, AUDIO
  * Returns a reference to the default audio device manager. Free with
  * g_object_unref. You must wait for the manager's state to become
  * READY before getting any audio devices.
+ *
+ * If the CSK_AUDIO_THREADED environment variable is set (and not "0"),
+ * PulseAudio events are processed on a separate thread, and changes to
+ * devices are applied on the main loop in batches about once per frame.
  */
 CskAudioDeviceManager * csk_audio_device_manager_get_default();
 
@@ -119,12 +154,21 @@ CskAudioDevice * csk_audio_device_manager_get_default_output(CskAudioDeviceManag
  * g_object_ref if you need to keep the device around).
  * Returns NULL on failure.
  */
-CskAudioDevice * csk_audio_device_manager_get_default_output(CskAudioDeviceManager *manager);
+CskAudioDevice * csk_audio_device_manager_get_default_input(CskAudioDeviceManager *manager);
 
 /*
- * Gets a list of all audio input devices. [transfer none]
+ * Gets a list of all audio devices, including per-application streams as
+ * client devices, in no particular order. [transfer none]
+ * The list is only valid until the next device is added or removed.
  * Returns NULL on failure.
  */
 GList * csk_audio_device_manager_get_devices(CskAudioDeviceManager *manager);
 
+/*
+ * In debug builds, logs how long PulseAudio events took to reach the
+ * devices' signals since the last call, and resets the statistics.
+ * Does nothing otherwise.
+ */
+void csk_audio_device_manager_log_stats(CskAudioDeviceManager *manager);
+
 #endif // __GRAPHENE_AUDIO_H__
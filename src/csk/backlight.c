@@ -3,18 +3,50 @@
  * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
  * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
  *
- * TODO: This is a signficantly laggy when rapidly changing brightness
- * (i.e. pressing and holding brightness key), mainly due to calling pkexec.
+ * The screen backlight is read directly from sysfs, and written through
+ * logind's Session.SetBrightness so that no privileges are needed. Writes
+ * are asynchronous, with at most one in flight; values requested while one
+ * is running replace each other and only the last is written afterwards.
+ * If there is no sysfs backlight or logind can't set it (logind < 243),
+ * gsd-backlight-helper is used instead, as before.
+ *
+ * Changes don't jump straight to the new value, but ramp towards it in a
+ * couple of steps. Writes are at least RAMP_INTERVAL apart and never
+ * overlap, so a keypress costs slow controllers RAMP_STEPS writes at most.
+ * Key repeats just move the ramp's target, and reads return the
+ * target instead of querying the hardware while the brightness is changing.
  */
-#include <glib-object.h>
+#include <gio/gio.h>
 #include <math.h>
 #include <time.h>
 
+#define SYSFS_BACKLIGHT_DIR "/sys/class/backlight"
+
 #define BH_EXEC "/usr/lib/gnome-settings-daemon/gsd-backlight-helper" 
 #define BH_GET_MAX "--get-max-brightness"
 #define BH_GET "--get-brightness"
 #define BH_SET "--set-brightness"
 
+static gboolean initialized = FALSE;
+static gchar *sysfsDevice = NULL; // Name in SYSFS_BACKLIGHT_DIR, or NULL to use the helper
+static gint64 sysfsMax = -1;
+static GDBusConnection *systemBus = NULL;
+static gboolean useLogind = TRUE;
+
+#define RAMP_INTERVAL 75 // ms, the most often the backlight gets written
+#define RAMP_STEPS 2 // Writes per change
+#define RAMP_CACHE_TIME (2 * G_USEC_PER_SEC) // How long after a change to trust target over the hardware
+
+static gint64 target = -1; // Value the ramp is heading to, or -1 if unknown
+static gint64 current = -1; // Ramp position, the value last queued for writing
+static gint64 rampStep = 1;
+static guint rampSourceId = 0;
+static gint64 lastChange = 0; // Monotonic time of the last set
+static gint64 lastStep = 0; // Monotonic time of the last ramp step
+
+static gint64 queued = -1; // Most recent value to write
+static gint64 writing = -1; // Value being written, or -1 if no write is in flight
+
 static gboolean backlight_command(const gchar *command, const gchar *value, gchar **stdout, gint *exitCode)
 {
 	const gchar *argv[] = {"pkexec", BH_EXEC, command, value, NULL};
@@ -24,8 +56,94 @@ static gboolean backlight_command(const gchar *command, const gchar *value, gcha
 		NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, stdout, NULL, exitCode, NULL);
 }
 
+static gint64 read_sysfs_value(const gchar *device, const gchar *attribute)
+{
+	gchar *path = g_build_filename(SYSFS_BACKLIGHT_DIR, device, attribute, NULL);
+	gchar *contents = NULL;
+	gint64 val = -1;
+	if(g_file_get_contents(path, &contents, NULL, NULL))
+	{
+		gchar *end = NULL;
+		val = g_ascii_strtoll(contents, &end, 10);
+		if(contents == end)
+			val = -1;
+	}
+	g_free(contents);
+	g_free(path);
+	return val;
+}
+
+/*
+ * Picks the backlight to control, preferring the same interfaces as
+ * gnome-settings-daemon does: firmware interfaces know the panel's real
+ * range, while raw ones go straight to the GPU's registers.
+ */
+static gchar * find_sysfs_device(void)
+{
+	static const gchar *types[] = {"firmware", "platform", "raw"};
+
+	GDir *dir = g_dir_open(SYSFS_BACKLIGHT_DIR, 0, NULL);
+	if(!dir)
+		return NULL;
+
+	gchar *best = NULL;
+	guint bestRank = G_N_ELEMENTS(types);
+	const gchar *name;
+	while((name = g_dir_read_name(dir)))
+	{
+		gchar *path = g_build_filename(SYSFS_BACKLIGHT_DIR, name, "type", NULL);
+		gchar *type = NULL;
+		g_file_get_contents(path, &type, NULL, NULL);
+		g_free(path);
+		if(!type)
+			continue;
+		g_strstrip(type);
+
+		for(guint i = 0; i < bestRank; ++i)
+		{
+			if(g_strcmp0(type, types[i]) == 0)
+			{
+				g_free(best);
+				best = g_strdup(name);
+				bestRank = i;
+				break;
+			}
+		}
+		g_free(type);
+	}
+	g_dir_close(dir);
+	return best;
+}
+
+static void init_backlight(void)
+{
+	if(initialized)
+		return;
+	initialized = TRUE;
+
+	sysfsDevice = find_sysfs_device();
+	if(sysfsDevice)
+		sysfsMax = read_sysfs_value(sysfsDevice, "max_brightness");
+	if(sysfsMax <= 0)
+		g_clear_pointer(&sysfsDevice, g_free);
+
+	GError *error = NULL;
+	if(sysfsDevice)
+		systemBus = g_bus_get_sync(G_BUS_TYPE_SYSTEM, NULL, &error);
+	if(sysfsDevice && !systemBus)
+	{
+		g_warning("Failed to connect to the system bus, using the backlight helper: %s", error->message);
+		g_clear_error(&error);
+		useLogind = FALSE;
+	}
+}
+
 static gint64 get_max_backlight(void)
 {
+	init_backlight();
+	if(sysfsDevice)
+		return sysfsMax;
+
 	static gint64 cache = -1;
 	static time_t cacheTime = 0;
 	if(cache >= 0 && time(NULL) - cacheTime < 5)
@@ -47,25 +165,156 @@ static gint64 get_max_backlight(void)
 
 static gint64 get_backlight(void)
 {
-	gchar *stdout;
-	gint exitCode;
-	gboolean r = backlight_command(BH_GET, NULL, &stdout, &exitCode);
-	if(!r || exitCode)
-		return -1;
-	gchar *end = NULL;
-	gint64 val = g_ascii_strtoll(stdout, &end, 10);
-	if(stdout == end)
-		return -1;
+	init_backlight();
+
+	// While ramping the hardware lags behind, and shortly after it's likely
+	// more keypresses are coming. Otherwise, pick up changes made by others.
+	if(target >= 0 && (rampSourceId || writing >= 0 || g_get_monotonic_time() - lastChange < RAMP_CACHE_TIME))
+		return target;
+
+	gint64 val = -1;
+	if(sysfsDevice)
+	{
+		val = read_sysfs_value(sysfsDevice, "brightness");
+	}
+	else
+	{
+		gchar *stdout;
+		gint exitCode;
+		gboolean r = backlight_command(BH_GET, NULL, &stdout, &exitCode);
+		if(!r || exitCode)
+			return -1;
+		gchar *end = NULL;
+		val = g_ascii_strtoll(stdout, &end, 10);
+		if(stdout == end)
+			return -1;
+	}
+
+	if(val >= 0)
+		target = current = val;
 	return val;
 }
 
-static gboolean set_backlight(gint64 val)
+static void start_write(void);
+
+static void on_write_done(gboolean success)
 {
-	gchar *sval = g_strdup_printf("%"G_GINT64_FORMAT, val);
-	gint exitCode;
-	gboolean r = backlight_command(BH_SET, sval, NULL, &exitCode);
+	if(!success)
+		g_warning("Failed to set backlight brightness to %"G_GINT64_FORMAT, writing);
+	gint64 written = writing;
+	writing = -1;
+	if(queued != written)
+		start_write();
+}
+
+static void on_logind_write_done(GDBusConnection *connection, GAsyncResult *res, UNUSED gpointer userdata)
+{
+	GError *error = NULL;
+	GVariant *ret = g_dbus_connection_call_finish(connection, res, &error);
+	if(ret)
+	{
+		g_variant_unref(ret);
+		on_write_done(TRUE);
+		return;
+	}
+
+	// Most likely a logind without SetBrightness. Fall back to the helper
+	// for this and all later writes.
+	g_message("Setting brightness through logind failed, using the backlight helper: %s", error->message);
+	g_clear_error(&error);
+	useLogind = FALSE;
+	writing = -1;
+	start_write();
+}
+
+static void on_helper_write_done(GPid pid, gint status, UNUSED gpointer userdata)
+{
+	g_spawn_close_pid(pid);
+	on_write_done(g_spawn_check_exit_status(status, NULL));
+}
+
+static void start_write(void)
+{
+	writing = queued;
+
+	if(sysfsDevice && useLogind)
+	{
+		g_dbus_connection_call(systemBus,
+			"org.freedesktop.login1",
+			"/org/freedesktop/login1/session/auto",
+			"org.freedesktop.login1.Session",
+			"SetBrightness",
+			g_variant_new("(ssu)", "backlight", sysfsDevice, (guint32)writing),
+			NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+			(GAsyncReadyCallback)on_logind_write_done, NULL);
+		return;
+	}
+
+	gchar *sval = g_strdup_printf("%"G_GINT64_FORMAT, writing);
+	const gchar *argv[] = {"pkexec", BH_EXEC, BH_SET, sval, NULL};
+	GPid pid;
+	gboolean r = g_spawn_async(NULL, (gchar **)argv, NULL,
+		G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_STDOUT_TO_DEV_NULL,
+		NULL, NULL, &pid, NULL);
 	g_free(sval);
-	return r && !exitCode;
+	if(r)
+		g_child_watch_add(pid, on_helper_write_done, NULL);
+	else
+	{
+		// Don't retry, or this would loop
+		g_warning("Failed to run the backlight helper");
+		writing = -1;
+	}
+}
+
+static void queue_write(gint64 val)
+{
+	queued = val;
+	if(writing < 0)
+		start_write();
+}
+
+static gboolean on_ramp_tick(UNUSED gpointer userdata)
+{
+	// Let slow (ACPI, I2C) controllers catch up instead of piling up writes
+	if(writing >= 0)
+		return G_SOURCE_CONTINUE;
+
+	if(current < target)
+		current = MIN(current + rampStep, target);
+	else
+		current = MAX(current - rampStep, target);
+	lastStep = g_get_monotonic_time();
+	queue_write(current);
+
+	if(current != target)
+		return G_SOURCE_CONTINUE;
+	rampSourceId = 0;
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean set_backlight(gint64 val)
+{
+	if(current < 0 && get_backlight() < 0)
+		return FALSE;
+
+	target = val;
+	lastChange = g_get_monotonic_time();
+	if(target == current)
+		return TRUE;
+
+	// Cover the remaining distance in RAMP_STEPS writes, however far it is
+	rampStep = MAX(1, (ABS(target - current) + RAMP_STEPS - 1) / RAMP_STEPS);
+	if(rampSourceId)
+		return TRUE;
+
+	// Take the first step right away, unless that would write too soon
+	// after the last one
+	if(g_get_monotonic_time() - lastStep >= RAMP_INTERVAL * 1000
+	&& on_ramp_tick(NULL) == G_SOURCE_REMOVE)
+		return TRUE;
+	rampSourceId = g_timeout_add(RAMP_INTERVAL, on_ramp_tick, NULL);
+	return TRUE;
 }
 
 gfloat csk_backlight_get_brightness(void)
@@ -106,14 +355,165 @@ gfloat csk_backlight_set_brightness(gfloat value, gboolean relative)
 	}
 }
 
+
+
+/*
+ * Keyboard backlight, through UPower's KbdBacklight interface. The proxy is
+ * created asynchronously on first use, and the brightness is kept up to date
+ * from UPower's BrightnessChanged signal so that reading it never blocks on
+ * the bus. Writes are coalesced the same way as for the screen.
+ */
+
+static GDBusProxy *kbdProxy = NULL;
+static gboolean kbdInitialized = FALSE;
+static gint kbdMax = -1;
+static gint kbdValue = -1; // Cached brightness, including writes not yet done
+static gint kbdQueued = -1;
+static gint kbdWriting = -1;
+
+static void kbd_start_write(void);
+
+static void on_kbd_resync(GDBusProxy *proxy, GAsyncResult *res, UNUSED gpointer userdata)
+{
+	GVariant *ret = g_dbus_proxy_call_finish(proxy, res, NULL);
+	if(!ret)
+		return;
+	// A write started since takes precedence
+	if(kbdWriting < 0)
+	{
+		g_variant_get(ret, "(i)", &kbdValue);
+		kbdQueued = kbdValue;
+	}
+	g_variant_unref(ret);
+}
+
+static void on_kbd_write_done(GDBusProxy *proxy, GAsyncResult *res, UNUSED gpointer userdata)
+{
+	GError *error = NULL;
+	GVariant *ret = g_dbus_proxy_call_finish(proxy, res, &error);
+	gboolean failed = !ret;
+	if(ret)
+		g_variant_unref(ret);
+	else
+	{
+		g_warning("Failed to set keyboard backlight brightness: %s", error->message);
+		g_clear_error(&error);
+	}
+
+	gint written = kbdWriting;
+	kbdWriting = -1;
+	if(kbdQueued != written)
+		kbd_start_write();
+	else if(failed)
+	{
+		// The cached value is the one that failed to be written, so
+		// get the real one again
+		g_dbus_proxy_call(kbdProxy, "GetBrightness", NULL,
+			G_DBUS_CALL_FLAGS_NONE, -1, NULL, (GAsyncReadyCallback)on_kbd_resync, NULL);
+	}
+}
+
+static void kbd_start_write(void)
+{
+	kbdWriting = kbdQueued;
+	g_dbus_proxy_call(kbdProxy, "SetBrightness", g_variant_new("(i)", kbdWriting),
+		G_DBUS_CALL_FLAGS_NONE, -1, NULL, (GAsyncReadyCallback)on_kbd_write_done, NULL);
+}
+
+static void on_kbd_signal(UNUSED GDBusProxy *proxy, UNUSED gchar *sender, gchar *signal, GVariant *parameters, UNUSED gpointer userdata)
+{
+	// BrightnessChangedWithSource also reports changes made by the
+	// firmware, such as with a hardware Fn key combination
+	if(g_strcmp0(signal, "BrightnessChanged") != 0 && g_strcmp0(signal, "BrightnessChangedWithSource") != 0)
+		return;
+
+	// Signals for the earlier of several queued writes would make the
+	// cached value jump back
+	if(kbdWriting >= 0)
+		return;
+
+	g_variant_get_child(parameters, 0, "i", &kbdValue);
+}
+
+static void on_kbd_get_max(GDBusProxy *proxy, GAsyncResult *res, UNUSED gpointer userdata)
+{
+	GVariant *ret = g_dbus_proxy_call_finish(proxy, res, NULL);
+	if(!ret)
+		return;
+	g_variant_get(ret, "(i)", &kbdMax);
+	g_variant_unref(ret);
+}
+
+static void on_kbd_get_brightness(GDBusProxy *proxy, GAsyncResult *res, UNUSED gpointer userdata)
+{
+	GVariant *ret = g_dbus_proxy_call_finish(proxy, res, NULL);
+	if(!ret)
+		return;
+	// Don't overwrite a value set while this call was running
+	if(kbdValue < 0)
+		g_variant_get(ret, "(i)", &kbdValue);
+	g_variant_unref(ret);
+}
+
+static void on_kbd_proxy_ready(UNUSED GObject *source, GAsyncResult *res, UNUSED gpointer userdata)
+{
+	GError *error = NULL;
+	kbdProxy = g_dbus_proxy_new_for_bus_finish(res, &error);
+	if(!kbdProxy)
+	{
+		g_warning("Failed to connect to UPower keyboard backlight: %s", error->message);
+		g_clear_error(&error);
+		return;
+	}
+
+	g_signal_connect(kbdProxy, "g-signal", G_CALLBACK(on_kbd_signal), NULL);
+	g_dbus_proxy_call(kbdProxy, "GetMaxBrightness", NULL,
+		G_DBUS_CALL_FLAGS_NONE, -1, NULL, (GAsyncReadyCallback)on_kbd_get_max, NULL);
+	g_dbus_proxy_call(kbdProxy, "GetBrightness", NULL,
+		G_DBUS_CALL_FLAGS_NONE, -1, NULL, (GAsyncReadyCallback)on_kbd_get_brightness, NULL);
+}
+
+static void init_kbd_backlight(void)
+{
+	if(kbdInitialized)
+		return;
+	kbdInitialized = TRUE;
+
+	g_dbus_proxy_new_for_bus(G_BUS_TYPE_SYSTEM,
+		G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
+		NULL,
+		"org.freedesktop.UPower",
+		"/org/freedesktop/UPower/KbdBacklight",
+		"org.freedesktop.UPower.KbdBacklight",
+		NULL,
+		on_kbd_proxy_ready,
+		NULL);
+}
+
 gfloat csk_keyboard_backlight_get_brightness(void)
 {
-	// TODO
-	return 0;
+	init_kbd_backlight();
+	if(kbdMax <= 0 || kbdValue < 0)
+		return -1;
+	return (gfloat)kbdValue / kbdMax;
 }
 
-gfloat csk_keyboard_backlight_set_brightness(UNUSED gfloat value, UNUSED gboolean relative)
+gfloat csk_keyboard_backlight_set_brightness(gfloat value, gboolean relative)
 {
-	// TODO
-	return 0;
+	init_kbd_backlight();
+	if(kbdMax <= 0 || kbdValue < 0)
+		return -1;
+
+	// Keyboards often only have two or three levels, so always move by at
+	// least one
+	gfloat fvalue = value * kbdMax;
+	gint ivalue = (fvalue < 0) ? floor(fvalue) : ceil(fvalue);
+	gint newval = MIN(MAX(0, relative ? kbdValue + ivalue : ivalue), kbdMax);
+	if(newval != kbdValue)
+	{
+		kbdValue = kbdQueued = newval;
+		if(kbdWriting < 0)
+			kbd_start_write();
+	}
+	return (gfloat)newval / kbdMax;
 }
@@ -7,12 +7,24 @@
 #include "battery.h"
 #include <gio/gio.h>
 
+// UPower only samples batteries every so often on its own, so while
+// discharging it's asked to refresh. The interval starts at the minimum,
+// and doubles each time the charge hasn't changed since the last refresh.
+#define REFRESH_MIN_INTERVAL 10 // seconds
+#define REFRESH_MAX_INTERVAL 160 // seconds
+
+#define UPOWER_DEVICE_TYPE_BATTERY 2
+#define UPOWER_DEVICE_STATE_DISCHARGING 2
+
 struct _CskBatteryInfo
 {
 	GObject parent;
 	
+	GCancellable *cancellable;
 	GDBusProxy *batteryDeviceProxy;
 	guint batteryRefreshTimerId;
+	guint refreshInterval; // seconds
+	gdouble refreshPercent; // Charge at the last refresh
 };
 
 enum
@@ -26,6 +38,7 @@ static guint signals[SIGNAL_LAST];
 
 static void csk_battery_info_dispose(GObject *self_);
 static gboolean refresh_battery_info(CskBatteryInfo *self);
+static void update_refresh_timer(CskBatteryInfo *self);
 static void on_upproxy_display_device_property_changed(CskBatteryInfo *self, GVariant *changed_properties, GStrv invalidated_properties, GDBusProxy *proxy);
 static gchar * get_icon_name(CskBatteryInfo *self);
 
@@ -60,35 +73,48 @@ static void csk_battery_info_class_init(CskBatteryInfoClass *class)
 	signals[SIGNAL_UPDATE] = g_signal_new("update", G_TYPE_FROM_CLASS(class), G_SIGNAL_RUN_FIRST, 0, NULL, NULL, NULL, G_TYPE_NONE, 0);
 }
 
-static void csk_battery_info_init(CskBatteryInfo *self)
+static void on_upproxy_ready(UNUSED GObject *source, GAsyncResult *res, CskBatteryInfo *self)
 {
 	GError *error = NULL;
-	self->batteryDeviceProxy = g_dbus_proxy_new_for_bus_sync(
+	GDBusProxy *proxy = g_dbus_proxy_new_for_bus_finish(res, &error);
+	if(!proxy)
+	{
+		// self may already be gone if cancelled
+		if(!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_warning("Failed to connect to UPower display device: %s", error->message);
+		g_clear_error(&error);
+		return;
+	}
+
+	self->batteryDeviceProxy = proxy;
+	g_signal_connect_swapped(self->batteryDeviceProxy, "g-properties-changed", G_CALLBACK(on_upproxy_display_device_property_changed), self);
+	update_refresh_timer(self);
+	g_signal_emit(self, signals[SIGNAL_UPDATE], 0);
+}
+
+static void csk_battery_info_init(CskBatteryInfo *self)
+{
+	self->cancellable = g_cancellable_new();
+	g_dbus_proxy_new_for_bus(
 		G_BUS_TYPE_SYSTEM,
 		0,
 		NULL,
 		"org.freedesktop.UPower",
 		"/org/freedesktop/UPower/devices/DisplayDevice",
 		"org.freedesktop.UPower.Device",
-		NULL,
-		&error);
-	
-	if(!self->batteryDeviceProxy)
-	{
-		g_warning("Failed to connect to UPower display device: %s", error->message);
-		g_clear_error(&error);
-		return;
-	}
-	
-		g_signal_connect_swapped(self->batteryDeviceProxy, "g-properties-changed", G_CALLBACK(on_upproxy_display_device_property_changed), self);
-		
-		self->batteryRefreshTimerId = g_timeout_add_seconds(10, (GSourceFunc)refresh_battery_info, self);
-		refresh_battery_info(self);
+		self->cancellable,
+		(GAsyncReadyCallback)on_upproxy_ready,
+		self);
 }
 
 static void csk_battery_info_dispose(GObject *self_)
 {
 	CskBatteryInfo *self = CSK_BATTERY_INFO(self_);
+	if(self->cancellable)
+		g_cancellable_cancel(self->cancellable);
+	g_clear_object(&self->cancellable);
+	if(self->batteryDeviceProxy)
+		g_signal_handlers_disconnect_by_data(self->batteryDeviceProxy, self);
 	g_clear_object(&self->batteryDeviceProxy);
 	if(self->batteryRefreshTimerId)
 		g_source_remove(self->batteryRefreshTimerId);
@@ -98,9 +124,44 @@ static void csk_battery_info_dispose(GObject *self_)
 
 static gboolean refresh_battery_info(CskBatteryInfo *self)
 {
-	if(self->batteryDeviceProxy)
-		g_dbus_proxy_call(self->batteryDeviceProxy, "Refresh", NULL, G_DBUS_CALL_FLAGS_NONE, 100, NULL, NULL, NULL);
-	return TRUE; // true to continue the timer callback
+	self->batteryRefreshTimerId = 0;
+
+	// Back off while the charge is steady, and return to the shortest
+	// interval once it moves again.
+	gdouble percent = csk_battery_info_get_percent(self);
+	if(percent == self->refreshPercent)
+		self->refreshInterval = MIN(self->refreshInterval * 2, REFRESH_MAX_INTERVAL);
+	else
+		self->refreshInterval = REFRESH_MIN_INTERVAL;
+	self->refreshPercent = percent;
+
+	g_dbus_proxy_call(self->batteryDeviceProxy, "Refresh", NULL, G_DBUS_CALL_FLAGS_NONE, -1, self->cancellable, NULL, NULL);
+	self->batteryRefreshTimerId = g_timeout_add_seconds(self->refreshInterval, (GSourceFunc)refresh_battery_info, self);
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * Refreshes only while running on a discharging battery. Otherwise, UPower's
+ * PropertiesChanged signals are enough.
+ */
+static void update_refresh_timer(CskBatteryInfo *self)
+{
+	gboolean discharging = csk_battery_info_is_available(self)
+		&& csk_battery_info_get_state(self) == UPOWER_DEVICE_STATE_DISCHARGING;
+
+	if(!discharging)
+	{
+		if(self->batteryRefreshTimerId)
+			g_source_remove(self->batteryRefreshTimerId);
+		self->batteryRefreshTimerId = 0;
+		return;
+	}
+
+	if(self->batteryRefreshTimerId)
+		return;
+	self->refreshInterval = REFRESH_MIN_INTERVAL;
+	self->refreshPercent = csk_battery_info_get_percent(self);
+	self->batteryRefreshTimerId = g_timeout_add_seconds(self->refreshInterval, (GSourceFunc)refresh_battery_info, self);
 }
 
 gboolean csk_battery_info_is_available(CskBatteryInfo *self)
@@ -131,7 +192,7 @@ gboolean csk_battery_info_is_available(CskBatteryInfo *self)
 		g_object_unref(self);
 	
 	// 0: Unknown, 1: Line Power, 2: Battery, 3: Ups, 4: Monitor, 5: Mouse, 6: Keyboard, 7: Pda, 8: Phone
-	return deviceType == 2;
+	return deviceType == UPOWER_DEVICE_TYPE_BATTERY;
 }
 gdouble csk_battery_info_get_percent(CskBatteryInfo *self)
 {
@@ -181,7 +242,9 @@ gchar * csk_battery_info_get_icon_name(CskBatteryInfo *self)
 {
 	// Returns a newly-allocated string
 	
-	g_return_val_if_fail(csk_battery_info_is_available(self), g_strdup("battery-full-charged-symbolic"));
+	// Not an error; the UPower proxy may not be ready yet
+	if(!csk_battery_info_is_available(self))
+		return g_strdup("battery-full-charged-symbolic");
 	
 	GVariant *iconNameVariant = g_dbus_proxy_get_cached_property(self->batteryDeviceProxy, "IconName");
 	if(iconNameVariant)
@@ -219,6 +282,7 @@ gint64 csk_battery_info_get_time(CskBatteryInfo *self)
 
 static void on_upproxy_display_device_property_changed(CskBatteryInfo *self, UNUSED GVariant *changed_properties, UNUSED GStrv invalidated_properties, UNUSED GDBusProxy *proxy)
 {
+	update_refresh_timer(self);
 	g_signal_emit_by_name(self, "update");
 }
 
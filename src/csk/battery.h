@@ -23,7 +23,8 @@ G_DECLARE_FINAL_TYPE(CskBatteryInfo, csk_battery_info, CSK, BATTERY_INFO, GObjec
 CskBatteryInfo * csk_battery_info_get_default(void);
 
 /*
- * Returns TRUE if a battery is attached to the system.
+ * Returns TRUE if a battery is attached to the system. UPower is connected
+ * to asynchronously, so this is FALSE until the first "update" signal.
  */
 gboolean csk_battery_info_is_available(CskBatteryInfo *self);
 
@@ -0,0 +1,353 @@
+/*
+ * This file is part of graphene-desktop, the desktop environment of VeltOS.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * frame-stats.c
+ * A frame goes through four points on the main loop: the pre-paint repaint
+ * functions, the start of the stage's paint (after layout), the stage's
+ * after-paint signal, and the post-paint repaint functions (after the buffer
+ * swap). The time between each is recorded per frame into a ring buffer.
+ * Only the main thread writes to it, and each record is published by
+ * bumping an atomic counter, so readers never need a lock; a reader can
+ * tell which records were overwritten while it copied them by checking the
+ * counter again afterwards.
+ */
+
+#include "frame-stats.h"
+#include <shell-dbus-iface.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAME_STATS_DBUS_NAME "io.velt.GrapheneShell.FrameStats"
+#define FRAME_STATS_DBUS_PATH "/io/velt/GrapheneShell/FrameStats"
+#define FRAME_STATS_RING_SIZE 512 // Frames; about 8 seconds at 60Hz
+#define FRAME_STATS_HISTOGRAM_SIZE 51 // 1ms buckets, the last is 50ms+
+#define FRAME_STATS_SMOOTHING 0.2 // Weight of the newest frame in the average cost
+#define FRAME_STATS_OVERLAY_INTERVAL 1000 // ms
+
+typedef struct
+{
+	gint64 start; // Monotonic, us
+	guint32 layout; // us
+	guint32 paint; // us
+	guint32 total; // us, including the swap
+	guint32 missed; // Frames skipped since the previous one
+} FrameRecord;
+
+typedef struct
+{
+	guint frames, missed;
+	gdouble fps;
+	gdouble layoutP50, layoutP99;
+	gdouble paintP50, paintP99;
+	gdouble frameP50, frameP90, frameP99, frameMax; // ms
+} FrameSummary;
+
+static FrameRecord ring[FRAME_STATS_RING_SIZE];
+// Unsigned, so these wrap around after months of painting at high refresh
+// rates instead of overflowing. The ring size divides 2^32, so written
+// still maps to the same ring slots after wrapping.
+static guint written = 0; // Accessed atomically; total records ever written
+static guint totalMissed = 0; // Accessed atomically
+static guint histogram[FRAME_STATS_HISTOGRAM_SIZE]; // Accessed atomically
+
+// Current frame, main thread only
+static gint64 preTime = 0, paintTime = 0, afterTime = 0;
+static gint64 lastPreTime = 0;
+static gdouble averageCost = 0; // us
+
+static DBusGrapheneShellFrameStats *dbusObject = NULL;
+static ClutterStage *stage = NULL;
+static ClutterActor *overlay = NULL;
+static guint overlaySourceId = 0;
+
+
+static gboolean on_pre_paint(UNUSED gpointer userdata)
+{
+	preTime = g_get_monotonic_time();
+	paintTime = afterTime = 0;
+	return G_SOURCE_CONTINUE;
+}
+
+static void on_stage_paint(UNUSED ClutterActor *actor, UNUSED gpointer userdata)
+{
+	// Outermost paint only; the stage can't be painted recursively, but
+	// clones of it could be
+	if(!paintTime)
+		paintTime = g_get_monotonic_time();
+}
+
+static void on_stage_after_paint(UNUSED ClutterStage *stage_, UNUSED gpointer userdata)
+{
+	afterTime = g_get_monotonic_time();
+}
+
+static gboolean on_post_paint(UNUSED gpointer userdata)
+{
+	// Repaint functions run even if the stage had nothing to paint
+	if(!preTime || !paintTime || !afterTime)
+		return G_SOURCE_CONTINUE;
+
+	gint64 now = g_get_monotonic_time();
+
+	guint32 missed = 0;
+	gint64 interval = preTime - lastPreTime;
+	if(lastPreTime && interval < GRAPHENE_FRAME_IDLE_GAP)
+	{
+		gint64 frames = (interval + GRAPHENE_FRAME_BUDGET/2) / GRAPHENE_FRAME_BUDGET;
+		if(frames > 1)
+			missed = frames - 1;
+	}
+	lastPreTime = preTime;
+
+	guint n = g_atomic_int_get(&written);
+	FrameRecord *r = &ring[n % FRAME_STATS_RING_SIZE];
+	r->start = preTime;
+	r->layout = paintTime - preTime;
+	r->paint = afterTime - paintTime;
+	r->total = now - preTime;
+	r->missed = missed;
+	g_atomic_int_set(&written, n + 1);
+
+	// Without the swap, which may just be waiting for vblank
+	gdouble cost = r->layout + r->paint;
+	if(averageCost == 0)
+		averageCost = cost;
+	else
+		averageCost += FRAME_STATS_SMOOTHING * (cost - averageCost);
+
+	guint bucket = MIN(r->total / 1000, FRAME_STATS_HISTOGRAM_SIZE - 1);
+	g_atomic_int_inc(&histogram[bucket]);
+	if(missed)
+		g_atomic_int_add(&totalMissed, missed);
+
+	preTime = 0;
+	return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Copies out the most recent records, oldest first. Returns the number
+ * copied. Safe to call from any thread.
+ */
+static guint copy_recent(FrameRecord *out)
+{
+	// Differences between counts stay right when written wraps around
+	guint end = g_atomic_int_get(&written);
+	guint count = MIN(end, FRAME_STATS_RING_SIZE);
+	guint begin = end - count;
+	for(guint i = 0; i < count; ++i)
+		out[i] = ring[(begin + i) % FRAME_STATS_RING_SIZE];
+
+	// Anything the writer got to while we were copying is garbage; only
+	// records after the one it may be writing now are still intact
+	guint ahead = g_atomic_int_get(&written) - begin;
+	guint overwritten = (ahead > FRAME_STATS_RING_SIZE - 1) ? ahead - (FRAME_STATS_RING_SIZE - 1) : 0;
+	if(overwritten >= count)
+		return 0;
+	if(overwritten > 0)
+		memmove(out, out + overwritten, (count - overwritten) * sizeof(FrameRecord));
+	return count - overwritten;
+}
+
+static gint compare_uint32(gconstpointer a, gconstpointer b)
+{
+	guint32 x = *(const guint32 *)a, y = *(const guint32 *)b;
+	return (x > y) - (x < y);
+}
+
+static gdouble percentile_ms(guint32 *sorted, guint count, gdouble p)
+{
+	if(count == 0)
+		return 0;
+	return sorted[(guint)(p * (count - 1))] / 1000.0;
+}
+
+static void summarize(FrameSummary *s)
+{
+	memset(s, 0, sizeof(FrameSummary));
+	s->frames = g_atomic_int_get(&written);
+	s->missed = g_atomic_int_get(&totalMissed);
+
+	FrameRecord *records = g_new(FrameRecord, FRAME_STATS_RING_SIZE);
+	guint count = copy_recent(records);
+	if(count == 0)
+	{
+		g_free(records);
+		return;
+	}
+
+	guint32 *layout = g_new(guint32, count);
+	guint32 *paint = g_new(guint32, count);
+	guint32 *total = g_new(guint32, count);
+	for(guint i = 0; i < count; ++i)
+	{
+		layout[i] = records[i].layout;
+		paint[i] = records[i].paint;
+		total[i] = records[i].total;
+	}
+	qsort(layout, count, sizeof(guint32), compare_uint32);
+	qsort(paint, count, sizeof(guint32), compare_uint32);
+	qsort(total, count, sizeof(guint32), compare_uint32);
+
+	s->layoutP50 = percentile_ms(layout, count, 0.5);
+	s->layoutP99 = percentile_ms(layout, count, 0.99);
+	s->paintP50 = percentile_ms(paint, count, 0.5);
+	s->paintP99 = percentile_ms(paint, count, 0.99);
+	s->frameP50 = percentile_ms(total, count, 0.5);
+	s->frameP90 = percentile_ms(total, count, 0.9);
+	s->frameP99 = percentile_ms(total, count, 0.99);
+	s->frameMax = percentile_ms(total, count, 1);
+
+	// Frames per second while actually drawing, over the last second
+	gint64 cutoff = records[count-1].start - G_USEC_PER_SEC;
+	guint recent = 0;
+	for(gint i = count - 1; i >= 0 && records[i].start > cutoff; --i)
+		recent ++;
+	if(g_get_monotonic_time() - records[count-1].start < GRAPHENE_FRAME_IDLE_GAP)
+		s->fps = recent;
+
+	g_free(layout);
+	g_free(paint);
+	g_free(total);
+	g_free(records);
+}
+
+
+
+/*
+ * DBus
+ */
+
+static gboolean on_dbus_get_frame_stats(DBusGrapheneShellFrameStats *object, GDBusMethodInvocation *invocation, UNUSED gpointer userdata)
+{
+	FrameSummary s;
+	summarize(&s);
+
+	GVariantBuilder percentiles;
+	g_variant_builder_init(&percentiles, G_VARIANT_TYPE("a{sd}"));
+	g_variant_builder_add(&percentiles, "{sd}", "layout-p50", s.layoutP50);
+	g_variant_builder_add(&percentiles, "{sd}", "layout-p99", s.layoutP99);
+	g_variant_builder_add(&percentiles, "{sd}", "paint-p50", s.paintP50);
+	g_variant_builder_add(&percentiles, "{sd}", "paint-p99", s.paintP99);
+	g_variant_builder_add(&percentiles, "{sd}", "frame-p50", s.frameP50);
+	g_variant_builder_add(&percentiles, "{sd}", "frame-p90", s.frameP90);
+	g_variant_builder_add(&percentiles, "{sd}", "frame-p99", s.frameP99);
+	g_variant_builder_add(&percentiles, "{sd}", "frame-max", s.frameMax);
+	g_variant_builder_add(&percentiles, "{sd}", "fps", s.fps);
+
+	GVariantBuilder hist;
+	g_variant_builder_init(&hist, G_VARIANT_TYPE("au"));
+	for(guint i = 0; i < FRAME_STATS_HISTOGRAM_SIZE; ++i)
+		g_variant_builder_add(&hist, "u", (guint32)g_atomic_int_get(&histogram[i]));
+
+	dbus_graphene_shell_frame_stats_complete_get_frame_stats(object, invocation,
+		s.frames, s.missed,
+		g_variant_builder_end(&percentiles),
+		g_variant_builder_end(&hist));
+	return TRUE;
+}
+
+static void on_bus_acquired(UNUSED GObject *source, GAsyncResult *res, UNUSED gpointer userdata)
+{
+	GError *error = NULL;
+	GDBusConnection *connection = g_bus_get_finish(res, &error);
+	if(!connection)
+	{
+		g_warning("Failed to export frame stats: %s", error->message);
+		g_error_free(error);
+		return;
+	}
+
+	dbusObject = dbus_graphene_shell_frame_stats_skeleton_new();
+	g_signal_connect(dbusObject, "handle-get-frame-stats", G_CALLBACK(on_dbus_get_frame_stats), NULL);
+	if(!g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(dbusObject), connection, FRAME_STATS_DBUS_PATH, &error))
+	{
+		g_warning("Failed to export frame stats: %s", error->message);
+		g_error_free(error);
+		g_clear_object(&dbusObject);
+	}
+	else
+	{
+		g_bus_own_name_on_connection(connection, FRAME_STATS_DBUS_NAME, G_BUS_NAME_OWNER_FLAGS_REPLACE, NULL, NULL, NULL, NULL);
+	}
+	g_object_unref(connection);
+}
+
+
+
+/*
+ * Overlay
+ */
+
+static gboolean update_overlay(UNUSED gpointer userdata)
+{
+	FrameSummary s;
+	summarize(&s);
+	gchar *text = g_strdup_printf(
+		"%.0f fps, %u missed\n"
+		"frame %.1f / %.1f / %.1f ms (p50/p99/max)\n"
+		"layout %.1f / %.1f ms, paint %.1f / %.1f ms",
+		s.fps, s.missed,
+		s.frameP50, s.frameP99, s.frameMax,
+		s.layoutP50, s.layoutP99, s.paintP50, s.paintP99);
+	clutter_text_set_text(CLUTTER_TEXT(overlay), text);
+	g_free(text);
+	return G_SOURCE_CONTINUE;
+}
+
+void graphene_frame_stats_toggle_overlay(void)
+{
+	g_return_if_fail(stage);
+
+	if(overlay)
+	{
+		g_source_remove(overlaySourceId);
+		overlaySourceId = 0;
+		clutter_actor_destroy(overlay);
+		overlay = NULL;
+		return;
+	}
+
+	ClutterColor fg = {255, 255, 255, 255};
+	ClutterColor bg = {0, 0, 0, 180};
+	overlay = clutter_text_new_full("Monospace 9", "", &fg);
+	clutter_actor_set_background_color(overlay, &bg);
+	clutter_actor_set_reactive(overlay, FALSE);
+	clutter_actor_set_position(overlay, 8, 40);
+	clutter_actor_insert_child_above(CLUTTER_ACTOR(stage), overlay, NULL);
+	update_overlay(NULL);
+	overlaySourceId = g_timeout_add(FRAME_STATS_OVERLAY_INTERVAL, update_overlay, NULL);
+}
+
+
+
+gdouble graphene_frame_stats_get_average_cost(void)
+{
+	return averageCost;
+}
+
+void graphene_frame_stats_start(ClutterStage *stage_)
+{
+	g_return_if_fail(CLUTTER_IS_STAGE(stage_));
+	g_return_if_fail(stage == NULL);
+	stage = stage_;
+
+	clutter_threads_add_repaint_func_full(CLUTTER_REPAINT_FLAGS_PRE_PAINT, on_pre_paint, NULL, NULL);
+	clutter_threads_add_repaint_func_full(CLUTTER_REPAINT_FLAGS_POST_PAINT, on_post_paint, NULL, NULL);
+	g_signal_connect(stage, "paint", G_CALLBACK(on_stage_paint), NULL);
+	g_signal_connect(stage, "after-paint", G_CALLBACK(on_stage_after_paint), NULL);
+
+	g_bus_get(G_BUS_TYPE_SESSION, NULL, on_bus_acquired, NULL);
+}
@@ -0,0 +1,53 @@
+/*
+ * This file is part of graphene-desktop, the desktop environment of VeltOS.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * frame-stats.h/c
+ */
+
+#ifndef __GRAPHENE_FRAME_STATS_H__
+#define __GRAPHENE_FRAME_STATS_H__
+
+#include <clutter/clutter.h>
+
+G_BEGIN_DECLS
+
+#define GRAPHENE_FRAME_BUDGET 16667 // us, one frame at 60Hz
+#define GRAPHENE_FRAME_IDLE_GAP 100000 // us; a longer gap between frames means the stage was idle
+
+/*
+ * Starts recording layout and paint times of every frame drawn on the
+ * stage, and exports them on the session bus (see the
+ * io.velt.GrapheneShell.FrameStats interface in shell-dbus-iface.xml).
+ */
+void graphene_frame_stats_start(ClutterStage *stage);
+
+/*
+ * Returns a moving average of how long recent frames took to draw, from
+ * pre-paint to after-paint (not counting the swap), in microseconds. This is drawing cost, not the
+ * time between frames, so it stays low while the stage redraws rarely.
+ * Returns 0 before the first frame.
+ */
+gdouble graphene_frame_stats_get_average_cost(void);
+
+/*
+ * Shows or hides a small text overlay of recent frame times in the corner
+ * of the stage.
+ */
+void graphene_frame_stats_toggle_overlay(void);
+
+G_END_DECLS
+
+#endif /* __GRAPHENE_FRAME_STATS_H__ */
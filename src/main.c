@@ -23,6 +23,10 @@
  *
  * Code dealing with Mutter must be GPL'd, but session management code
  * is under the Apache License and in its own file.
+ *
+ * With --no-session, the session manager instead runs in its own process
+ * (graphene-session, see session-main.c), which launches this as a client.
+ * Session dialogs are then requested over DBus (shell-dbus-iface.xml).
  */
 
 #include <meta/main.h>
@@ -30,6 +34,10 @@
 #include <glib-unix.h>
 #include "session.h"
 #include "wm.h"
+#include "watchdog.h"
+#include "dialog.h"
+#include "pkagent.h"
+#include <shell-dbus-iface.h>
 #include <stdio.h>
 
 #ifndef GRAPHENE_VERSION_STR
@@ -40,11 +48,26 @@
 #define GRAPHENE_DEBUG FALSE
 #endif
 
+#define SESSION_DBUS_NAME "org.gnome.SessionManager"
+#define SESSION_DBUS_PATH "/org/gnome/SessionManager"
+#define SHELL_DBUS_NAME "io.velt.GrapheneShell"
+#define SHELL_DBUS_PATH "/io/velt/GrapheneShell"
+
 G_DEFINE_TYPE(GrapheneWM, graphene_wm, META_TYPE_PLUGIN);
 static gboolean on_exit_signal(gpointer userdata);
 static void on_session_startup_complete(gpointer userdata);
-static void on_show_dialog(ClutterActor *dialog, gpointer userdata);
+static void on_show_dialog(const gchar *message, const gchar * const *buttons, gpointer userdata);
+static void on_show_pk_dialog(ClutterActor *dialog, gpointer userdata);
 static void on_session_quit(gboolean failed, gpointer userdata);
+static void shell_init(GrapheneWM *wm);
+
+static gboolean noSession = FALSE;
+static GrapheneWM *wmInstance = NULL; // Never destroyed; see graphene_wm_class_init
+
+// Split mode only (--no-session)
+static GDBusConnection *shellBus = NULL;
+static DBusGrapheneShell *shellSkeleton = NULL;
+static gchar *clientObjectPath = NULL; // Our client object on the session manager
 
 int main(int argc, char **argv)
 {
@@ -80,8 +103,14 @@ int main(int argc, char **argv)
 	meta_set_wm_name("GRAPHENE Desktop");
 	meta_set_gnome_wm_keybindings("Mutter,GNOME Shell");
 	
+	GOptionEntry entries[] = {
+		{"no-session", 0, 0, G_OPTION_ARG_NONE, &noSession, "Run under a separate session manager (graphene-session)", NULL},
+		{NULL}
+	};
+
 	GError *error = NULL;
 	GOptionContext *opt = meta_get_option_context();
+	g_option_context_add_main_entries(opt, entries, NULL);
 	if(!g_option_context_parse(opt, &argc, &argv, &error))
 	{
 		g_critical("Bad arguments to graphene-wm: %s", error->message);
@@ -95,7 +124,12 @@ int main(int argc, char **argv)
 	g_unsetenv("NO_AT_BRIDGE");
 	g_unsetenv("NO_GAIL");
 	
-	return meta_run();
+	graphene_watchdog_start();
+	int ret = meta_run();
+	if(wmInstance)
+		graphene_wm_stop(wmInstance);
+	graphene_watchdog_stop();
+	return ret;
 }
 
 static void graphene_wm_class_init(GrapheneWMClass *class)
@@ -113,7 +147,12 @@ static void graphene_wm_class_init(GrapheneWMClass *class)
 
 static void graphene_wm_init(GrapheneWM *wm)
 {
-	graphene_session_init(on_session_startup_complete, on_show_dialog, on_session_quit, wm);
+	wmInstance = wm;
+	if(noSession)
+		shell_init(wm);
+	else
+		graphene_session_init(on_session_startup_complete, on_show_dialog, on_session_quit, wm);
+	graphene_pk_agent_init(on_show_pk_dialog, wm);
 
 	g_unix_signal_add(SIGTERM, (GSourceFunc)on_exit_signal, NULL);
 	g_unix_signal_add(SIGINT, (GSourceFunc)on_exit_signal, NULL);
@@ -123,7 +162,13 @@ static void graphene_wm_init(GrapheneWM *wm)
 static gboolean on_exit_signal(UNUSED gpointer userdata)
 {
 	g_warning("SIGTERM/INT/HUP. Aborting.");
-	graphene_session_exit(TRUE);
+	if(noSession)
+	{
+		graphene_pk_agent_exit();
+		meta_quit(META_EXIT_SUCCESS);
+	}
+	else
+		graphene_session_exit(TRUE);
 	return G_SOURCE_CONTINUE;
 }
 
@@ -134,7 +179,40 @@ static void on_session_startup_complete(gpointer userdata)
 	graphene_wm_show_dialog(GRAPHENE_WM(userdata), NULL);
 }
 
-static void on_show_dialog(ClutterActor *dialog, gpointer userdata)
+static void on_session_dialog_select(UNUSED GrapheneDialog *dialog, const gchar *button, UNUSED gpointer userdata)
+{
+	if(noSession)
+	{
+		if(shellSkeleton)
+			dbus_graphene_shell_emit_dialog_response(shellSkeleton, button);
+	}
+	else
+		graphene_session_dialog_response(button);
+}
+
+// See CSMDialogCallback in session.h
+static void on_show_dialog(const gchar *message, const gchar * const *buttons, gpointer userdata)
+{
+	GrapheneWM *wm = GRAPHENE_WM(userdata);
+	if(!buttons)
+	{
+		graphene_wm_show_dialog(wm, NULL);
+	}
+	else if(!message && !buttons[0])
+	{
+		graphene_wm_show_dialog(wm, clutter_actor_new());
+	}
+	else
+	{
+		GrapheneDialog *dialog = graphene_dialog_new();
+		graphene_dialog_set_message(dialog, message);
+		graphene_dialog_set_buttons(dialog, buttons);
+		g_signal_connect(dialog, "select", G_CALLBACK(on_session_dialog_select), NULL);
+		graphene_wm_show_dialog(wm, CLUTTER_ACTOR(dialog));
+	}
+}
+
+static void on_show_pk_dialog(ClutterActor *dialog, gpointer userdata)
 {
 	graphene_wm_show_dialog(GRAPHENE_WM(userdata), dialog);
 }
@@ -142,11 +220,155 @@ static void on_show_dialog(ClutterActor *dialog, gpointer userdata)
 static void on_session_quit(gboolean failed, UNUSED gpointer userdata)
 {
 	g_message("SM has completed %s. Exiting mutter.", failed ? "with an error" : "successfully");
+	graphene_pk_agent_exit();
 	meta_quit(failed ? META_EXIT_ERROR : META_EXIT_SUCCESS);
 }
 
 // Called directly from wm.c (extern)
 void wm_request_logout(UNUSED gpointer userdata)
 {
-	graphene_session_request_logout();
+	if(noSession)
+	{
+		// The session manager shows its logout dialog through ShowDialog
+		if(shellBus)
+			g_dbus_connection_call(shellBus, SESSION_DBUS_NAME, SESSION_DBUS_PATH, SESSION_DBUS_NAME,
+				"Logout", g_variant_new("(u)", 0), NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, NULL);
+	}
+	else
+		graphene_session_request_logout();
+}
+
+
+
+/*
+ * Split mode (--no-session)
+ * Registers with the session manager as a client, and once the session is
+ * running, hides the startup cover and exports io.velt.GrapheneShell so the
+ * session manager can show its dialogs. Exporting only after hiding the
+ * cover keeps a dialog sent straight away from being closed with it.
+ */
+
+static gboolean on_shell_show_dialog(DBusGrapheneShell *object, GDBusMethodInvocation *invocation, const gchar *message, const gchar * const *buttons, GrapheneWM *wm)
+{
+	on_show_dialog((message && *message) ? message : NULL, buttons, wm);
+	dbus_graphene_shell_complete_show_dialog(object, invocation);
+	return TRUE;
+}
+
+static gboolean on_shell_close_dialog(DBusGrapheneShell *object, GDBusMethodInvocation *invocation, GrapheneWM *wm)
+{
+	on_show_dialog(NULL, NULL, wm);
+	dbus_graphene_shell_complete_close_dialog(object, invocation);
+	return TRUE;
+}
+
+static void shell_export(GrapheneWM *wm)
+{
+	if(shellSkeleton)
+		return;
+
+	// Hide the startup cover
+	graphene_wm_show_dialog(wm, NULL);
+
+	shellSkeleton = dbus_graphene_shell_skeleton_new();
+	g_signal_connect(shellSkeleton, "handle-show-dialog", G_CALLBACK(on_shell_show_dialog), wm);
+	g_signal_connect(shellSkeleton, "handle-close-dialog", G_CALLBACK(on_shell_close_dialog), wm);
+	if(!g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(shellSkeleton), shellBus, SHELL_DBUS_PATH, NULL))
+	{
+		g_critical("Failed to export shell dbus object. Session dialogs will not be shown.");
+		return;
+	}
+	g_bus_own_name_on_connection(shellBus, SHELL_DBUS_NAME, G_BUS_NAME_OWNER_FLAGS_REPLACE, NULL, NULL, NULL, NULL);
+}
+
+static void on_session_running(UNUSED GDBusConnection *connection, UNUSED const gchar *sender, UNUSED const gchar *objectPath, UNUSED const gchar *interfaceName, UNUSED const gchar *signalName, UNUSED GVariant *parameters, gpointer userdata)
+{
+	shell_export(GRAPHENE_WM(userdata));
+}
+
+static void on_is_session_running(GDBusConnection *connection, GAsyncResult *res, gpointer userdata)
+{
+	GVariant *ret = g_dbus_connection_call_finish(connection, res, NULL);
+	if(!ret)
+		return;
+	gboolean running = FALSE;
+	g_variant_get(ret, "(b)", &running);
+	g_variant_unref(ret);
+	if(running)
+		shell_export(GRAPHENE_WM(userdata));
+}
+
+static void end_session_response()
+{
+	g_dbus_connection_call(shellBus, SESSION_DBUS_NAME, clientObjectPath, SESSION_DBUS_NAME ".ClientPrivate",
+		"EndSessionResponse", g_variant_new("(bs)", TRUE, ""), NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, NULL);
+}
+
+static void on_client_private_signal(UNUSED GDBusConnection *connection, UNUSED const gchar *sender, UNUSED const gchar *objectPath, UNUSED const gchar *interfaceName, const gchar *signalName, UNUSED GVariant *parameters, UNUSED gpointer userdata)
+{
+	if(g_strcmp0(signalName, "QueryEndSession") == 0)
+	{
+		end_session_response();
+	}
+	else if(g_strcmp0(signalName, "EndSession") == 0 || g_strcmp0(signalName, "Stop") == 0)
+	{
+		if(g_strcmp0(signalName, "EndSession") == 0)
+			end_session_response();
+		g_dbus_connection_flush_sync(shellBus, NULL, NULL);
+		graphene_pk_agent_exit();
+		meta_quit(META_EXIT_SUCCESS);
+	}
+}
+
+static void on_client_registered(GDBusConnection *connection, GAsyncResult *res, gpointer userdata)
+{
+	GError *error = NULL;
+	GVariant *ret = g_dbus_connection_call_finish(connection, res, &error);
+	if(!ret)
+	{
+		g_critical("Failed to register with the session manager: %s", error->message);
+		g_error_free(error);
+		return;
+	}
+	g_variant_get(ret, "(o)", &clientObjectPath);
+	g_variant_unref(ret);
+	g_message("Registered with the session manager as %s", clientObjectPath);
+
+	g_dbus_connection_signal_subscribe(shellBus, SESSION_DBUS_NAME, SESSION_DBUS_NAME ".ClientPrivate", NULL,
+		clientObjectPath, NULL, G_DBUS_SIGNAL_FLAGS_NONE, on_client_private_signal, userdata, NULL);
+
+	// Wait for the session to be running before dropping the startup cover,
+	// like on_session_startup_complete does when the session is in-process.
+	g_dbus_connection_signal_subscribe(shellBus, SESSION_DBUS_NAME, SESSION_DBUS_NAME, "SessionRunning",
+		SESSION_DBUS_PATH, NULL, G_DBUS_SIGNAL_FLAGS_NONE, on_session_running, userdata, NULL);
+	g_dbus_connection_call(shellBus, SESSION_DBUS_NAME, SESSION_DBUS_PATH, SESSION_DBUS_NAME,
+		"IsSessionRunning", NULL, G_VARIANT_TYPE("(b)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+		(GAsyncReadyCallback)on_is_session_running, userdata);
+}
+
+static void on_shell_bus_acquired(UNUSED GObject *source, GAsyncResult *res, gpointer userdata)
+{
+	GError *error = NULL;
+	shellBus = g_bus_get_finish(res, &error);
+	if(!shellBus)
+	{
+		g_critical("Failed to acquire Session DBus connection: %s", error->message);
+		g_error_free(error);
+		return;
+	}
+
+	// Don't pass our startup id on to apps launched from the panel
+	gchar *startupId = g_strdup(g_getenv("DESKTOP_AUTOSTART_ID"));
+	g_unsetenv("DESKTOP_AUTOSTART_ID");
+
+	g_dbus_connection_call(shellBus, SESSION_DBUS_NAME, SESSION_DBUS_PATH, SESSION_DBUS_NAME,
+		"RegisterClient", g_variant_new("(ss)", "graphene-desktop", startupId ? startupId : ""),
+		G_VARIANT_TYPE("(o)"), G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+		(GAsyncReadyCallback)on_client_registered, userdata);
+	g_free(startupId);
+}
+
+static void shell_init(GrapheneWM *wm)
+{
+	g_bus_get(G_BUS_TYPE_SESSION, NULL, on_shell_bus_acquired, wm);
 }
@@ -36,7 +36,8 @@ struct _GraphenePanel
 	GrapheneStatusNotifierHost *snHost;
 
 	CmkWidget *tasklist;
-	GHashTable *windows; // GrapheneWindow * (not owned) to CmkWidget * (not refed)
+	GHashTable *windows; // GrapheneWindow * (not owned) to CmkButton * (not refed)
+	GHashTable *buttons; // CmkButton * to GrapheneWindow *; reverse of windows
 };
 
 static void graphene_panel_dispose(GObject *self_);
@@ -93,6 +94,7 @@ static void graphene_panel_init(GraphenePanel *self)
 
 	// Tasklist
 	self->windows = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)clutter_actor_destroy);
+	self->buttons = g_hash_table_new(g_direct_hash, g_direct_equal);
 	self->tasklist = cmk_widget_new();
 	clutter_actor_set_layout_manager(CLUTTER_ACTOR(self->tasklist), clutter_box_layout_new());
 	clutter_actor_set_x_expand(CLUTTER_ACTOR(self->tasklist), TRUE);
@@ -125,7 +127,8 @@ static void graphene_panel_init(GraphenePanel *self)
 static void graphene_panel_dispose(GObject *self_)
 {
 	GraphenePanel *self = GRAPHENE_PANEL(self_);
-	g_hash_table_unref(self->windows);
+	g_clear_pointer(&self->buttons, g_hash_table_unref);
+	g_clear_pointer(&self->windows, g_hash_table_unref);
 	G_OBJECT_CLASS(graphene_panel_parent_class)->dispose(self_);
 }
 
@@ -266,19 +269,7 @@ static void on_settings_button_activate(CmkButton *button, GraphenePanel *self)
 
 static void on_tasklist_button_activate(CmkButton *button, GraphenePanel *self)
 {
-	GrapheneWindow *window = NULL;
-	GHashTableIter iter;
-	gpointer key, value;
-	g_hash_table_iter_init(&iter, self->windows);
-	while(g_hash_table_iter_next(&iter, &key, &value))
-	{
-		if(value == button)
-		{
-			window = key;
-			break;
-		}
-	}
-	
+	GrapheneWindow *window = g_hash_table_lookup(self->buttons, button);
 	if(!window)
 		return;
 
@@ -288,8 +279,12 @@ static void on_tasklist_button_activate(CmkButton *button, GraphenePanel *self)
 		window->minimize(window);
 }
 
-static void on_tasklist_button_allocation_changed(CmkButton *button, UNUSED ClutterActorBox *box, UNUSED ClutterAllocationFlags flags, GrapheneWindow *window)
+static void on_tasklist_button_allocation_changed(CmkButton *button, UNUSED ClutterActorBox *box, UNUSED ClutterAllocationFlags flags, GraphenePanel *self)
 {
+	// Buttons animating out no longer have a window
+	GrapheneWindow *window = g_hash_table_lookup(self->buttons, button);
+	if(!window)
+		return;
 	gfloat x, y, width, height;
 	clutter_actor_get_transformed_position(CLUTTER_ACTOR(button), &x, &y);
 	clutter_actor_get_transformed_size(CLUTTER_ACTOR(button), &width, &height);
@@ -304,11 +299,12 @@ void graphene_panel_add_window(GraphenePanel *self, GrapheneWindow *window)
 
 	CmkButton *button = cmk_button_new(CMK_BUTTON_TYPE_EMBED);
 	g_signal_connect(button, "activate", G_CALLBACK(on_tasklist_button_activate), self);
-	g_signal_connect(button, "allocation-changed", G_CALLBACK(on_tasklist_button_allocation_changed), window);
+	g_signal_connect(button, "allocation-changed", G_CALLBACK(on_tasklist_button_allocation_changed), self);
 	cmk_button_set_content(button, CMK_WIDGET(icon));
 
 	clutter_actor_add_child(CLUTTER_ACTOR(self->tasklist), CLUTTER_ACTOR(button));
 	g_hash_table_insert(self->windows, window, button);
+	g_hash_table_insert(self->buttons, button, window);
 	
 	ClutterActor *buttonActor = CLUTTER_ACTOR(button);
 	clutter_actor_set_pivot_point(buttonActor, 0.5, 0.5);
@@ -321,30 +317,26 @@ void graphene_panel_add_window(GraphenePanel *self, GrapheneWindow *window)
 	TRANSITION_MEMLEAK_FIX(button, "scale-x");
 	TRANSITION_MEMLEAK_FIX(button, "scale-y");
 
-	graphene_panel_update_window(self, window);
+	cmk_icon_set_icon(icon, window->icon);
+	cmk_button_set_selected(button, (window->flags & GRAPHENE_WINDOW_FLAG_FOCUSED));
 }
 
-static void remove_window_complete(GraphenePanel *self, CmkButton *button)
+static void remove_window_complete(CmkButton *button)
 {
-	GHashTableIter iter;
-	gpointer key, value;
-	g_hash_table_iter_init(&iter, self->windows);
-	while(g_hash_table_iter_next(&iter, &key, &value))
-	{
-		if(value == button)
-		{
-			g_hash_table_iter_remove(&iter);
-			return;
-		}
-	}
+	clutter_actor_destroy(CLUTTER_ACTOR(button));
 }
 
 void graphene_panel_remove_window(GraphenePanel *self, GrapheneWindow *window)
 {
+	// The window may be freed right after this, so forget it now and let
+	// the button finish animating out on its own.
 	ClutterActor *button = CLUTTER_ACTOR(g_hash_table_lookup(self->windows, window));
 	if(!button)
 		return;
-	g_signal_connect_swapped(button, "transitions_completed", G_CALLBACK(remove_window_complete), self);
+	g_hash_table_remove(self->buttons, button);
+	g_hash_table_steal(self->windows, window);
+
+	g_signal_connect(button, "transitions_completed", G_CALLBACK(remove_window_complete), NULL);
 	clutter_actor_save_easing_state(button);
 	clutter_actor_set_easing_mode(button, CLUTTER_EASE_IN_BACK);
 	clutter_actor_set_easing_duration(button, 200);
@@ -357,17 +349,27 @@ void graphene_panel_remove_window(GraphenePanel *self, GrapheneWindow *window)
 void graphene_panel_update_window(GraphenePanel *self, GrapheneWindow *window)
 {
 	CmkButton *button = g_hash_table_lookup(self->windows, window);
-	if(button)
+
+	if(!button && !(window->flags & GRAPHENE_WINDOW_FLAG_SKIP_TASKBAR))
+	{
+		graphene_panel_add_window(self, window);
+		return;
+	}
+	else if(button && (window->flags & GRAPHENE_WINDOW_FLAG_SKIP_TASKBAR))
+	{
+		graphene_panel_remove_window(self, window);
+		return;
+	}
+	else if(!button)
+		return;
+
+	// The tasklist doesn't show titles, so only icon and flag changes matter
+	if(window->changed & GRAPHENE_WINDOW_CHANGED_ICON)
 	{
 		CmkWidget *content = cmk_button_get_content(button);
 		cmk_icon_set_icon(CMK_ICON(content), window->icon);
 	}
 
-	if(button)
+	if(window->changed & GRAPHENE_WINDOW_CHANGED_FLAGS)
 		cmk_button_set_selected(button, (window->flags & GRAPHENE_WINDOW_FLAG_FOCUSED));
-
-	if(!button && !(window->flags & GRAPHENE_WINDOW_FLAG_SKIP_TASKBAR))
-		graphene_panel_add_window(self, window);
-	else if(button && (window->flags & GRAPHENE_WINDOW_FLAG_SKIP_TASKBAR))
-		graphene_panel_remove_window(self, window);
 }
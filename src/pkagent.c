@@ -0,0 +1,306 @@
+/*
+ * This file is part of graphene-desktop, the desktop environment of VeltOS.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * pkagent.c
+ * PolicyKit Authentication Agent
+ *
+ * The Authentication Agent is responsible for displaying a dialog box asking
+ * for a password or some other form of authentication when an unprivileged
+ * application needs to preform a privilged operation (for example, GNOME
+ * Control Center modifying users in the Users panel).
+ * 
+ * How it works:
+ * An unprivileged application sends a request to the Polkit Authority Daemon
+ * via DBus, and then the Authority asks us to display a dialog. We display
+ * a dialog, and using the password/response from the user, launch an
+ * a helper app with the necessary privileges. This helper app then attempts
+ * to send a completion request to the Authority. If it worked, the original
+ * application gets permission to do its operation, and we close our dialog.
+ * The whole "helper app" part of this process is done for us by the
+ * polkitagent library.
+ *
+ * The agent lives in the compositor (rather than the session manager) since
+ * it needs to draw its dialogs.
+ */
+
+#include "pkagent.h"
+#include "pkauthdialog.h"
+#include "async-sequence.h"
+#include <gio/gio.h>
+#include <unistd.h>
+#include <session-dbus-iface.h>
+
+#define POLKIT_AUTH_AGENT_DBUS_PATH "/io/velt/PolicyKit1/AuthenticationAgent"
+
+// Generated name is a bit too long...
+typedef DBusOrgFreedesktopPolicyKit1AuthenticationAgent DBusPolkitAuthAgent; 
+
+typedef struct {
+	GraphenePkAgentDialogCallback dialogCb;
+	gpointer cbUserdata;
+
+	GCancellable *cancel;
+	GDBusConnection *yBus; // sYstem DBus Connection
+	DBusPolkitAuthAgent *dbusPkAgentSkeleton;
+	gchar *ldSessionObject; // DBus session object path provided by systemd-logind
+
+	GList *pkAuthDialogList; // In case multiple requests come in at once, put them in a wait list. The first in the list is always the current one.
+} GraphenePkAgent;
+
+static void async_init_sequence(UNUSED GObject *source, GAsyncResult *res, gpointer userdata);
+static void on_pk_auth_dialog_complete(GraphenePKAuthDialog *dialog, gboolean cancelled, gboolean gainedAuthentication, gpointer userdata);
+static gboolean on_pk_agent_begin_authentication(DBusPolkitAuthAgent *object, GDBusMethodInvocation *invocation, const gchar *actionId, const gchar *message, const gchar *iconName, GVariant *details, const gchar *cookie, GVariant *identities);
+static gboolean on_pk_agent_cancel_authentication(DBusPolkitAuthAgent *object, GDBusMethodInvocation *invocation, const gchar *cookie);
+
+static GraphenePkAgent *agent = NULL;
+
+
+void graphene_pk_agent_init(GraphenePkAgentDialogCallback dialogCb, gpointer userdata)
+{
+	if(agent || !dialogCb)
+		return;
+
+	agent = g_new0(GraphenePkAgent, 1);
+	agent->dialogCb = dialogCb;
+	agent->cbUserdata = userdata;
+	agent->cancel = g_cancellable_new();
+	async_init_sequence(NULL, NULL, NULL);
+}
+
+void graphene_pk_agent_exit()
+{
+	if(!agent)
+		return;
+
+	if(agent->cancel)
+		g_cancellable_cancel(agent->cancel);
+	g_clear_object(&agent->cancel);
+
+	// The authority cancels any pending requests once the agent is gone
+	if(agent->pkAuthDialogList)
+	{
+		agent->dialogCb(NULL, agent->cbUserdata); // Closes and frees the current dialog
+		for(GList *it = agent->pkAuthDialogList; it != NULL; it = it->next)
+		{
+			g_signal_handlers_disconnect_matched(it->data, G_SIGNAL_MATCH_FUNC, 0, 0, NULL, on_pk_auth_dialog_complete, NULL);
+			graphene_pk_auth_dialog_cancel(it->data);
+			if(it != agent->pkAuthDialogList)
+				clutter_actor_destroy(CLUTTER_ACTOR(it->data));
+		}
+		g_clear_pointer(&agent->pkAuthDialogList, g_list_free);
+	}
+
+	if(agent->dbusPkAgentSkeleton && g_dbus_interface_skeleton_get_connection(G_DBUS_INTERFACE_SKELETON(agent->dbusPkAgentSkeleton)))
+		g_dbus_interface_skeleton_unexport(G_DBUS_INTERFACE_SKELETON(agent->dbusPkAgentSkeleton));
+	g_clear_object(&agent->dbusPkAgentSkeleton);
+	g_clear_pointer(&agent->ldSessionObject, g_free);
+	g_clear_object(&agent->yBus);
+	g_clear_pointer(&agent, g_free);
+}
+
+// Performs the init sequence:
+// 1. Get System Bus
+// 2. Get session object (from logind)
+// 3. Get session id
+// 4. Export the agent interface and register as an authentication agent
+static void async_init_sequence(UNUSED GObject *source, GAsyncResult *res, gpointer userdata)
+{
+	GError *error = NULL;
+	GVariant *ret = NULL;
+
+	// See async-sequence.h
+	ASYNC_SEQ_BEGIN(userdata, )
+
+	// Get system bus
+	g_bus_get(G_BUS_TYPE_SYSTEM, agent->cancel, (GAsyncReadyCallback)async_init_sequence, seqdata);
+	ASYNC_SEQ_WAIT(1, )
+
+	agent->yBus = g_bus_get_finish(res, &error);
+	if(!agent->yBus || error)
+	{
+		if(!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_warning("Failed to acquire System DBus connection for the PolKit agent: %s", error ? error->message : "Unknown error");
+		g_clear_error(&error);
+		return;
+	}
+
+	// Get logind session object
+	g_dbus_connection_call(agent->yBus,
+		"org.freedesktop.login1",
+		"/org/freedesktop/login1",
+		"org.freedesktop.login1.Manager",
+		"GetSessionByPID",
+		g_variant_new("(u)", getpid()),
+		G_VARIANT_TYPE("(o)"),
+		G_DBUS_CALL_FLAGS_NONE,
+		-1,
+		agent->cancel,
+		(GAsyncReadyCallback)async_init_sequence,
+		seqdata);
+	ASYNC_SEQ_WAIT(2, )
+
+	ret = g_dbus_connection_call_finish(agent->yBus, res, &error);
+	if(!ret || error)
+	{
+		if(!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_warning("Failed to find logind session: %s", error ? error->message : "Unknown error");
+		g_clear_error(&error);
+		return;
+	}
+
+	g_variant_get(ret, "(o)", &agent->ldSessionObject);
+	g_variant_unref(ret);
+	g_message("logind session object: %s", agent->ldSessionObject);
+
+	// Get session ID
+	g_dbus_connection_call(agent->yBus,
+		"org.freedesktop.login1",
+		agent->ldSessionObject,
+		"org.freedesktop.DBus.Properties",
+		"Get",
+		g_variant_new("(ss)", "org.freedesktop.login1.Session", "Id"),
+		G_VARIANT_TYPE("(v)"),
+		G_DBUS_CALL_FLAGS_NONE,
+		-1,
+		agent->cancel,
+		(GAsyncReadyCallback)async_init_sequence,
+		seqdata);
+	ASYNC_SEQ_WAIT(3, )
+
+	ret = g_dbus_connection_call_finish(agent->yBus, res, &error);
+	if(!ret || error)
+	{
+		if(!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_warning("Failed to get session id: %s", error ? error->message : "Unknown error");
+		g_clear_error(&error);
+		return;
+	}
+
+	GVariant *sessionIdV = NULL;
+	g_variant_get(ret, "(v)", &sessionIdV);
+	g_variant_unref(ret);
+
+	// Setup authentication agent interface
+	agent->dbusPkAgentSkeleton = dbus_org_freedesktop_policy_kit1_authentication_agent_skeleton_new();
+	g_signal_connect(agent->dbusPkAgentSkeleton, "handle-begin-authentication", G_CALLBACK(on_pk_agent_begin_authentication), NULL);
+	g_signal_connect(agent->dbusPkAgentSkeleton, "handle-cancel-authentication", G_CALLBACK(on_pk_agent_cancel_authentication), NULL);
+	
+	if(!g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(agent->dbusPkAgentSkeleton), agent->yBus, POLKIT_AUTH_AGENT_DBUS_PATH, NULL))
+	{
+		g_warning("Failed to export PolKit authentication agent dbus object.");
+		g_variant_unref(sessionIdV);
+		return;
+	}
+
+	GVariantBuilder builder;
+	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+	g_variant_builder_add(&builder, "{sv}", "session-id", sessionIdV);
+	GVariant *dict = g_variant_builder_end(&builder); // dict is Floating
+	g_variant_unref(sessionIdV);
+	
+	// Register as authentication agent
+	g_dbus_connection_call(agent->yBus,
+		"org.freedesktop.PolicyKit1",
+		"/org/freedesktop/PolicyKit1/Authority",
+		"org.freedesktop.PolicyKit1.Authority",
+		"RegisterAuthenticationAgent",
+		g_variant_new("((s@a{sv})ss)",
+			"unix-session",
+			dict, // dict absorbed
+			g_getenv("LANG"),
+			POLKIT_AUTH_AGENT_DBUS_PATH),
+		NULL,
+		G_DBUS_CALL_FLAGS_NONE,
+		-1,
+		agent->cancel,
+		(GAsyncReadyCallback)async_init_sequence,
+		seqdata);
+	ASYNC_SEQ_WAIT(4, )
+
+	ret = g_dbus_connection_call_finish(agent->yBus, res, &error);
+	if(!ret || error)
+	{
+		if(!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			g_warning("Failed to register as PolKit Authentication Agent: %s", error ? error->message : "Unknown error");
+		g_clear_error(&error);
+		return;
+	}
+
+	g_variant_unref(ret);
+	g_message("Registered as authentication agent");
+
+	ASYNC_SEQ_END()
+}
+
+static void on_pk_auth_dialog_complete(GraphenePKAuthDialog *dialog, gboolean cancelled, UNUSED gboolean gainedAuthentication, gpointer userdata)
+{
+	if(G_IS_DBUS_METHOD_INVOCATION(userdata))
+	{
+		GDBusMethodInvocation *invocation = G_DBUS_METHOD_INVOCATION(userdata);
+		if(cancelled)
+			g_dbus_method_invocation_return_dbus_error(invocation, "org.freedesktop.PolicyKit1.Error.Cancelled", "Cancelled");
+		else
+			dbus_org_freedesktop_policy_kit1_authentication_agent_complete_begin_authentication(agent->dbusPkAgentSkeleton, invocation);
+	}
+
+	gboolean current = agent->pkAuthDialogList && agent->pkAuthDialogList->data == dialog;
+	agent->pkAuthDialogList = g_list_remove(agent->pkAuthDialogList, dialog);
+	
+	if(!current)
+	{
+		// Was still waiting in the queue, never shown
+		clutter_actor_destroy(CLUTTER_ACTOR(dialog));
+		return;
+	}
+
+	// This closes and frees the dialog
+	agent->dialogCb(NULL, agent->cbUserdata);
+
+	// Show the next dialog in the queue, if any
+	if(agent->pkAuthDialogList != NULL)
+		agent->dialogCb(CLUTTER_ACTOR(agent->pkAuthDialogList->data), agent->cbUserdata);
+}
+
+static gboolean on_pk_agent_begin_authentication(UNUSED DBusPolkitAuthAgent *object, GDBusMethodInvocation *invocation, const gchar *actionId, const gchar *message, const gchar *iconName, UNUSED GVariant *details, const gchar *cookie, GVariant *identitiesV)
+{
+	GError *error = NULL;
+	GraphenePKAuthDialog *dialog = graphene_pk_auth_dialog_new(actionId, message, iconName, cookie, identitiesV, &error);
+	if(!dialog)
+	{
+		g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED, "%s", error->message);
+		g_error_free(error);
+		return TRUE;
+	}
+
+	g_signal_connect(dialog, "complete", G_CALLBACK(on_pk_auth_dialog_complete), invocation);
+
+	gboolean firstDialog = agent->pkAuthDialogList == NULL;
+	agent->pkAuthDialogList = g_list_append(agent->pkAuthDialogList, dialog);
+
+	if(firstDialog)
+		agent->dialogCb(CLUTTER_ACTOR(dialog), agent->cbUserdata);
+	return TRUE;
+}
+
+static gboolean on_pk_agent_cancel_authentication(DBusPolkitAuthAgent *object, GDBusMethodInvocation *invocation, UNUSED const gchar *cookie)
+{
+	// TODO: Validate cookie
+	if(agent && agent->pkAuthDialogList && agent->pkAuthDialogList->data)
+		graphene_pk_auth_dialog_cancel(agent->pkAuthDialogList->data);
+
+	dbus_org_freedesktop_policy_kit1_authentication_agent_complete_cancel_authentication(object, invocation);
+	return TRUE;
+}
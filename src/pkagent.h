@@ -0,0 +1,44 @@
+/*
+ * This file is part of graphene-desktop, the desktop environment of VeltOS.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ * 
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * pkagent.h/c
+ */
+
+#ifndef __GRAPHENE_PK_AGENT_H__
+#define __GRAPHENE_PK_AGENT_H__
+
+#include <glib.h>
+#include <clutter/clutter.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Called to show an authentication dialog, or with NULL to close the
+ * current one.
+ */
+typedef void (*GraphenePkAgentDialogCallback)(ClutterActor *dialog, gpointer userdata);
+
+/*
+ * Registers as the PolicyKit authentication agent for the logind session
+ * this process belongs to. Runs asynchronously; failing to register is not
+ * fatal, but applications won't be able to ask for authentication.
+ */
+void graphene_pk_agent_init(GraphenePkAgentDialogCallback dialogCb, gpointer userdata);
+void graphene_pk_agent_exit();
+
+G_END_DECLS
+
+#endif /* __GRAPHENE_PK_AGENT_H__ */
@@ -0,0 +1,181 @@
+/*
+ * This file is part of graphene-desktop, the desktop environment of VeltOS.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * session-main.c
+ * Entry point of graphene-session, which runs the session manager in its own
+ * process and launches graphene-desktop (the window manager) as a client.
+ * If the window manager crashes, it is restarted without taking the rest of
+ * the session down with it. Dialogs are shown by the window manager through
+ * its io.velt.GrapheneShell DBus interface.
+ *
+ * This only works on X11, where the window manager isn't also the display
+ * server. Running graphene-desktop directly keeps the session inside the
+ * window manager process, as before.
+ */
+
+#include "session.h"
+#include <gio/gio.h>
+#include <glib-unix.h>
+#include <signal.h>
+
+#define SHELL_DBUS_NAME "io.velt.GrapheneShell"
+#define SHELL_DBUS_PATH "/io/velt/GrapheneShell"
+#define SHELL_DBUS_IFACE "io.velt.GrapheneShell"
+#define DEFAULT_WINDOW_MANAGER "graphene-desktop --no-session"
+
+static GMainLoop *loop = NULL;
+static gint exitStatus = 0;
+
+// The dialog the session currently wants shown. Kept so it can be sent
+// again if the window manager restarts while it's open.
+static gchar *dialogMessage = NULL;
+static gchar **dialogButtons = NULL; // NULL if no dialog is open
+
+static GDBusConnection *shellConnection = NULL; // Set while the shell is on the bus
+static guint responseSubscriptionId = 0;
+
+static gboolean on_exit_signal(gpointer userdata);
+static void on_session_startup_complete(gpointer userdata);
+static void on_show_dialog(const gchar *message, const gchar * const *buttons, gpointer userdata);
+static void on_session_quit(gboolean failed, gpointer userdata);
+static void on_shell_appeared(GDBusConnection *connection, const gchar *name, const gchar *owner, gpointer userdata);
+static void on_shell_vanished(GDBusConnection *connection, const gchar *name, gpointer userdata);
+
+int main(int argc, char **argv)
+{
+	gchar *windowManager = NULL;
+	GOptionEntry entries[] = {
+		{"window-manager", 0, 0, G_OPTION_ARG_STRING, &windowManager, "Window manager command (default: '" DEFAULT_WINDOW_MANAGER "')", "COMMAND"},
+		{NULL}
+	};
+
+	GError *error = NULL;
+	GOptionContext *opt = g_option_context_new(NULL);
+	g_option_context_add_main_entries(opt, entries, NULL);
+	if(!g_option_context_parse(opt, &argc, &argv, &error))
+	{
+		g_critical("Bad arguments to graphene-session: %s", error->message);
+		return 1;
+	}
+	g_option_context_free(opt);
+
+	loop = g_main_loop_new(NULL, FALSE);
+
+	guint watchId = g_bus_watch_name(G_BUS_TYPE_SESSION, SHELL_DBUS_NAME, G_BUS_NAME_WATCHER_FLAGS_NONE,
+		on_shell_appeared, on_shell_vanished, NULL, NULL);
+
+	graphene_session_set_window_manager(windowManager ? windowManager : DEFAULT_WINDOW_MANAGER);
+	g_free(windowManager);
+	graphene_session_init(on_session_startup_complete, on_show_dialog, on_session_quit, NULL);
+
+	g_unix_signal_add(SIGTERM, (GSourceFunc)on_exit_signal, NULL);
+	g_unix_signal_add(SIGINT, (GSourceFunc)on_exit_signal, NULL);
+	g_unix_signal_add(SIGHUP, (GSourceFunc)on_exit_signal, NULL);
+
+	g_main_loop_run(loop);
+
+	g_bus_unwatch_name(watchId);
+	g_clear_pointer(&loop, g_main_loop_unref);
+	return exitStatus;
+}
+
+static gboolean on_exit_signal(UNUSED gpointer userdata)
+{
+	g_warning("SIGTERM/INT/HUP. Aborting.");
+	graphene_session_exit(TRUE);
+	return G_SOURCE_CONTINUE;
+}
+
+static void on_session_startup_complete(UNUSED gpointer userdata)
+{
+	// The window manager hides its startup cover on its own, once it sees
+	// the SessionRunning signal.
+	g_message("SM startup complete.");
+}
+
+static void on_session_quit(gboolean failed, UNUSED gpointer userdata)
+{
+	g_message("SM has completed %s.", failed ? "with an error" : "successfully");
+	exitStatus = failed ? 1 : 0;
+	g_main_loop_quit(loop);
+}
+
+
+
+/*
+ * Dialogs
+ */
+
+static void send_dialog()
+{
+	if(!shellConnection)
+		return;
+
+	if(dialogButtons)
+	{
+		g_dbus_connection_call(shellConnection, SHELL_DBUS_NAME, SHELL_DBUS_PATH, SHELL_DBUS_IFACE,
+			"ShowDialog", g_variant_new("(s^as)", dialogMessage ? dialogMessage : "", dialogButtons),
+			NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, NULL);
+	}
+	else
+	{
+		g_dbus_connection_call(shellConnection, SHELL_DBUS_NAME, SHELL_DBUS_PATH, SHELL_DBUS_IFACE,
+			"CloseDialog", NULL,
+			NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, NULL);
+	}
+}
+
+static void on_show_dialog(const gchar *message, const gchar * const *buttons, UNUSED gpointer userdata)
+{
+	g_clear_pointer(&dialogMessage, g_free);
+	g_clear_pointer(&dialogButtons, g_strfreev);
+	dialogMessage = g_strdup(message);
+	dialogButtons = g_strdupv((gchar **)buttons);
+	send_dialog();
+}
+
+static void on_dialog_response(UNUSED GDBusConnection *connection, UNUSED const gchar *sender, UNUSED const gchar *objectPath, UNUSED const gchar *interfaceName, UNUSED const gchar *signalName, GVariant *parameters, UNUSED gpointer userdata)
+{
+	const gchar *button = NULL;
+	g_variant_get(parameters, "(&s)", &button);
+	graphene_session_dialog_response(button);
+}
+
+static void on_shell_appeared(GDBusConnection *connection, UNUSED const gchar *name, const gchar *owner, UNUSED gpointer userdata)
+{
+	g_message("Window manager shell is on the bus (%s)", owner);
+	g_clear_object(&shellConnection);
+	shellConnection = g_object_ref(connection);
+
+	if(responseSubscriptionId)
+		g_dbus_connection_signal_unsubscribe(shellConnection, responseSubscriptionId);
+	responseSubscriptionId = g_dbus_connection_signal_subscribe(shellConnection,
+		owner, SHELL_DBUS_IFACE, "DialogResponse", SHELL_DBUS_PATH, NULL,
+		G_DBUS_SIGNAL_FLAGS_NONE, on_dialog_response, NULL, NULL);
+
+	// A freshly started shell has no dialog open, so only resend if one
+	// should be showing.
+	if(dialogButtons)
+		send_dialog();
+}
+
+static void on_shell_vanished(UNUSED GDBusConnection *connection, UNUSED const gchar *name, UNUSED gpointer userdata)
+{
+	if(shellConnection && responseSubscriptionId)
+		g_dbus_connection_signal_unsubscribe(shellConnection, responseSubscriptionId);
+	responseSubscriptionId = 0;
+	g_clear_object(&shellConnection);
+}
@@ -28,25 +28,34 @@
 #include <glib-unix.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/timerfd.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "client.h"
 #include "util.h"
 #include "status-notifier-watcher.h"
 #include <session-dbus-iface.h>
 #include <stdio.h>
-#include "pkauthdialog.h"
-#include "dialog.h"
 #include "async-sequence.h"
 
+#ifndef GRAPHENE_DEBUG
+#define GRAPHENE_DEBUG FALSE
+#endif
+
 #define GRAPHENE_SESSION_NAME "Graphene"
 #define SESSION_DBUS_NAME "org.gnome.SessionManager"
 #define SESSION_DBUS_PATH "/org/gnome/SessionManager"
-#define POLKIT_AUTH_AGENT_DBUS_PATH "/io/velt/PolicyKit1/AuthenticationAgent"
+#define SESSION_SETTINGS_SCHEMA "io.velt.desktop.session"
+#define DEFAULT_CLIENT_SAMPLE_INTERVAL 2000 // ms
+#define DEFERRED_POLL_INTERVAL 1 // Seconds between system load checks for deferred autostarts
+#define DEFERRED_MIN_DELAY 3 // Seconds after the session goes idle before any deferred autostart launches
+#define DEFERRED_MAX_DELAY 60 // Seconds after which deferred autostarts launch regardless of load
+#define PRESSURE_QUIET_THRESHOLD 10.0 // Percent of time stalled ("some avg10") below which the system is quiet
+#define LOADAVG_QUIET_THRESHOLD 0.5 // 1 minute load average per CPU below which the system is quiet
 #define SHOW_ALL_OUTPUT FALSE // Set to TRUE for release; FALSE only shows output from .desktop files with 'Graphene-ShowOutput=true'
 
-// Generated name is a bit too long...
-typedef DBusOrgFreedesktopPolicyKit1AuthenticationAgent DBusPolkitAuthAgent; 
-
 // Session phases happen in linear order and only happen at most once each.
 typedef enum {
 	// Connection to system and session dbus, aborts session on fail or
@@ -87,16 +96,31 @@ typedef struct {
 	GDBusConnection *yBus; // sYstem DBus Connection
 	guint dbusNameId;
 	DBusSessionManager *dbusSMSkeleton;
-	DBusPolkitAuthAgent *dbusPkAgentSkeleton;
-	gchar *ldSessionObject; // DBus session object path provided by systemd-logind
 	GrapheneStatusNotifierWatcher *statusNotifierWatcher;
-	
-	GList *pkAuthDialogList; // In case multiple requests come in at once, put them in a wait list. The first in the list is always the current one.
+
+	// Called with the selected button of the dialog currently being shown
+	// through dialogCb, if any.
+	void (*dialogResponseCb)(const gchar *button);
 
 	SessionPhase phase;
 	ExitType exitType;
 	
 	GList *clients;
+
+	// Only used when the window manager runs as a separate client (see
+	// graphene_session_set_window_manager). The desktop is launched once
+	// the window manager has registered.
+	GrapheneSessionClient *wmClient;
+	gboolean desktopLaunched;
+
+	// Client resource sampling. A single timerfd drives sampling of all clients.
+	gint sampleTimerFd;
+	guint sampleSourceId;
+
+	// Low priority autostarts waiting for the system to become quiet
+	GQueue *deferredLaunches; // GDesktopAppInfo
+	guint deferredSourceId;
+	gint64 deferredSince; // Monotonic time the deferred launches were queued
 } GrapheneSession;
 
 
@@ -112,6 +136,12 @@ static void do_idle_phase();
 static void stop_self_destruct();
 static void self_destruct_countdown();
 
+static void start_client_sampling();
+static void stop_client_sampling();
+
+static void start_deferred_launches();
+static void stop_deferred_launches();
+
 static void on_client_notify_ready(GrapheneSessionClient *client);
 static void on_client_notify_complete(GrapheneSessionClient *client);
 
@@ -119,12 +149,13 @@ static GHashTable * list_autostarts();
 static void launch_autostart(GDesktopAppInfo *desktopInfo);
 
 static void connect_dbus_methods();
-
-static gboolean on_pk_agent_begin_authentication(DBusPolkitAuthAgent *object, GDBusMethodInvocation *invocation, const gchar *actionId, const gchar *message, const gchar *iconName, GVariant *details, const gchar *cookie, GVariant *identities);
-static gboolean on_pk_agent_cancel_authentication(DBusPolkitAuthAgent *object, GDBusMethodInvocation *invocation, const gchar *cookie);
+#if GRAPHENE_DEBUG
+static void log_method_stats();
+#endif
 
 
 static GrapheneSession *session = NULL;
+static gchar *windowManagerArgs = NULL;
 
 /*
  * Init
@@ -145,20 +176,19 @@ void graphene_session_init(CSMStartupCompleteCallback startupCb, CSMDialogCallba
 	session->cbUserdata = cbUserdata;
 	
 	session->cancel = g_cancellable_new();
+	session->sampleTimerFd = -1;
+	session->deferredLaunches = g_queue_new();
 	async_init_sequence(NULL, NULL, NULL);
 }
 
 // Performs the init sequence:
 // 1. Get System Bus
 // 2. Get Session Bus
-// 3. Get session object (from logind)
-// 4. Register as an authentication agent
-// 5. Export/own session manager interface/name on DBus
+// 3. Export/own session manager interface/name on DBus
 // Once the name has been owned, do_startup() is called
 static void async_init_sequence(UNUSED GObject *source, GAsyncResult *res, gpointer userdata)
 {
 	GError *error = NULL;
-	GVariant *ret = NULL;
 	
 	// Begin async sequence. See async-sequence.h for details.
 	// Simply: async_init_sequence exits at calls to ASYNC_SEQ_WAIT
@@ -202,117 +232,6 @@ static void async_init_sequence(UNUSED GObject *source, GAsyncResult *res, gpoin
 	g_signal_connect(session->eBus, "closed", G_CALLBACK(on_eybus_connection_lost), NULL);
 	g_dbus_connection_set_exit_on_close(session->eBus, FALSE);
 
-	// Get logind session object
-	g_dbus_connection_call(session->yBus,
-		"org.freedesktop.login1",
-		"/org/freedesktop/login1",
-		"org.freedesktop.login1.Manager",
-		"GetSessionByPID",
-		g_variant_new("(u)", getpid()),
-		G_VARIANT_TYPE("(o)"),
-		G_DBUS_CALL_FLAGS_NONE,
-		-1,
-		session->cancel,
-		(GAsyncReadyCallback)async_init_sequence,
-		seqdata);
-	ASYNC_SEQ_WAIT(3, )
-
-	ret = g_dbus_connection_call_finish(session->yBus, res, &error);
-	if(!ret || error)
-	{
-		g_critical("Failed to find logind session: %s", error ? error->message : "Unknown error");
-		g_clear_error(&error);
-		g_clear_object(&ret);
-		graphene_session_exit(TRUE);
-		return;
-	}
-
-	g_variant_get(ret, "(o)", &session->ldSessionObject);
-	g_variant_unref(ret);
-	g_message("logind session object: %s", session->ldSessionObject);
-
-	// Get session ID
-	g_dbus_connection_call(session->yBus,
-		"org.freedesktop.login1",
-		session->ldSessionObject,
-		"org.freedesktop.DBus.Properties",
-		"Get",
-		g_variant_new("(ss)", "org.freedesktop.login1.Session", "Id"),
-		G_VARIANT_TYPE("(v)"),
-		G_DBUS_CALL_FLAGS_NONE,
-		-1,
-		session->cancel,
-		(GAsyncReadyCallback)async_init_sequence,
-		seqdata);
-	ASYNC_SEQ_WAIT(4, )
-
-	ret = g_dbus_connection_call_finish(session->yBus, res, &error);
-	if(!ret || error)
-	{
-		g_critical("Failed to get session id: %s", error ? error->message : "Unknown error");
-		g_clear_error(&error);
-		g_clear_object(&ret);
-		graphene_session_exit(TRUE);
-		return;
-	}
-
-	GVariant *sessionIdV = NULL;
-	g_variant_get(ret, "(v)", &sessionIdV);
-	g_variant_unref(ret);
-
-	// Setup authentication agent interface
-	session->dbusPkAgentSkeleton = dbus_org_freedesktop_policy_kit1_authentication_agent_skeleton_new();
-	g_signal_connect(session->dbusPkAgentSkeleton, "handle-begin-authentication", G_CALLBACK(on_pk_agent_begin_authentication), NULL);
-	g_signal_connect(session->dbusPkAgentSkeleton, "handle-cancel-authentication", G_CALLBACK(on_pk_agent_cancel_authentication), NULL);
-	
-	// TODO: Failing to register as an authentication agent probably shouldn't
-	// be fatal. The session could still run without it (although various
-	// things may not work).
-	if(!g_dbus_interface_skeleton_export(G_DBUS_INTERFACE_SKELETON(session->dbusPkAgentSkeleton), session->yBus, POLKIT_AUTH_AGENT_DBUS_PATH, NULL))
-	{
-		g_critical("Failed to export PolKit authentication agent dbus object.");
-		graphene_session_exit(TRUE);
-		return;
-	}
-
-	GVariantBuilder builder;
-	g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
-	g_variant_builder_add(&builder, "{sv}", "session-id", sessionIdV);
-	GVariant *dict = g_variant_builder_end(&builder); // dict is Floating
-	g_variant_unref(sessionIdV);
-	
-	// Register as authentication agent
-	g_dbus_connection_call(session->yBus,
-		"org.freedesktop.PolicyKit1",
-		"/org/freedesktop/PolicyKit1/Authority",
-		"org.freedesktop.PolicyKit1.Authority",
-		"RegisterAuthenticationAgent",
-		g_variant_new("((s@a{sv})ss)",
-			"unix-session",
-			dict, // dict absorbed
-			g_getenv("LANG"),
-			POLKIT_AUTH_AGENT_DBUS_PATH),
-		NULL,
-		G_DBUS_CALL_FLAGS_NONE,
-		-1,
-		session->cancel,
-		(GAsyncReadyCallback)async_init_sequence,
-		seqdata);
-	ASYNC_SEQ_WAIT(5, )
-
-	ret = g_dbus_connection_call_finish(session->yBus, res, &error);
-	if(!ret || error)
-	{
-		g_critical("Failed to register as PolKit Authentication Agent: %s", error ? error->message : "Unknown error");
-		g_clear_error(&error);
-		g_clear_object(&ret);
-		graphene_session_exit(TRUE);
-		return;
-	}
-
-	g_variant_unref(ret);
-	g_message("Registered as authentication agent");
-
 	// Export SM object
 	session->dbusSMSkeleton = dbus_session_manager_skeleton_new();
 	connect_dbus_methods();
@@ -369,6 +288,7 @@ static void on_eybus_connection_lost(UNUSED GDBusConnection *eyBus, UNUSED gbool
  */
 
 static void launch_desktop();
+static void launch_window_manager();
 
 static void do_startup()
 {
@@ -377,7 +297,11 @@ static void do_startup()
 	
 	session->phase = SESSION_PHASE_STARTUP;
 	session->statusNotifierWatcher = graphene_status_notifier_watcher_new();
-	launch_desktop();
+	if(windowManagerArgs)
+		launch_window_manager(); // Launches the desktop once the WM is ready
+	else
+		launch_desktop();
+	start_client_sampling();
 	check_startup_complete();
 	
 	// Stopped if STARTUP phase completes, in do_idle_phase
@@ -399,6 +323,7 @@ static gboolean check_startup_complete()
 
 static void launch_desktop()
 {
+	session->desktopLaunched = TRUE;
 	GHashTable *autostarts = list_autostarts();
 	GHashTableIter iter;
 	gpointer key, value;
@@ -419,6 +344,45 @@ static void launch_desktop()
 	}
 }
 
+static void on_wm_client_notify_ready(GrapheneSessionClient *client)
+{
+	if(graphene_session_client_get_is_ready(client) && !session->desktopLaunched)
+		launch_desktop();
+}
+
+/*
+ * Launches the window manager as a regular client, restarting it if it
+ * crashes. Clients are unaffected by a crash since they belong to this
+ * process, not the WM. The window manager must register with the session
+ * to become ready.
+ */
+static void launch_window_manager()
+{
+	GrapheneSessionClient *client = graphene_session_client_new(session->eBus, NULL);
+	session->clients = g_list_prepend(session->clients, client);
+	session->wmClient = client;
+
+	g_object_set(client,
+		"name", "Window Manager",
+		"args", windowManagerArgs,
+		"auto-restart", CSM_CLIENT_RESTART_FAIL_ONLY,
+		NULL);
+
+	g_object_connect(client,
+		"signal::notify::ready", on_wm_client_notify_ready, NULL,
+		"signal::notify::ready", on_client_notify_ready, NULL,
+		"signal::notify::complete", on_client_notify_complete, NULL,
+		NULL);
+
+	graphene_session_client_spawn(client);
+}
+
+void graphene_session_set_window_manager(const gchar *args)
+{
+	g_free(windowManagerArgs);
+	windowManagerArgs = g_strdup(args);
+}
+
 
 
 /*
@@ -457,10 +421,111 @@ static void launch_apps()
 		&& g_strcmp0(phase, "WindowManager") != 0
 		&& g_strcmp0(phase, "Panel") != 0
 		&& g_strcmp0(phase, "Desktop") != 0)
+		{
+			// Low priority apps (tray helpers, updaters, etc.) wait until
+			// the system is quiet. See start_deferred_launches.
+			gchar *priority = g_desktop_app_info_get_string(desktopInfo, "Graphene-Autostart-Priority");
+			if(g_strcmp0(priority, "low") == 0)
+				g_queue_push_tail(session->deferredLaunches, g_object_ref(desktopInfo));
+			else
+				launch_autostart(desktopInfo);
+			g_free(priority);
+		}
+		g_free(phase);
+	}
+	g_hash_table_unref(autostarts);
+
+	start_deferred_launches();
+}
+
+
+
+/*
+ * Deferred launching
+ * Autostarts with 'Graphene-Autostart-Priority=low' are launched one at a
+ * time, only while the system is quiet, so they don't compete with the
+ * user's first app launch. After DEFERRED_MAX_DELAY they launch anyway.
+ */
+
+// Returns the "some avg10" value of a /proc/pressure file, or -1 if PSI is unavailable
+static gdouble read_pressure(const gchar *path)
+{
+	gchar *contents = NULL;
+	if(!g_file_get_contents(path, &contents, NULL, NULL))
+		return -1;
+
+	gdouble value = -1;
+	gchar *avg = g_strstr_len(contents, -1, "some avg10=");
+	if(avg)
+		value = g_ascii_strtod(avg + strlen("some avg10="), NULL);
+	g_free(contents);
+	return value;
+}
+
+static gboolean system_is_quiet()
+{
+	gdouble cpu = read_pressure("/proc/pressure/cpu");
+	gdouble io = read_pressure("/proc/pressure/io");
+	if(cpu >= 0 && io >= 0)
+		return cpu < PRESSURE_QUIET_THRESHOLD && io < PRESSURE_QUIET_THRESHOLD;
+
+	// Kernel without PSI, fall back to the load average
+	gdouble load[1];
+	if(getloadavg(load, 1) < 1)
+		return TRUE;
+	return load[0] / g_get_num_processors() < LOADAVG_QUIET_THRESHOLD;
+}
+
+static gboolean on_deferred_launch_poll(UNUSED gpointer userdata)
+{
+	gint64 waited = (g_get_monotonic_time() - session->deferredSince) / G_USEC_PER_SEC;
+	if(waited < DEFERRED_MIN_DELAY)
+		return G_SOURCE_CONTINUE;
+
+	if(waited >= DEFERRED_MAX_DELAY)
+	{
+		g_message("Launching %i deferred autostarts after waiting %is", g_queue_get_length(session->deferredLaunches), DEFERRED_MAX_DELAY);
+		GDesktopAppInfo *desktopInfo;
+		while((desktopInfo = g_queue_pop_head(session->deferredLaunches)))
 		{
 			launch_autostart(desktopInfo);
+			g_object_unref(desktopInfo);
 		}
 	}
+	else if(system_is_quiet())
+	{
+		// Only one per tick, so that the load from each launch shows up
+		// before deciding on the next
+		GDesktopAppInfo *desktopInfo = g_queue_pop_head(session->deferredLaunches);
+		g_debug("Launching deferred autostart '%s' after %lis", g_app_info_get_id(G_APP_INFO(desktopInfo)), (glong)waited);
+		launch_autostart(desktopInfo);
+		g_object_unref(desktopInfo);
+	}
+
+	if(!g_queue_is_empty(session->deferredLaunches))
+		return G_SOURCE_CONTINUE;
+	session->deferredSourceId = 0;
+	return G_SOURCE_REMOVE;
+}
+
+static void start_deferred_launches()
+{
+	if(session->deferredSourceId || g_queue_is_empty(session->deferredLaunches))
+		return;
+	session->deferredSince = g_get_monotonic_time();
+	session->deferredSourceId = g_timeout_add_seconds(DEFERRED_POLL_INTERVAL, on_deferred_launch_poll, NULL);
+}
+
+static void stop_deferred_launches()
+{
+	if(session->deferredSourceId)
+		g_source_remove(session->deferredSourceId);
+	session->deferredSourceId = 0;
+	if(session->deferredLaunches)
+	{
+		g_queue_foreach(session->deferredLaunches, (GFunc)g_object_unref, NULL);
+		g_queue_clear(session->deferredLaunches);
+	}
 }
 
 
@@ -469,20 +534,40 @@ static void launch_apps()
  * Exit
  */
 
-static void on_logout_dialog_close(GrapheneDialog *dialog, const gchar *button);
-static void on_inhibitors_dialog_close(GrapheneDialog *dialog, const gchar *button);
+static void on_logout_dialog_close(const gchar *button);
+static void on_inhibitors_dialog_close(const gchar *button);
 static void do_exit(ExitType exitType, gboolean force);
 
+static void show_dialog(const gchar *message, const gchar * const *buttons, void (*responseCb)(const gchar *button))
+{
+	session->dialogResponseCb = responseCb;
+	session->dialogCb(message, buttons, session->cbUserdata);
+}
+
+static void close_dialog()
+{
+	session->dialogResponseCb = NULL;
+	session->dialogCb(NULL, NULL, session->cbUserdata);
+}
+
+void graphene_session_dialog_response(const gchar *button)
+{
+	if(!session || !session->dialogResponseCb)
+		return;
+	void (*responseCb)(const gchar *button) = session->dialogResponseCb;
+	session->dialogResponseCb = NULL;
+	responseCb(button);
+}
+
 void graphene_session_request_logout()
 {	
-	GrapheneDialog *dialog = graphene_dialog_new_simple(NULL, NULL, "Cancel", "Suspend", "Logout", "Restart", "Shutdown", NULL);
-	g_signal_connect(dialog, "select", G_CALLBACK(on_logout_dialog_close), NULL);
-	session->dialogCb(CLUTTER_ACTOR(dialog), session->cbUserdata);
+	static const gchar * const buttons[] = {"Cancel", "Suspend", "Logout", "Restart", "Shutdown", NULL};
+	show_dialog(NULL, buttons, on_logout_dialog_close);
 }
 
-static void on_logout_dialog_close(UNUSED GrapheneDialog *dialog, const gchar *button)
+static void on_logout_dialog_close(const gchar *button)
 {
-	session->dialogCb(NULL, session->cbUserdata);
+	close_dialog();
 	if(g_strcmp0(button, "Suspend") == 0)
 		system("systemctl suspend");
 	else if(g_strcmp0(button, "Shutdown") == 0)
@@ -501,14 +586,14 @@ void notify_inhibitors()
 	else if(session->exitType == EXIT_REBOOT)
 		type = "restart";
 	gchar *msg = g_strdup_printf("An application is blocking %s. Force %s?", type, type);
-	GrapheneDialog *dialog = graphene_dialog_new_simple(msg, NULL, "Cancel", "Force", NULL);
-	g_signal_connect(dialog, "select", G_CALLBACK(on_inhibitors_dialog_close), NULL);
-	session->dialogCb(CLUTTER_ACTOR(dialog), session->cbUserdata);
+	static const gchar * const buttons[] = {"Cancel", "Force", NULL};
+	show_dialog(msg, buttons, on_inhibitors_dialog_close);
+	g_free(msg);
 }
 
-static void on_inhibitors_dialog_close(UNUSED GrapheneDialog *dialog, const gchar *button)
+static void on_inhibitors_dialog_close(const gchar *button)
 {
-	session->dialogCb(NULL, session->cbUserdata);
+	close_dialog();
 	if(g_strcmp0(button, "Force") == 0)
 		do_exit(session->exitType, TRUE);
 	else
@@ -542,20 +627,27 @@ static void do_exit(ExitType exitType, gboolean force)
 		}
 	}
 	
-	session->dialogCb(clutter_actor_new(), session->cbUserdata);
+	// Blank cover over the screen while clients close
+	static const gchar * const noButtons[] = {NULL};
+	show_dialog(NULL, noButtons, NULL);
 	
 	session->phase = SESSION_PHASE_EXIT;
+	stop_deferred_launches();
 	//dbus_session_manager_set_session_is_active(session->dbusSMSkeleton, FALSE);
 	//dbus_session_manager_emit_session_over(session->dbusSMSkeleton);
 	
 	// Inform all clients of the endsession
 	// Once all clients close, the session will end automatically
+	// A separate window manager is ended last, in on_client_notify_complete,
+	// so that it keeps drawing while the other clients close.
 	g_message("Num clients: %i", g_list_length(session->clients));
+	gboolean onlyWM = session->clients && !session->clients->next && session->clients->data == session->wmClient;
 	for(GList *it = session->clients; it != NULL;)
 	{
 		GrapheneSessionClient *client = it->data;
 		it=it->next;
-		graphene_session_client_end_session(client);
+		if(client != session->wmClient || onlyWM)
+			graphene_session_client_end_session(client);
 	}
 
 	// Start a countdown. If all the clients don't close before
@@ -576,6 +668,14 @@ void graphene_session_exit(gboolean failed)
 		g_cancellable_cancel(session->cancel);
 	g_clear_object(&session->cancel);
 
+	stop_client_sampling();
+	stop_deferred_launches();
+	g_clear_pointer(&session->deferredLaunches, g_queue_free);
+
+#if GRAPHENE_DEBUG
+	log_method_stats();
+#endif
+
 	// Kill and free any remaining client objects
 	// (In a successful logout, there should be no clients left anyway)
 	g_list_free_full(session->clients, g_object_unref);
@@ -593,8 +693,6 @@ void graphene_session_exit(gboolean failed)
 		g_dbus_interface_skeleton_unexport(G_DBUS_INTERFACE_SKELETON(session->dbusSMSkeleton));
 	g_clear_object(&session->dbusSMSkeleton);
 
-	g_clear_pointer(&session->ldSessionObject, g_free);
-
 	// Flush and close the connection. This may be blocking.
 	if(session->yBus)
 		g_dbus_connection_flush_sync(session->yBus, NULL, NULL);
@@ -673,6 +771,69 @@ static void self_destruct_countdown()
 
 
 
+/*
+ * Client resource sampling
+ */
+
+static gboolean on_client_sample_timer(gint fd, UNUSED GIOCondition condition, UNUSED gpointer userdata)
+{
+	// Drain the expiration count; missed expirations are just skipped
+	guint64 expirations;
+	if(read(fd, &expirations, sizeof(expirations)) < 0)
+		return G_SOURCE_CONTINUE;
+
+	for(GList *it = session->clients; it != NULL; it = it->next)
+		graphene_session_client_sample_resources(it->data);
+	return G_SOURCE_CONTINUE;
+}
+
+static void start_client_sampling()
+{
+	guint interval = DEFAULT_CLIENT_SAMPLE_INTERVAL;
+	GVariant *intervalV = get_gsettings_value(SESSION_SETTINGS_SCHEMA, "client-sample-interval");
+	if(intervalV)
+	{
+		if(g_variant_is_of_type(intervalV, G_VARIANT_TYPE_UINT32))
+			interval = g_variant_get_uint32(intervalV);
+		g_variant_unref(intervalV);
+	}
+
+	if(interval == 0)
+		return;
+
+	session->sampleTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if(session->sampleTimerFd < 0)
+	{
+		g_warning("Failed to create client sampling timer: %s", g_strerror(errno));
+		return;
+	}
+
+	struct itimerspec spec = {0};
+	spec.it_interval.tv_sec = interval / 1000;
+	spec.it_interval.tv_nsec = (interval % 1000) * 1000000;
+	spec.it_value = spec.it_interval;
+	if(timerfd_settime(session->sampleTimerFd, 0, &spec, NULL) < 0)
+	{
+		g_warning("Failed to start client sampling timer: %s", g_strerror(errno));
+		stop_client_sampling();
+		return;
+	}
+
+	session->sampleSourceId = g_unix_fd_add(session->sampleTimerFd, G_IO_IN, on_client_sample_timer, NULL);
+}
+
+static void stop_client_sampling()
+{
+	if(session->sampleSourceId)
+		g_source_remove(session->sampleSourceId);
+	session->sampleSourceId = 0;
+	if(session->sampleTimerFd >= 0)
+		close(session->sampleTimerFd);
+	session->sampleTimerFd = -1;
+}
+
+
+
 /*
  * Client Events
  * Some of these are sent back from the GrapheneSessionClient object, while
@@ -758,9 +919,22 @@ static void on_client_notify_complete(GrapheneSessionClient *client)
 		return;
 	g_message("Client %s is complete. Remain: %i", graphene_session_client_get_best_name(client), g_list_length(session->clients)-1);
 	session->clients = g_list_remove(session->clients, client);
+
+	if(client == session->wmClient)
+	{
+		session->wmClient = NULL;
+		if(session->phase < SESSION_PHASE_EXIT)
+		{
+			// Either it exited on its own or crashed too many times.
+			// There is no session without a window manager.
+			g_critical("The window manager has exited. Ending session.");
+			g_object_unref(client);
+			graphene_session_exit_on_idle(TRUE);
+			return;
+		}
+	}
 	g_object_unref(client);
 	
-	
 	if(session->phase == SESSION_PHASE_STARTUP)
 		check_startup_complete();
 	else if(session->phase == SESSION_PHASE_EXIT && session->clients == NULL)
@@ -768,6 +942,12 @@ static void on_client_notify_complete(GrapheneSessionClient *client)
 		g_message("exit");
 		graphene_session_exit_on_idle(FALSE);
 	}
+	else if(session->phase == SESSION_PHASE_EXIT && session->wmClient
+	     && session->clients->data == session->wmClient && session->clients->next == NULL)
+	{
+		// Everything else has closed; the window manager goes last
+		graphene_session_client_end_session(session->wmClient);
+	}
 	//if(!check_startup_complete())
 	//{
 	//	// If all clients die, exit
@@ -1001,10 +1181,12 @@ static gboolean on_dbus_client_relaunch(DBusSessionManager *object, GDBusMethodI
 	return FALSE;
 }
 
-// TODO
-UNUSED static gboolean on_dbus_is_inhibited(DBusSessionManager *object, GDBusMethodInvocation *invocation, UNUSED gint flags, UNUSED gpointer userdata)
+static gboolean on_dbus_is_inhibited(DBusSessionManager *object, GDBusMethodInvocation *invocation, guint flags, UNUSED gpointer userdata)
 {
-	dbus_session_manager_complete_is_inhibited(object, invocation, 0);
+	gboolean inhibited = FALSE;
+	for(GList *it = session->clients; it != NULL && !inhibited; it = it->next)
+		inhibited = (graphene_session_client_get_inhibited_flags(it->data) & flags) != 0;
+	dbus_session_manager_complete_is_inhibited(object, invocation, inhibited);
 	return TRUE;
 }
 
@@ -1101,106 +1283,115 @@ static gboolean on_dbus_get_is_session_running(DBusSessionManager *object, GDBus
 }
 
 // At the end to avoid a huge block of function declarations
-static void connect_dbus_methods()
-{
-	#define connect(s, f) g_signal_connect(session->dbusSMSkeleton, "handle-" s, G_CALLBACK(f), NULL)
-	connect("setenv", on_dbus_set_env);
-	connect("get-locale", on_dbus_get_locale);
-	connect("initialization-error", on_dbus_initialization_error);
-	connect("register-client", on_client_register);
-	connect("unregister-client", on_client_unregister);
-	connect("relaunch", on_dbus_client_relaunch);
-	connect("inhibit", on_client_inhibit);
-	connect("uninhibit", on_client_uninhibit);
-	connect("get-current-client", on_dbus_get_current_client);
-	connect("get-clients", on_dbus_get_clients);
-	connect("get-inhibitors", on_dbus_get_inhibitors);
-	connect("is-autostart-condition-handled", on_dbus_get_is_autostart_condition_handled);
-	connect("shutdown", on_dbus_shutdown);
-	connect("reboot", on_dbus_reboot);
-	connect("can-shutdown", on_dbus_get_can_shutdown);
-	connect("logout", on_dbus_logout);
-	connect("is-session-running", on_dbus_get_is_session_running);
-	#undef connect
-}
+#if GRAPHENE_DEBUG
+/*
+ * DBus method statistics (debug builds only)
+ * Every SessionManager method handler is timed, and the call counts and
+ * latency percentiles are logged when the session exits. Useful for seeing
+ * how the handlers scale when many clients register or inhibit at once.
+ */
 
+#define METHOD_STATS_MAX_SAMPLES 10000
 
+typedef struct
+{
+	const gchar *method;
+	guint64 count;
+	GArray *latencies; // gint64 microseconds, reservoir sampled past METHOD_STATS_MAX_SAMPLES
+	gint64 start;
+} MethodStats;
 
-/*
- * PolKit Authentication Agent
- *
- * The Authentication Agent is responsible for displaying a dialog box asking
- * for a password or some other form of authentication when an unprivileged
- * application needs to preform a privilged operation (for example, GNOME
- * Control Center modifying users in the Users panel).
- * 
- * How it works:
- * An unprivileged application sends a request to the Polkit Authority Daemon
- * via DBus, and then the Authority asks us to display a dialog. We display
- * a dialog, and using the password/response from the user, launch an
- * a helper app with the necessary privileges. This helper app then attempts
- * to send a completion request to the Authority. If it worked, the original
- * application gets permission to do its operation, and we close our dialog.
- * The whole "helper app" part of this process is done for us by the
- * polkitagent library.
- */
+static GPtrArray *methodStats = NULL;
+static gint64 methodStatsSince = 0;
 
-static void on_pk_auth_dialog_complete(GraphenePKAuthDialog *dialog, gboolean cancelled, UNUSED gboolean gainedAuthentication, gpointer userdata)
+static void method_stats_pre(MethodStats *stats, UNUSED GClosure *closure)
 {
-	session->pkAuthDialogList = g_list_remove(session->pkAuthDialogList, dialog);
-	
-	// This closes and frees the dialog
-	session->dialogCb(NULL, session->cbUserdata);
-	
-	g_return_if_fail(G_IS_DBUS_METHOD_INVOCATION(userdata));
-	GDBusMethodInvocation *invocation = G_DBUS_METHOD_INVOCATION(userdata);
+	stats->start = g_get_monotonic_time();
+}
 
-	if(cancelled)
-	{
-		g_dbus_method_invocation_return_dbus_error(invocation, "org.freedesktop.PolicyKit1.Error.Cancelled", "Cancelled");
-	}
+static void method_stats_post(MethodStats *stats, UNUSED GClosure *closure)
+{
+	gint64 latency = g_get_monotonic_time() - stats->start;
+	stats->count++;
+	if(stats->latencies->len < METHOD_STATS_MAX_SAMPLES)
+		g_array_append_val(stats->latencies, latency);
 	else
 	{
-		dbus_org_freedesktop_policy_kit1_authentication_agent_complete_begin_authentication(session->dbusPkAgentSkeleton, invocation);
+		guint64 i = ((guint64)g_random_int() << 32 | g_random_int()) % stats->count;
+		if(i < METHOD_STATS_MAX_SAMPLES)
+			g_array_index(stats->latencies, gint64, i) = latency;
 	}
+}
 
-	// Show the next dialog in the queue, if any
-	if(session->pkAuthDialogList != NULL)
-		session->dialogCb(CLUTTER_ACTOR(session->pkAuthDialogList->data), session->cbUserdata);
+static void method_stats_free(MethodStats *stats)
+{
+	g_array_unref(stats->latencies);
+	g_free(stats);
 }
 
-static gboolean on_pk_agent_begin_authentication(UNUSED DBusPolkitAuthAgent *object, GDBusMethodInvocation *invocation, const gchar *actionId, const gchar *message, const gchar *iconName, UNUSED GVariant *details, const gchar *cookie, GVariant *identitiesV)
+static void connect_timed(gpointer instance, const gchar *signal, GCallback callback)
 {
-	if(!session->dialogCb)
+	if(!methodStats)
 	{
-		g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED, "Unknown error");
-		return TRUE;
+		methodStats = g_ptr_array_new_with_free_func((GDestroyNotify)method_stats_free);
+		methodStatsSince = g_get_monotonic_time();
 	}
 
-	GError *error = NULL;
-	GraphenePKAuthDialog *dialog = graphene_pk_auth_dialog_new(actionId, message, iconName, cookie, identitiesV, &error);
-	if(!dialog)
-	{
-		g_dbus_method_invocation_return_error(invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED, error->message);
-		return TRUE;
-	}
+	MethodStats *stats = g_new0(MethodStats, 1);
+	stats->method = signal + strlen("handle-");
+	stats->latencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+	g_ptr_array_add(methodStats, stats);
 
-	g_signal_connect(dialog, "complete", G_CALLBACK(on_pk_auth_dialog_complete), invocation);
+	GClosure *closure = g_cclosure_new(callback, NULL, NULL);
+	g_closure_add_marshal_guards(closure, stats, (GClosureNotify)method_stats_pre, stats, (GClosureNotify)method_stats_post);
+	g_signal_connect_closure(instance, signal, closure, FALSE);
+}
+
+static void log_method_stats()
+{
+	if(!methodStats)
+		return;
 
-	gboolean firstDialog = session->pkAuthDialogList == NULL;
-	session->pkAuthDialogList = g_list_append(session->pkAuthDialogList, dialog);
+	gdouble elapsed = (g_get_monotonic_time() - methodStatsSince) / (gdouble)G_USEC_PER_SEC;
+	for(guint i=0;i<methodStats->len;++i)
+	{
+		MethodStats *stats = g_ptr_array_index(methodStats, i);
+		gchar *percentiles = latency_percentiles(stats->latencies);
+		if(!percentiles)
+			continue;
+		g_message("DBus %-30s %8lu calls  %8.2f/s  %s",
+			stats->method, (gulong)stats->count, stats->count / elapsed, percentiles);
+		g_free(percentiles);
+	}
 
-	if(firstDialog)
-		session->dialogCb(CLUTTER_ACTOR(dialog), session->cbUserdata);
-	return TRUE;
+	g_clear_pointer(&methodStats, g_ptr_array_unref);
 }
+#endif
 
-static gboolean on_pk_agent_cancel_authentication(DBusPolkitAuthAgent *object, GDBusMethodInvocation *invocation, UNUSED const gchar *cookie)
+static void connect_dbus_methods()
 {
-	// TODO: Validate cookie
-	if(session && session->pkAuthDialogList && session->pkAuthDialogList->data)
-		graphene_pk_auth_dialog_cancel(session->pkAuthDialogList->data);
-
-	dbus_org_freedesktop_policy_kit1_authentication_agent_complete_cancel_authentication(object, invocation);
-	return TRUE;
+#if GRAPHENE_DEBUG
+	#define connect(s, f) connect_timed(session->dbusSMSkeleton, "handle-" s, G_CALLBACK(f))
+#else
+	#define connect(s, f) g_signal_connect(session->dbusSMSkeleton, "handle-" s, G_CALLBACK(f), NULL)
+#endif
+	connect("setenv", on_dbus_set_env);
+	connect("get-locale", on_dbus_get_locale);
+	connect("initialization-error", on_dbus_initialization_error);
+	connect("register-client", on_client_register);
+	connect("unregister-client", on_client_unregister);
+	connect("relaunch", on_dbus_client_relaunch);
+	connect("inhibit", on_client_inhibit);
+	connect("uninhibit", on_client_uninhibit);
+	connect("is-inhibited", on_dbus_is_inhibited);
+	connect("get-current-client", on_dbus_get_current_client);
+	connect("get-clients", on_dbus_get_clients);
+	connect("get-inhibitors", on_dbus_get_inhibitors);
+	connect("is-autostart-condition-handled", on_dbus_get_is_autostart_condition_handled);
+	connect("shutdown", on_dbus_shutdown);
+	connect("reboot", on_dbus_reboot);
+	connect("can-shutdown", on_dbus_get_can_shutdown);
+	connect("logout", on_dbus_logout);
+	connect("is-session-running", on_dbus_get_is_session_running);
+	#undef connect
 }
@@ -20,16 +20,35 @@
 #define __GRAPHENE_SESSION_H__
 
 #include <glib.h>
-#include <clutter/clutter.h>
 
 G_BEGIN_DECLS
 
 typedef void (*CSMStartupCompleteCallback)(gpointer userdata);
-typedef void (*CSMDialogCallback)(ClutterActor *dialog, gpointer userdata);
 typedef void (*CSMQuitCallback)(gboolean failed, gpointer userdata);
 
+/*
+ * Asks the host to show a dialog with a message (may be NULL) and a list of
+ * buttons. If buttons is NULL, the current dialog should be closed instead.
+ * An empty button list with no message is a blank cover over the screen.
+ * The host reports the selected button with graphene_session_dialog_response.
+ */
+typedef void (*CSMDialogCallback)(const gchar *message, const gchar * const *buttons, gpointer userdata);
+
 void graphene_session_init(CSMStartupCompleteCallback startupCb, CSMDialogCallback dialogCb, CSMQuitCallback quitCb, gpointer userdata);
 
+/*
+ * Runs the window manager as a client of the session instead of the session
+ * living inside the window manager. The window manager is started before
+ * the rest of the desktop and restarted if it crashes. Must be called before
+ * graphene_session_init.
+ */
+void graphene_session_set_window_manager(const gchar *args);
+
+/*
+ * Call when the user selects a button of the dialog shown by CSMDialogCallback.
+ */
+void graphene_session_dialog_response(const gchar *button);
+
 /*
  * Immediately exits the session, attempting to close clients.
  * Pass TRUE to failed if this exit is due to an error.
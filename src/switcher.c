@@ -0,0 +1,523 @@
+/*
+ * This file is part of graphene-desktop, the desktop environment of VeltOS.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define COGL_ENABLE_EXPERIMENTAL_API
+#include "switcher.h"
+#include <meta/meta-window-actor.h>
+#include <meta/meta-shaped-texture.h>
+
+#define THUMBNAIL_MAX_WIDTH 256 // Pixels
+#define THUMBNAIL_MAX_HEIGHT 160
+#define THUMBNAIL_CACHE_MAX_BYTES (24*1024*1024)
+
+/*
+ * Thumbnails
+ *
+ * Drawing every window at full size into the switcher would mean sampling
+ * every window's full texture each frame the switcher is open. Instead,
+ * each window is drawn once, scaled down, into a small offscreen texture
+ * which is kept until the window's contents change. Damage to a window only
+ * marks its thumbnail dirty; it gets redrawn the next time the switcher
+ * wants it. The cache is capped in size, and the least recently shown
+ * thumbnails are dropped first.
+ */
+
+#define GRAPHENE_TYPE_THUMBNAIL_CONTENT graphene_thumbnail_content_get_type()
+G_DECLARE_FINAL_TYPE(GrapheneThumbnailContent, graphene_thumbnail_content, GRAPHENE, THUMBNAIL_CONTENT, GObject)
+
+struct _GrapheneThumbnailContent
+{
+	GObject parent;
+	CoglTexture *texture;
+	CoglOffscreen *offscreen;
+};
+
+static void graphene_thumbnail_content_iface_init(ClutterContentIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE(GrapheneThumbnailContent, graphene_thumbnail_content, G_TYPE_OBJECT,
+	G_IMPLEMENT_INTERFACE(CLUTTER_TYPE_CONTENT, graphene_thumbnail_content_iface_init));
+
+typedef struct
+{
+	MetaWindowActor *actor;
+	ClutterActor *source; // The window's MetaShapedTexture; weak pointer
+	GrapheneThumbnailContent *content;
+	gsize bytes;
+	gboolean dirty;
+	GList *link; // In lru
+} Thumbnail;
+
+static GHashTable *thumbnails = NULL; // MetaWindowActor * to Thumbnail *
+static GQueue lru = G_QUEUE_INIT; // Thumbnail *, most recently used first
+static gsize cacheBytes = 0;
+
+
+static void graphene_thumbnail_content_finalize(GObject *self_)
+{
+	GrapheneThumbnailContent *self = GRAPHENE_THUMBNAIL_CONTENT(self_);
+	if(self->offscreen)
+		cogl_object_unref(self->offscreen);
+	if(self->texture)
+		cogl_object_unref(self->texture);
+	G_OBJECT_CLASS(graphene_thumbnail_content_parent_class)->finalize(self_);
+}
+
+static void graphene_thumbnail_content_class_init(GrapheneThumbnailContentClass *class)
+{
+	G_OBJECT_CLASS(class)->finalize = graphene_thumbnail_content_finalize;
+}
+
+static void graphene_thumbnail_content_init(UNUSED GrapheneThumbnailContent *self)
+{
+}
+
+static gboolean graphene_thumbnail_content_get_preferred_size(ClutterContent *self_, gfloat *width, gfloat *height)
+{
+	GrapheneThumbnailContent *self = GRAPHENE_THUMBNAIL_CONTENT(self_);
+	if(!self->texture)
+		return FALSE;
+	if(width)
+		*width = cogl_texture_get_width(self->texture);
+	if(height)
+		*height = cogl_texture_get_height(self->texture);
+	return TRUE;
+}
+
+// Same as ClutterImage
+static void graphene_thumbnail_content_paint_content(ClutterContent *self_, ClutterActor *actor, ClutterPaintNode *root)
+{
+	GrapheneThumbnailContent *self = GRAPHENE_THUMBNAIL_CONTENT(self_);
+	if(!self->texture)
+		return;
+
+	ClutterScalingFilter minFilter, magFilter;
+	clutter_actor_get_content_scaling_filters(actor, &minFilter, &magFilter);
+	guint8 opacity = clutter_actor_get_paint_opacity(actor);
+	ClutterColor color = {opacity, opacity, opacity, opacity};
+	ClutterActorBox box;
+	clutter_actor_get_content_box(actor, &box);
+
+	ClutterPaintNode *node = clutter_texture_node_new(self->texture, &color, minFilter, magFilter);
+	clutter_paint_node_set_name(node, "Thumbnail");
+	clutter_paint_node_add_rectangle(node, &box);
+	clutter_paint_node_add_child(root, node);
+	clutter_paint_node_unref(node);
+}
+
+static void graphene_thumbnail_content_iface_init(ClutterContentIface *iface)
+{
+	iface->get_preferred_size = graphene_thumbnail_content_get_preferred_size;
+	iface->paint_content = graphene_thumbnail_content_paint_content;
+}
+
+/*
+ * Draws the window's texture scaled down into the thumbnail, on the GPU.
+ * The offscreen texture is kept and drawn over if the size hasn't changed.
+ */
+static gboolean thumbnail_render(Thumbnail *thumb)
+{
+	if(!thumb->source)
+		return FALSE;
+	CoglTexture *source = meta_shaped_texture_get_texture(META_SHAPED_TEXTURE(thumb->source));
+	if(!source)
+		return FALSE;
+
+	gfloat sw = cogl_texture_get_width(source);
+	gfloat sh = cogl_texture_get_height(source);
+	if(sw <= 0 || sh <= 0)
+		return FALSE;
+	gfloat scale = MIN(MIN(THUMBNAIL_MAX_WIDTH / sw, THUMBNAIL_MAX_HEIGHT / sh), 1);
+	gint width = MAX(sw * scale, 1);
+	gint height = MAX(sh * scale, 1);
+
+	GrapheneThumbnailContent *content = thumb->content;
+	if(!content->texture
+	|| cogl_texture_get_width(content->texture) != (guint)width
+	|| cogl_texture_get_height(content->texture) != (guint)height)
+	{
+		if(content->offscreen)
+			cogl_object_unref(content->offscreen);
+		if(content->texture)
+			cogl_object_unref(content->texture);
+		content->offscreen = NULL;
+		content->texture = NULL;
+
+		CoglContext *ctx = clutter_backend_get_cogl_context(clutter_get_default_backend());
+		CoglTexture *texture = COGL_TEXTURE(cogl_texture_2d_new_with_size(ctx, width, height));
+		CoglOffscreen *offscreen = cogl_offscreen_new_with_texture(texture);
+		GError *error = NULL;
+		if(!cogl_framebuffer_allocate(COGL_FRAMEBUFFER(offscreen), &error))
+		{
+			g_warning("Failed to allocate window thumbnail: %s", error->message);
+			g_error_free(error);
+			cogl_object_unref(offscreen);
+			cogl_object_unref(texture);
+			return FALSE;
+		}
+		cogl_framebuffer_orthographic(COGL_FRAMEBUFFER(offscreen), 0, 0, width, height, -1, 1);
+		content->texture = texture;
+		content->offscreen = offscreen;
+
+		cacheBytes -= thumb->bytes;
+		thumb->bytes = width * height * 4;
+		cacheBytes += thumb->bytes;
+	}
+
+	CoglFramebuffer *fb = COGL_FRAMEBUFFER(content->offscreen);
+	CoglPipeline *pipeline = cogl_pipeline_new(cogl_framebuffer_get_context(fb));
+	cogl_pipeline_set_layer_texture(pipeline, 0, source);
+	cogl_pipeline_set_layer_filters(pipeline, 0, COGL_PIPELINE_FILTER_LINEAR, COGL_PIPELINE_FILTER_LINEAR);
+	cogl_framebuffer_clear4f(fb, COGL_BUFFER_BIT_COLOR, 0, 0, 0, 0);
+	cogl_framebuffer_draw_rectangle(fb, pipeline, 0, 0, width, height);
+	cogl_object_unref(pipeline);
+
+	thumb->dirty = FALSE;
+	clutter_content_invalidate(CLUTTER_CONTENT(content));
+	return TRUE;
+}
+
+static void on_thumbnail_source_damaged(UNUSED ClutterActor *source, UNUSED ClutterActor *origin, Thumbnail *thumb)
+{
+	thumb->dirty = TRUE;
+}
+
+static void thumbnail_free(Thumbnail *thumb)
+{
+	if(thumb->source)
+	{
+		g_signal_handlers_disconnect_by_func(thumb->source, on_thumbnail_source_damaged, thumb);
+		g_object_remove_weak_pointer(G_OBJECT(thumb->source), (gpointer *)&thumb->source);
+	}
+	g_queue_delete_link(&lru, thumb->link);
+	cacheBytes -= thumb->bytes;
+	// Switchers still showing the thumbnail keep the content alive
+	g_object_unref(thumb->content);
+	g_free(thumb);
+}
+
+static void on_thumbnail_actor_destroyed(MetaWindowActor *actor)
+{
+	g_hash_table_remove(thumbnails, actor);
+}
+
+static void thumbnail_remove(Thumbnail *thumb)
+{
+	g_signal_handlers_disconnect_by_func(thumb->actor, on_thumbnail_actor_destroyed, NULL);
+	g_hash_table_remove(thumbnails, thumb->actor);
+}
+
+static void evict_thumbnails(Thumbnail *keep)
+{
+	while(cacheBytes > THUMBNAIL_CACHE_MAX_BYTES)
+	{
+		Thumbnail *oldest = g_queue_peek_tail(&lru);
+		if(!oldest || oldest == keep)
+			break;
+		thumbnail_remove(oldest);
+	}
+}
+
+/*
+ * Returns the (unowned) thumbnail content for a window, rendering it first
+ * if the window changed since it was last rendered. Returns NULL if the
+ * window has nothing to show yet.
+ */
+static ClutterContent * get_thumbnail(MetaWindowActor *actor)
+{
+	if(!thumbnails)
+		thumbnails = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)thumbnail_free);
+
+	Thumbnail *thumb = g_hash_table_lookup(thumbnails, actor);
+	if(!thumb)
+	{
+		thumb = g_new0(Thumbnail, 1);
+		thumb->actor = actor;
+		thumb->source = meta_window_actor_get_texture(actor);
+		thumb->content = g_object_new(GRAPHENE_TYPE_THUMBNAIL_CONTENT, NULL);
+		thumb->dirty = TRUE;
+		g_queue_push_head(&lru, thumb);
+		thumb->link = g_queue_peek_head_link(&lru);
+		if(thumb->source)
+		{
+			g_object_add_weak_pointer(G_OBJECT(thumb->source), (gpointer *)&thumb->source);
+			g_signal_connect(thumb->source, "queue-redraw", G_CALLBACK(on_thumbnail_source_damaged), thumb);
+		}
+		g_signal_connect(actor, "destroy", G_CALLBACK(on_thumbnail_actor_destroyed), NULL);
+		g_hash_table_insert(thumbnails, actor, thumb);
+	}
+	else
+	{
+		g_queue_unlink(&lru, thumb->link);
+		g_queue_push_head_link(&lru, thumb->link);
+	}
+
+	if(thumb->dirty && !thumbnail_render(thumb) && !thumb->content->texture)
+		return NULL;
+
+	evict_thumbnails(thumb);
+	return CLUTTER_CONTENT(thumb->content);
+}
+
+
+
+/*
+ * Switcher
+ */
+
+struct _GrapheneSwitcher
+{
+	CmkWidget parent;
+
+	GrapheneSwitcherCb callback;
+	gpointer userdata;
+	ClutterModifierType mask;
+
+	GPtrArray *windows; // MetaWindow *, refed
+	GPtrArray *buttons; // CmkButton *, parallel to windows
+	guint selected;
+	guint eventFilterId;
+	gboolean done;
+};
+
+static void graphene_switcher_dispose(GObject *self_);
+static void on_window_unmanaged(MetaWindow *window, GrapheneSwitcher *self);
+
+G_DEFINE_TYPE(GrapheneSwitcher, graphene_switcher, CMK_TYPE_WIDGET);
+
+
+static void graphene_switcher_class_init(GrapheneSwitcherClass *class)
+{
+	G_OBJECT_CLASS(class)->dispose = graphene_switcher_dispose;
+}
+
+static void graphene_switcher_init(GrapheneSwitcher *self)
+{
+	self->windows = g_ptr_array_new_with_free_func(g_object_unref);
+	self->buttons = g_ptr_array_new();
+
+	cmk_widget_set_draw_background_color(CMK_WIDGET(self), TRUE);
+	clutter_actor_set_layout_manager(CLUTTER_ACTOR(self), clutter_box_layout_new());
+	clutter_actor_set_reactive(CLUTTER_ACTOR(self), TRUE);
+}
+
+static void graphene_switcher_dispose(GObject *self_)
+{
+	GrapheneSwitcher *self = GRAPHENE_SWITCHER(self_);
+	if(self->eventFilterId)
+		clutter_event_remove_filter(self->eventFilterId);
+	self->eventFilterId = 0;
+	if(self->windows)
+		for(guint i = 0; i < self->windows->len; ++i)
+			g_signal_handlers_disconnect_by_func(g_ptr_array_index(self->windows, i), on_window_unmanaged, self);
+	g_clear_pointer(&self->windows, g_ptr_array_unref);
+	g_clear_pointer(&self->buttons, g_ptr_array_unref);
+	G_OBJECT_CLASS(graphene_switcher_parent_class)->dispose(self_);
+}
+
+static void switcher_finish(GrapheneSwitcher *self, MetaWindow *window)
+{
+	if(self->done)
+		return;
+	self->done = TRUE;
+	if(self->eventFilterId)
+		clutter_event_remove_filter(self->eventFilterId);
+	self->eventFilterId = 0;
+	self->callback(self, window, self->userdata);
+}
+
+static void switcher_select(GrapheneSwitcher *self, gint index)
+{
+	gint n = self->buttons->len;
+	index = ((index % n) + n) % n;
+	cmk_button_set_selected(g_ptr_array_index(self->buttons, self->selected), FALSE);
+	self->selected = index;
+	cmk_button_set_selected(g_ptr_array_index(self->buttons, self->selected), TRUE);
+}
+
+/*
+ * Windows closed while the switcher is open are dropped from it, so an
+ * unmanaged window can never be chosen.
+ */
+static void on_window_unmanaged(MetaWindow *window, GrapheneSwitcher *self)
+{
+	guint i = 0;
+	while(i < self->windows->len && g_ptr_array_index(self->windows, i) != window)
+		++i;
+	if(i == self->windows->len)
+		return;
+
+	g_signal_handlers_disconnect_by_func(window, on_window_unmanaged, self);
+	ClutterActor *button = g_ptr_array_index(self->buttons, i);
+	g_ptr_array_remove_index(self->buttons, i);
+	g_ptr_array_remove_index(self->windows, i);
+	clutter_actor_destroy(button);
+
+	guint n = self->buttons->len;
+	if(n == 0)
+	{
+		switcher_finish(self, NULL);
+		return;
+	}
+
+	// Keep the same window selected, or move on to the next if it was
+	// the one that closed
+	if(self->selected > i)
+		self->selected--;
+	else if(self->selected == i)
+		self->selected = i % n;
+	cmk_button_set_selected(g_ptr_array_index(self->buttons, self->selected), TRUE);
+}
+
+static void on_button_activate(CmkButton *button, GrapheneSwitcher *self)
+{
+	for(guint i = 0; i < self->buttons->len; ++i)
+		if(g_ptr_array_index(self->buttons, i) == button)
+			switcher_finish(self, g_ptr_array_index(self->windows, i));
+}
+
+static gboolean is_mask_modifier(guint keyval, ClutterModifierType mask)
+{
+	switch(keyval)
+	{
+	case CLUTTER_KEY_Alt_L:
+	case CLUTTER_KEY_Alt_R:
+	case CLUTTER_KEY_Meta_L:
+	case CLUTTER_KEY_Meta_R:
+		return mask & CLUTTER_MOD1_MASK;
+	case CLUTTER_KEY_Super_L:
+	case CLUTTER_KEY_Super_R:
+		return mask & (CLUTTER_SUPER_MASK | CLUTTER_MOD4_MASK);
+	case CLUTTER_KEY_Control_L:
+	case CLUTTER_KEY_Control_R:
+		return mask & CLUTTER_CONTROL_MASK;
+	case CLUTTER_KEY_Shift_L:
+	case CLUTTER_KEY_Shift_R:
+		return mask & CLUTTER_SHIFT_MASK;
+	}
+	return FALSE;
+}
+
+static gboolean switcher_event_filter(const ClutterEvent *event, gpointer userdata)
+{
+	GrapheneSwitcher *self = GRAPHENE_SWITCHER(userdata);
+	ClutterEventType type = clutter_event_type(event);
+
+	if(type == CLUTTER_BUTTON_PRESS)
+	{
+		ClutterActor *source = clutter_event_get_source(event);
+		if(source != CLUTTER_ACTOR(self) && !clutter_actor_contains(CLUTTER_ACTOR(self), source))
+		{
+			switcher_finish(self, NULL);
+			return CLUTTER_EVENT_STOP;
+		}
+		return CLUTTER_EVENT_PROPAGATE;
+	}
+
+	if(type != CLUTTER_KEY_PRESS && type != CLUTTER_KEY_RELEASE)
+		return CLUTTER_EVENT_PROPAGATE;
+
+	guint keyval = clutter_event_get_key_symbol(event);
+
+	if(type == CLUTTER_KEY_RELEASE)
+	{
+		if(is_mask_modifier(keyval, self->mask))
+			switcher_finish(self, g_ptr_array_index(self->windows, self->selected));
+		return CLUTTER_EVENT_STOP;
+	}
+
+	gboolean shift = clutter_event_has_shift_modifier(event);
+	switch(keyval)
+	{
+	case CLUTTER_KEY_Tab:
+	case CLUTTER_KEY_Right:
+		switcher_select(self, self->selected + (shift ? -1 : 1));
+		break;
+	case CLUTTER_KEY_ISO_Left_Tab:
+	case CLUTTER_KEY_Left:
+		switcher_select(self, self->selected - 1);
+		break;
+	case CLUTTER_KEY_Escape:
+		switcher_finish(self, NULL);
+		break;
+	case CLUTTER_KEY_Return:
+	case CLUTTER_KEY_KP_Enter:
+	case CLUTTER_KEY_space:
+		switcher_finish(self, g_ptr_array_index(self->windows, self->selected));
+		break;
+	}
+	return CLUTTER_EVENT_STOP;
+}
+
+static CmkButton * create_button(GrapheneSwitcher *self, MetaWindow *window)
+{
+	CmkWidget *box = cmk_widget_new();
+	clutter_actor_set_layout_manager(CLUTTER_ACTOR(box), clutter_bin_layout_new(CLUTTER_BIN_ALIGNMENT_CENTER, CLUTTER_BIN_ALIGNMENT_CENTER));
+	cmk_widget_set_margin(box, 8, 8, 8, 8);
+	clutter_actor_set_size(CLUTTER_ACTOR(box), THUMBNAIL_MAX_WIDTH, THUMBNAIL_MAX_HEIGHT);
+
+	MetaWindowActor *windowActor = META_WINDOW_ACTOR(meta_window_get_compositor_private(window));
+	ClutterContent *content = windowActor ? get_thumbnail(windowActor) : NULL;
+	if(content)
+	{
+		ClutterActor *thumbnail = clutter_actor_new();
+		gfloat width = 0, height = 0;
+		clutter_content_get_preferred_size(content, &width, &height);
+		clutter_actor_set_size(thumbnail, width, height);
+		clutter_actor_set_content(thumbnail, content);
+		clutter_actor_add_child(CLUTTER_ACTOR(box), thumbnail);
+	}
+
+	CmkButton *button = cmk_button_new(CMK_BUTTON_TYPE_EMBED);
+	cmk_button_set_content(button, box);
+	cmk_widget_set_style_parent(CMK_WIDGET(button), CMK_WIDGET(self));
+	g_signal_connect(button, "activate", G_CALLBACK(on_button_activate), self);
+	return button;
+}
+
+GrapheneSwitcher * graphene_switcher_new(GList *windows, ClutterModifierType mask, gboolean backward, GrapheneSwitcherCb callback, gpointer userdata)
+{
+	g_return_val_if_fail(windows, NULL);
+	g_return_val_if_fail(callback, NULL);
+
+	GrapheneSwitcher *self = GRAPHENE_SWITCHER(g_object_new(GRAPHENE_TYPE_SWITCHER, NULL));
+	self->callback = callback;
+	self->userdata = userdata;
+	self->mask = mask;
+
+	for(GList *it = windows; it != NULL; it = it->next)
+	{
+		CmkButton *button = create_button(self, META_WINDOW(it->data));
+		g_ptr_array_add(self->windows, g_object_ref(it->data));
+		g_ptr_array_add(self->buttons, button);
+		g_signal_connect(it->data, "unmanaged", G_CALLBACK(on_window_unmanaged), self);
+		clutter_actor_add_child(CLUTTER_ACTOR(self), CLUTTER_ACTOR(button));
+	}
+
+	self->selected = 0;
+	switcher_select(self, backward ? -1 : 1);
+	return self;
+}
+
+void graphene_switcher_start(GrapheneSwitcher *self)
+{
+	g_return_if_fail(GRAPHENE_IS_SWITCHER(self));
+	ClutterActor *stage = clutter_actor_get_stage(CLUTTER_ACTOR(self));
+	g_return_if_fail(stage);
+	if(!self->eventFilterId && !self->done)
+		self->eventFilterId = clutter_event_add_filter(CLUTTER_STAGE(stage), switcher_event_filter, NULL, self);
+}
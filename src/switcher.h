@@ -0,0 +1,57 @@
+/*
+ * This file is part of graphene-desktop, the desktop environment of VeltOS.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * The Alt-Tab window switcher popup. Shows a thumbnail of each window, and
+ * handles its own key events while open. The WM is responsible for placing
+ * it on screen and for going modal while it's open.
+ */
+
+#ifndef __GRAPHENE_SWITCHER_H__
+#define __GRAPHENE_SWITCHER_H__
+
+#include <cmk/cmk.h>
+#include <meta/window.h>
+
+G_BEGIN_DECLS
+
+#define GRAPHENE_TYPE_SWITCHER  graphene_switcher_get_type()
+G_DECLARE_FINAL_TYPE(GrapheneSwitcher, graphene_switcher, GRAPHENE, SWITCHER, CmkWidget)
+
+/*
+ * Called once when the switcher is done, with the chosen window or NULL if
+ * it was cancelled. The switcher may be destroyed from this callback.
+ */
+typedef void (*GrapheneSwitcherCb)(GrapheneSwitcher *switcher, MetaWindow *window, gpointer userdata);
+
+/*
+ * Creates a switcher for a list of MetaWindows, in most-recently-used order.
+ * The second window (or the last, if backward) starts selected. The switcher
+ * selects its window when all modifier keys in mask are released.
+ * Windows that are unmanaged while it's open are removed, and if none are
+ * left, it finishes as if cancelled.
+ */
+GrapheneSwitcher * graphene_switcher_new(GList *windows, ClutterModifierType mask, gboolean backward, GrapheneSwitcherCb callback, gpointer userdata);
+
+/*
+ * Starts listening for key events. Call after the switcher is on the stage
+ * and the WM has gone modal.
+ */
+void graphene_switcher_start(GrapheneSwitcher *switcher);
+
+G_END_DECLS
+
+#endif /* __GRAPHENE_SWITCHER_H__ */
@@ -149,3 +149,28 @@ GObject * monitor_gsettings_key(const gchar *schemaId, const gchar *key, GCallba
   g_free(signalName);
   return settings;
 }
+
+static gint compare_int64(gconstpointer a, gconstpointer b)
+{
+  gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Sorts <samples>, an array of gint64 latencies in microseconds, and
+ * returns their p50, p90, p99 and max formatted for a log line.
+ * Returns NULL if <samples> is empty. Free with g_free().
+ */
+gchar * latency_percentiles(GArray *samples)
+{
+  guint n = samples->len;
+  if(n == 0)
+    return NULL;
+
+  g_array_sort(samples, compare_int64);
+  #define percentile(p) g_array_index(samples, gint64, MIN(n - 1, (guint)(n * (p) / 100)))
+  gchar *summary = g_strdup_printf("p50 %6lius  p90 %6lius  p99 %6lius  max %6lius",
+    (glong)percentile(50), (glong)percentile(90), (glong)percentile(99), (glong)percentile(100));
+  #undef percentile
+  return summary;
+}
@@ -0,0 +1,214 @@
+/*
+ * This file is part of graphene-desktop, the desktop environment of VeltOS.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Everything in the compositor (session manager, DBus handlers, csk modules,
+ * panel) runs on one main loop, so any blocking call freezes the desktop.
+ * A main loop source increments a counter a few times per stall threshold,
+ * and a separate thread checks that it keeps moving. If it stops for too long, the
+ * watchdog interrupts the main thread with a signal, whose handler writes
+ * the main thread's stack to the stall log.
+ */
+
+#include "watchdog.h"
+#include "util.h"
+#include <glib/gstdio.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define WATCHDOG_SETTINGS_SCHEMA "io.velt.desktop.wm"
+#define WATCHDOG_PING_DIVISOR 4 // Pings per stall threshold
+#define WATCHDOG_MIN_PING_INTERVAL 50 // ms
+#define WATCHDOG_LOG_MAX_SIZE (256*1024) // Bytes; the log is cleared once it grows past this
+#define WATCHDOG_MAX_FRAMES 64
+#define WATCHDOG_CAPTURE_TIMEOUT 1000 // ms to wait for the main thread to write its backtrace
+#define WATCHDOG_SIGNAL SIGUSR2
+
+static pthread_t mainThread;
+static GThread *watchdogThread = NULL;
+static guint pingSourceId = 0;
+static guint threshold = 0; // ms
+static guint pingInterval = 0; // ms
+static gint logFd = -1;
+static gchar *logPath = NULL;
+
+// Accessed atomically
+static gint pingCount = 0;
+static gint running = 0;
+static gint captureDone = 0;
+
+
+// Async-signal-safe write of a whole string to the log
+static void write_str(const gchar *str)
+{
+	gsize len = strlen(str);
+	while(len > 0)
+	{
+		ssize_t n = write(logFd, str, len);
+		if(n <= 0)
+			return;
+		str += n;
+		len -= n;
+	}
+}
+
+static gboolean on_ping(UNUSED gpointer userdata)
+{
+	g_atomic_int_inc(&pingCount);
+	return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Runs on the main thread, on top of whatever it's stuck in. backtrace() is
+ * primed in graphene_watchdog_start so that it won't allocate here.
+ */
+static void on_capture_signal(UNUSED int sig)
+{
+	int savedErrno = errno;
+
+	GSource *source = g_main_current_source();
+	const gchar *name = source ? g_source_get_name(source) : NULL;
+	write_str("Dispatching source: ");
+	write_str(name ? name : (source ? "(unnamed)" : "(none)"));
+	write_str("\n");
+
+	void *frames[WATCHDOG_MAX_FRAMES];
+	int n = backtrace(frames, WATCHDOG_MAX_FRAMES);
+	backtrace_symbols_fd(frames, n, logFd);
+	write_str("\n");
+
+	g_atomic_int_set(&captureDone, 1);
+	errno = savedErrno;
+}
+
+static void capture_stall(gint64 stallMs)
+{
+	// Keep the log bounded. It's opened with O_APPEND, so writes continue
+	// from the start after truncating.
+	struct stat st;
+	if(fstat(logFd, &st) == 0 && st.st_size > WATCHDOG_LOG_MAX_SIZE)
+		if(ftruncate(logFd, 0) < 0) {}
+
+	GDateTime *dt = g_date_time_new_now_local();
+	gchar *time = g_date_time_format(dt, "%F %T");
+	gchar *header = g_strdup_printf("==== %s: main loop stalled for %lims ====\n", time, (glong)stallMs);
+	write_str(header);
+	g_free(header);
+	g_free(time);
+	g_date_time_unref(dt);
+
+	g_atomic_int_set(&captureDone, 0);
+	pthread_kill(mainThread, WATCHDOG_SIGNAL);
+	for(guint i=0; i<WATCHDOG_CAPTURE_TIMEOUT/10 && !g_atomic_int_get(&captureDone); ++i)
+		g_usleep(10 * 1000);
+	if(!g_atomic_int_get(&captureDone))
+		write_str("(main thread did not respond)\n\n");
+}
+
+static gpointer watchdog_thread_func(UNUSED gpointer userdata)
+{
+	gint lastCount = g_atomic_int_get(&pingCount);
+	gint64 lastChange = g_get_monotonic_time();
+	gboolean stalled = FALSE;
+	while(g_atomic_int_get(&running))
+	{
+		g_usleep((gulong)pingInterval * 1000);
+
+		gint count = g_atomic_int_get(&pingCount);
+		gint64 now = g_get_monotonic_time();
+		if(count != lastCount)
+		{
+			if(stalled)
+			{
+				gchar *msg = g_strdup_printf("Recovered after %lims\n\n", (glong)((now - lastChange) / 1000));
+				write_str(msg);
+				g_free(msg);
+			}
+			lastCount = count;
+			lastChange = now;
+			stalled = FALSE;
+		}
+		else if(!stalled && now - lastChange >= (gint64)threshold * 1000)
+		{
+			// Only capture once per stall
+			stalled = TRUE;
+			capture_stall((now - lastChange) / 1000);
+		}
+	}
+	return NULL;
+}
+
+void graphene_watchdog_start()
+{
+	if(watchdogThread)
+		return;
+
+	threshold = 0;
+	GVariant *thresholdV = get_gsettings_value(WATCHDOG_SETTINGS_SCHEMA, "stall-threshold");
+	if(thresholdV)
+	{
+		if(g_variant_is_of_type(thresholdV, G_VARIANT_TYPE_UINT32))
+			threshold = g_variant_get_uint32(thresholdV);
+		g_variant_unref(thresholdV);
+	}
+	if(threshold == 0)
+		return;
+
+	gchar *logDir = g_build_filename(g_get_user_cache_dir(), "graphene", NULL);
+	g_mkdir_with_parents(logDir, 0700);
+	logPath = g_build_filename(logDir, "stalls.log", NULL);
+	g_free(logDir);
+	logFd = open(logPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if(logFd < 0)
+	{
+		g_warning("Failed to open stall log '%s': %s", logPath, g_strerror(errno));
+		g_clear_pointer(&logPath, g_free);
+		return;
+	}
+
+	// backtrace() loads libgcc on first use, which isn't safe in a signal handler
+	void *frames[1];
+	backtrace(frames, 1);
+
+	mainThread = pthread_self();
+	struct sigaction action = {0};
+	action.sa_handler = on_capture_signal;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(WATCHDOG_SIGNAL, &action, NULL);
+
+	// Idle desktops shouldn't wake up every frame just for this. A stall is
+	// still caught within a quarter threshold or so of crossing it.
+	pingInterval = MAX(threshold / WATCHDOG_PING_DIVISOR, WATCHDOG_MIN_PING_INTERVAL);
+	pingSourceId = g_timeout_add(pingInterval, on_ping, NULL);
+	g_source_set_name_by_id(pingSourceId, "[graphene] watchdog ping");
+
+	g_atomic_int_set(&running, 1);
+	watchdogThread = g_thread_new("graphene-watchdog", watchdog_thread_func, NULL);
+	g_message("Main loop watchdog started (threshold %ums, log '%s')", threshold, logPath);
+}
+
+void graphene_watchdog_stop()
+{
+	if(!watchdogThread)
+		return;
+
+	g_atomic_int_set(&running, 0);
+	g_thread_join(watchdogThread);
+	watchdogThread = NULL;
+
+	if(pingSourceId)
+		g_source_remove(pingSourceId);
+	pingSourceId = 0;
+	signal(WATCHDOG_SIGNAL, SIG_DFL);
+	close(logFd);
+	logFd = -1;
+	g_clear_pointer(&logPath, g_free);
+}
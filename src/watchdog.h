@@ -0,0 +1,26 @@
+/*
+ * This file is part of graphene-desktop, the desktop environment of VeltOS.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ */
+
+#ifndef __GRAPHENE_WATCHDOG_H__
+#define __GRAPHENE_WATCHDOG_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Starts watching the default main loop for stalls. Must be called from the
+ * thread that runs the main loop. When the main loop fails to run for longer
+ * than the stall-threshold setting (io.velt.desktop.wm), the main thread's
+ * backtrace and the GSource being dispatched are written to
+ * $XDG_CACHE_HOME/graphene/stalls.log. Does nothing if the threshold is 0.
+ */
+void graphene_watchdog_start();
+void graphene_watchdog_stop();
+
+G_END_DECLS
+
+#endif /* __GRAPHENE_WATCHDOG_H__ */
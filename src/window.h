@@ -26,16 +26,28 @@ typedef enum
 	GRAPHENE_WINDOW_FLAG_SKIP_TASKBAR = 8
 } GrapheneWindowFlags;
 
+// Which fields of a GrapheneWindow changed since delegates were last told
+typedef enum
+{
+	GRAPHENE_WINDOW_CHANGED_TITLE = 1,
+	GRAPHENE_WINDOW_CHANGED_ICON = 2,
+	GRAPHENE_WINDOW_CHANGED_FLAGS = 4,
+	GRAPHENE_WINDOW_CHANGED_ALL = 7
+} GrapheneWindowChanges;
+
 struct _GrapheneWindow
 {
 	// Delegates ignore
 	void *wm;
 	void *window;
+	unsigned int index; // Position in the WM's window array
+	GrapheneWindowChanges pending; // Changes not yet sent to delegates
 
 	// Delegates may use but not modify
 	const char *title;
 	char *icon;
 	GrapheneWindowFlags flags;
+	GrapheneWindowChanges changed; // Set when delegates are notified of an update
 	
 	void (*show)(GrapheneWindow *window);
 	void (*minimize)(GrapheneWindow *window);
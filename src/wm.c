@@ -19,6 +19,8 @@
 #include "wm.h"
 #include "background.h"
 #include "dialog.h"
+#include "frame-stats.h"
+#include "switcher.h"
 #include "window.h"
 #include <cmk/cmk.h>
 #include <cmk/cmk-icon-loader.h>
@@ -27,12 +29,16 @@
 #include <meta/display.h>
 #include <meta/keybindings.h>
 #include <meta/util.h>
+#include <meta/meta-cursor-tracker.h>
 #include <glib-unix.h>
+#include <gio/gdesktopappinfo.h>
 #include <stdio.h>
+#include <string.h>
 
 #define WM_VERSION_STRING "1.0.0"
 #define WM_PERCENT_BAR_STEPS 15
 #define WM_TRANSITION_TIME 200 // Common transition time, ms
+#define WM_WINDOW_ICON_SIZE 24 // Size of icons given to delegates
 #define ACTOR CLUTTER_ACTOR // I am lazy
 
 static const CmkNamedColor GrapheneColors[] = {
@@ -86,6 +92,8 @@ static void destroy_done(ClutterActor *actor, MetaPlugin *plugin);
 static void map_done(ClutterActor *actor, MetaPlugin *plugin);
 
 static void init_keybindings(GrapheneWM *self);
+static void init_window_icons(GrapheneWM *self);
+static void init_unredirect_policy(GrapheneWM *self);
 
 const MetaPluginInfo * graphene_wm_plugin_info(UNUSED MetaPlugin *plugin)
 {
@@ -157,15 +165,22 @@ void graphene_wm_start(MetaPlugin *self_)
 
 	self->stage = meta_get_stage_for_screen(screen);
 
+	self->windows = g_ptr_array_new();
+	init_window_icons(self);
+
 	MetaDisplay *display = meta_screen_get_display(screen);
 	g_signal_connect_swapped(display, "window-created", G_CALLBACK(on_window_created), self_);
 
 	self->audioManager = csk_audio_device_manager_get_default();
 
+	// Connects to UPower now, so the first keypress already has a value
+	csk_keyboard_backlight_get_brightness();
+
 	// Don't bother clearing the stage when we're drawing our own background
 	clutter_stage_set_no_clear_hint(CLUTTER_STAGE(self->stage), TRUE);
 
 	init_keybindings(self);
+	graphene_frame_stats_start(CLUTTER_STAGE(self->stage));
 	
 	// Default styling
 	// TODO: Load styling from a file
@@ -220,39 +235,121 @@ void graphene_wm_start(MetaPlugin *self_)
 	clutter_actor_show(self->coverGroup);
 	graphene_wm_begin_modal(self);
 
-	// TODO: "Unredirection" is the WM's feature of painting fullscreen windows
-	// directly to the screen without compositing. This is good for speed, but
-	// means that things like the volume bar won't get shown over fullscreen
-	// windows. So whenever the volume bar needs to be shown, and a window is
-	// in fullscreen, temporarily disable unredirection (but also be sure to
-	// hide the task bar). This also applies to notifications and cover group.
-	//meta_disable_unredirect_for_screen(screen);
+	// Fullscreen windows may skip compositing, unless something of ours
+	// needs to be shown over them
+	init_unredirect_policy(self);
+}
+
+static void set_cover_geometry(ClutterActor *cover, const MetaRectangle *rect)
+{
+	clutter_actor_set_position(cover, rect->x, rect->y);
+	clutter_actor_set_size(cover, rect->width, rect->height);
 }
 
+/*
+ * Monitor hotplugs usually leave most monitors as they were, so match the
+ * new layout against the old one and only touch what changed. A monitor
+ * with the same geometry keeps its background and cover even if its index
+ * changed; moved or resized monitors reuse leftover actors; and only then
+ * are actors created or destroyed.
+ */
 static void on_monitors_changed(MetaScreen *screen, GrapheneWM *self)
 {
 	ClutterActor *bgGroup = ACTOR(self->backgroundGroup);
-	clutter_actor_destroy_all_children(bgGroup);
-	clutter_actor_destroy_all_children(self->coverGroup);
-	
-	ClutterColor *coverColor = clutter_color_new(0,0,0,140);
 
-	gint numMonitors = meta_screen_get_n_monitors(screen);
-	for(int i=0;i<numMonitors;++i)
+	if(!self->monitors)
 	{
-		clutter_actor_add_child(bgGroup, ACTOR(graphene_wm_background_new(screen, i)));
-	
-		MetaRectangle rect = meta_rect(0,0,0,0);
-		meta_screen_get_monitor_geometry(screen, i, &rect);
+		self->monitors = g_array_new(FALSE, FALSE, sizeof(MetaRectangle));
+		self->backgrounds = g_ptr_array_new();
+		self->covers = g_ptr_array_new();
+	}
+
+	guint oldCount = self->monitors->len;
+	guint newCount = meta_screen_get_n_monitors(screen);
+	MetaRectangle *rects = g_newa(MetaRectangle, newCount);
+	gboolean *used = g_newa(gboolean, oldCount + 1);
+	gint *match = g_newa(gint, newCount + 1);
+	gboolean *moved = g_newa(gboolean, newCount + 1);
+	memset(used, 0, (oldCount + 1) * sizeof(gboolean));
+	memset(moved, 0, (newCount + 1) * sizeof(gboolean));
+
+	// Unchanged monitors
+	for(guint i = 0; i < newCount; ++i)
+	{
+		rects[i] = meta_rect(0,0,0,0);
+		meta_screen_get_monitor_geometry(screen, i, &rects[i]);
+		match[i] = -1;
+		for(guint j = 0; j < oldCount; ++j)
+		{
+			if(!used[j] && meta_rectangle_equal(&rects[i], &g_array_index(self->monitors, MetaRectangle, j)))
+			{
+				used[j] = TRUE;
+				match[i] = j;
+				break;
+			}
+		}
+	}
+
+	// Changed monitors take over unused actors
+	guint nextUnused = 0;
+	for(guint i = 0; i < newCount; ++i)
+	{
+		if(match[i] >= 0)
+			continue;
+		while(nextUnused < oldCount && used[nextUnused])
+			nextUnused ++;
+		if(nextUnused < oldCount)
+		{
+			used[nextUnused] = TRUE;
+			match[i] = nextUnused;
+			moved[i] = TRUE;
+			set_cover_geometry(g_ptr_array_index(self->covers, nextUnused), &rects[i]);
+		}
+	}
+
+	GPtrArray *backgrounds = g_ptr_array_sized_new(newCount);
+	GPtrArray *covers = g_ptr_array_sized_new(newCount);
+	ClutterColor coverColor = {0, 0, 0, 140};
+
+	for(guint i = 0; i < newCount; ++i)
+	{
+		if(match[i] >= 0)
+		{
+			GrapheneWMBackground *bg = g_ptr_array_index(self->backgrounds, match[i]);
+			// The background actor finds its geometry by monitor index, so
+			// it needs updating even if only the index changed
+			if(moved[i] || match[i] != (gint)i)
+				graphene_wm_background_set_monitor(bg, i);
+			g_ptr_array_add(backgrounds, bg);
+			g_ptr_array_add(covers, g_ptr_array_index(self->covers, match[i]));
+			continue;
+		}
+
+		GrapheneWMBackground *bg = graphene_wm_background_new(screen, i);
+		clutter_actor_add_child(bgGroup, ACTOR(bg));
+		g_ptr_array_add(backgrounds, bg);
 
 		ClutterActor *cover = clutter_actor_new();
-		clutter_actor_set_background_color(cover, coverColor);
-		clutter_actor_set_position(cover, rect.x, rect.y);
-		clutter_actor_set_size(cover, rect.width, rect.height);
+		clutter_actor_set_background_color(cover, &coverColor);
+		set_cover_geometry(cover, &rects[i]);
 		clutter_actor_add_child(self->coverGroup, cover);
+		g_ptr_array_add(covers, cover);
+	}
+
+	for(guint j = 0; j < oldCount; ++j)
+	{
+		if(used[j])
+			continue;
+		clutter_actor_destroy(g_ptr_array_index(self->backgrounds, j));
+		clutter_actor_destroy(g_ptr_array_index(self->covers, j));
 	}
-	
-	clutter_color_free(coverColor);
+
+	g_ptr_array_unref(self->backgrounds);
+	g_ptr_array_unref(self->covers);
+	self->backgrounds = backgrounds;
+	self->covers = covers;
+	g_array_set_size(self->monitors, 0);
+	g_array_append_vals(self->monitors, rects, newCount);
 
 	int primaryMonitor = meta_screen_get_primary_monitor(screen);
 	MetaRectangle primary;
@@ -301,26 +398,128 @@ static void graphene_window_set_icon_box(GrapheneWindow *cwindow, double x, doub
 	meta_window_set_icon_geometry(META_WINDOW(cwindow->window), &rect);
 }
 
-static void graphene_window_update(GrapheneWindow *cwindow)
+static void graphene_window_update_title(GrapheneWindow *cwindow)
+{
+	cwindow->title = meta_window_get_title(META_WINDOW(cwindow->window));
+}
+
+/*
+ * Resolving a window's icon means looking through desktop files and the icon
+ * theme, which is too slow to do on every property change. Results are
+ * cached by everything that can affect them, and only recomputed when a
+ * window's WM_CLASS changes or the installed apps or icon theme change.
+ */
+static GHashTable *iconCache = NULL; // Cache key (see below) to icon name
+static GHashTable *wmClassIndex = NULL; // StartupWMClass to icon name; built on demand
+static gchar *iconTheme = NULL;
+
+static gchar * icon_name_for_app_info(GAppInfo *info)
+{
+	GIcon *gicon = g_app_info_get_icon(info);
+	if(!G_IS_THEMED_ICON(gicon))
+		return NULL;
+	const gchar * const *names = g_themed_icon_get_names(G_THEMED_ICON(gicon));
+	return (names && names[0]) ? g_strdup(names[0]) : NULL;
+}
+
+static void build_wm_class_index(void)
+{
+	wmClassIndex = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	GList *apps = g_app_info_get_all();
+	for(GList *it = apps; it != NULL; it = it->next)
+	{
+		if(!G_IS_DESKTOP_APP_INFO(it->data))
+			continue;
+		const gchar *wmClass = g_desktop_app_info_get_startup_wm_class(G_DESKTOP_APP_INFO(it->data));
+		if(!wmClass || g_hash_table_contains(wmClassIndex, wmClass))
+			continue;
+		gchar *icon = icon_name_for_app_info(G_APP_INFO(it->data));
+		if(icon)
+			g_hash_table_insert(wmClassIndex, g_strdup(wmClass), icon);
+	}
+	g_list_free_full(apps, g_object_unref);
+}
+
+static gchar * resolve_window_icon(const gchar *wmClass, const gchar *instance, const gchar *appId)
+{
+	// GTK applications say exactly which desktop file they belong to
+	if(appId)
+	{
+		gchar *desktopId = g_strconcat(appId, ".desktop", NULL);
+		GDesktopAppInfo *info = g_desktop_app_info_new(desktopId);
+		g_free(desktopId);
+		if(info)
+		{
+			gchar *icon = icon_name_for_app_info(G_APP_INFO(info));
+			g_object_unref(info);
+			if(icon)
+				return icon;
+		}
+	}
+
+	// Otherwise, find a desktop file which claims this WM_CLASS
+	if(!wmClassIndex)
+		build_wm_class_index();
+	const gchar *icon = NULL;
+	if(wmClass)
+		icon = g_hash_table_lookup(wmClassIndex, wmClass);
+	if(!icon && instance)
+		icon = g_hash_table_lookup(wmClassIndex, instance);
+	if(icon)
+		return g_strdup(icon);
+
+	// Last resort, hope there's an icon named after the class
+	// TODO: Should probably validate g_utf8_strdown
+	if(wmClass)
+	{
+		gchar *name = g_utf8_strdown(wmClass, -1);
+		if(cmk_icon_loader_lookup(cmk_icon_loader_get_default(), name, WM_WINDOW_ICON_SIZE))
+			return name;
+		g_free(name);
+	}
+	if(instance)
+		return g_utf8_strdown(instance, -1);
+	return g_strdup("");
+}
+
+static void graphene_window_update_icon(GrapheneWindow *cwindow)
 {
 	MetaWindow *window = META_WINDOW(cwindow->window);
-	cwindow->title = meta_window_get_title(window);
 	g_clear_pointer(&cwindow->icon, g_free);
-	
-	CmkIconLoader *loader = cmk_icon_loader_get_default();
 
-	// TODO: Should probably validate g_utf8_strdown
-	if(!cwindow->icon)
+	if(!iconCache)
+		iconCache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	const gchar *wmClass = meta_window_get_wm_class(window);
+	const gchar *instance = meta_window_get_wm_class_instance(window);
+	const gchar *appId = meta_window_get_gtk_application_id(window);
+
+	// Fields are separated by newlines, which can't be in any of them
+	gchar *key = g_strdup_printf("%s\n%s\n%s\n%s\n%i",
+		wmClass ? wmClass : "",
+		instance ? instance : "",
+		appId ? appId : "",
+		iconTheme ? iconTheme : "",
+		WM_WINDOW_ICON_SIZE);
+
+	const gchar *icon = g_hash_table_lookup(iconCache, key);
+	if(icon)
 	{
-		cwindow->icon = g_utf8_strdown(meta_window_get_wm_class(window), -1);
-		if(!cmk_icon_loader_lookup(loader, cwindow->icon, 24))
-			g_clear_pointer(&cwindow->icon, g_free);
+		g_free(key);
 	}
-	if(!cwindow->icon)
-		cwindow->icon = g_utf8_strdown(meta_window_get_wm_class_instance(window), -1);
-	if(!cwindow->icon)
-		cwindow->icon = g_strdup("");
-	
+	else
+	{
+		gchar *resolved = resolve_window_icon(wmClass, instance, appId);
+		g_hash_table_insert(iconCache, key, resolved);
+		icon = resolved;
+	}
+
+	cwindow->icon = g_strdup(icon);
+}
+
+static void graphene_window_update_flags(GrapheneWindow *cwindow)
+{
+	MetaWindow *window = META_WINDOW(cwindow->window);
 	cwindow->flags = GRAPHENE_WINDOW_FLAG_NORMAL;
 	gboolean minimized, attention, focused, skip;
 	g_object_get(window,
@@ -339,25 +538,106 @@ static void graphene_window_update(GrapheneWindow *cwindow)
 		cwindow->flags |= GRAPHENE_WINDOW_FLAG_SKIP_TASKBAR;
 }
 
-static void graphene_window_changed(GrapheneWindow *cwindow)
+static void graphene_window_update(GrapheneWindow *cwindow, GrapheneWindowChanges changes)
+{
+	if(changes & GRAPHENE_WINDOW_CHANGED_TITLE)
+		graphene_window_update_title(cwindow);
+	if(changes & GRAPHENE_WINDOW_CHANGED_ICON)
+		graphene_window_update_icon(cwindow);
+	if(changes & GRAPHENE_WINDOW_CHANGED_FLAGS)
+		graphene_window_update_flags(cwindow);
+}
+
+/*
+ * Sends all pending window changes to delegates. Runs before layout of the
+ * next frame, so any number of property notifications between two frames
+ * (a browser updating its title while loading, focus moving between
+ * windows, etc.) turn into at most one update per window.
+ */
+static gboolean flush_window_updates(GrapheneWM *self)
+{
+	self->windowFlushId = 0;
+	for(guint i = 0; i < self->windows->len; ++i)
+	{
+		GrapheneWindow *cwindow = g_ptr_array_index(self->windows, i);
+		if(!cwindow->pending)
+			continue;
+		graphene_window_update(cwindow, cwindow->pending);
+		cwindow->changed = cwindow->pending;
+		cwindow->pending = 0;
+		graphene_panel_update_window(self->panel, cwindow);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+static void graphene_window_queue_update(GrapheneWindow *cwindow, GrapheneWindowChanges changes)
+{
+	GrapheneWM *self = GRAPHENE_WM(cwindow->wm);
+	cwindow->pending |= changes;
+	if(self->windowFlushId)
+		return;
+	self->windowFlushId = clutter_threads_add_repaint_func_full(CLUTTER_REPAINT_FLAGS_PRE_PAINT,
+		(GSourceFunc)flush_window_updates, self, NULL);
+	// Repaint functions only run when there is a frame to draw, and a
+	// title change alone doesn't cause one.
+	clutter_actor_queue_redraw(graphene_panel_get_input_actor(self->panel));
+}
+
+static void on_window_title_changed(GrapheneWindow *cwindow)
+{
+	graphene_window_queue_update(cwindow, GRAPHENE_WINDOW_CHANGED_TITLE);
+}
+
+static void on_window_icon_changed(GrapheneWindow *cwindow)
+{
+	graphene_window_queue_update(cwindow, GRAPHENE_WINDOW_CHANGED_ICON);
+}
+
+static void on_window_flags_changed(GrapheneWindow *cwindow)
 {
-	graphene_window_update(cwindow);
-	graphene_panel_update_window(GRAPHENE_WM(cwindow->wm)->panel, cwindow);
+	graphene_window_queue_update(cwindow, GRAPHENE_WINDOW_CHANGED_FLAGS);
 }
 
-static void graphene_window_connect(GrapheneWindow *cwindow, GrapheneWindowNotify callback)
+static void graphene_window_connect(GrapheneWindow *cwindow)
 {
 	MetaWindow *window = META_WINDOW(cwindow->window);
-	g_signal_connect_swapped(window, "notify::title", G_CALLBACK(callback), cwindow);
-	g_signal_connect_swapped(window, "notify::minimized", G_CALLBACK(callback), cwindow);
-	g_signal_connect_swapped(window, "notify::appears-focused", G_CALLBACK(callback), cwindow);
-	g_signal_connect_swapped(window, "notify::demands-attention", G_CALLBACK(callback), cwindow);
-	g_signal_connect_swapped(window, "notify::wm-class", G_CALLBACK(callback), cwindow);
+	g_signal_connect_swapped(window, "notify::title", G_CALLBACK(on_window_title_changed), cwindow);
+	g_signal_connect_swapped(window, "notify::minimized", G_CALLBACK(on_window_flags_changed), cwindow);
+	g_signal_connect_swapped(window, "notify::appears-focused", G_CALLBACK(on_window_flags_changed), cwindow);
+	g_signal_connect_swapped(window, "notify::demands-attention", G_CALLBACK(on_window_flags_changed), cwindow);
+	g_signal_connect_swapped(window, "notify::skip-taskbar", G_CALLBACK(on_window_flags_changed), cwindow);
+	g_signal_connect_swapped(window, "notify::wm-class", G_CALLBACK(on_window_icon_changed), cwindow);
+	g_signal_connect_swapped(window, "notify::gtk-application-id", G_CALLBACK(on_window_icon_changed), cwindow);
+}
+
+static void invalidate_window_icons(GrapheneWM *self)
+{
+	if(iconCache)
+		g_hash_table_remove_all(iconCache);
+	g_clear_pointer(&wmClassIndex, g_hash_table_unref);
+	g_free(iconTheme);
+	iconTheme = g_settings_get_string(interfaceSettings, "icon-theme");
+
+	for(guint i = 0; i < self->windows->len; ++i)
+		graphene_window_queue_update(g_ptr_array_index(self->windows, i), GRAPHENE_WINDOW_CHANGED_ICON);
+}
+
+static void init_window_icons(GrapheneWM *self)
+{
+	iconTheme = g_settings_get_string(interfaceSettings, "icon-theme");
+	g_signal_connect_swapped(interfaceSettings, "changed::icon-theme", G_CALLBACK(invalidate_window_icons), self);
+	g_signal_connect_swapped(g_app_info_monitor_get(), "changed", G_CALLBACK(invalidate_window_icons), self);
 }
 
 static void on_window_destroyed(GrapheneWindow *cwindow, UNUSED MetaWindow *window)
 {
-	graphene_panel_remove_window(GRAPHENE_WM(cwindow->wm)->panel, cwindow);
+	GrapheneWM *self = GRAPHENE_WM(cwindow->wm);
+	graphene_panel_remove_window(self->panel, cwindow);
+
+	g_ptr_array_remove_index_fast(self->windows, cwindow->index);
+	if(cwindow->index < self->windows->len)
+		((GrapheneWindow *)g_ptr_array_index(self->windows, cwindow->index))->index = cwindow->index;
+
 	g_free(cwindow->icon);
 	g_free(cwindow);
 }
@@ -371,19 +651,53 @@ static void on_window_created(GrapheneWM *self, MetaWindow *window, UNUSED MetaD
 	cwindow->minimize = graphene_window_minimize;
 	cwindow->setIconBox = graphene_window_set_icon_box;
 
+	cwindow->index = self->windows->len;
+	g_ptr_array_add(self->windows, cwindow);
+
 	// This seems to be the best way to get a notification when a window is
 	// destroyed. In special cases, MetaWindow objects are freed and recreated,
 	// and I'm not sure if the window-created signal will be called in that
 	// case. TODO: Figure out.
 	g_object_weak_ref(G_OBJECT(window), (GWeakNotify)on_window_destroyed, cwindow);
 	
-	graphene_window_connect(cwindow, graphene_window_changed);
-	graphene_window_update(cwindow);
+	graphene_window_connect(cwindow);
+	graphene_window_update(cwindow, GRAPHENE_WINDOW_CHANGED_ALL);
+	cwindow->changed = GRAPHENE_WINDOW_CHANGED_ALL;
 
 	// Inform delegates
 	graphene_panel_add_window(self->panel, cwindow);
 }
 
+void graphene_wm_stop(GrapheneWM *self)
+{
+	g_return_if_fail(GRAPHENE_IS_WM(self));
+
+	if(self->windowFlushId)
+		clutter_threads_remove_repaint_func(self->windowFlushId);
+	self->windowFlushId = 0;
+
+	// Mutter normally destroys every window before meta_run returns, so
+	// this is usually empty
+	if(self->windows)
+	{
+		for(guint i = 0; i < self->windows->len; ++i)
+		{
+			GrapheneWindow *cwindow = g_ptr_array_index(self->windows, i);
+			g_object_weak_unref(G_OBJECT(cwindow->window), (GWeakNotify)on_window_destroyed, cwindow);
+			g_signal_handlers_disconnect_by_data(cwindow->window, cwindow);
+			g_free(cwindow->icon);
+			g_free(cwindow);
+		}
+		g_clear_pointer(&self->windows, g_ptr_array_unref);
+	}
+
+	// Other components keep the audio manager alive, so it's never
+	// disposed and can't log its statistics itself
+	if(self->audioManager)
+		csk_audio_device_manager_log_stats(self->audioManager);
+	g_clear_object(&self->audioManager);
+}
+
 static void update_struts(GrapheneWM *self)
 {
 	g_return_if_fail(GRAPHENE_IS_WM(self));
@@ -420,6 +734,143 @@ static void update_struts(GrapheneWM *self)
 
 
 
+/*
+ * Unredirection
+ *
+ * Mutter can let the topmost window bypass compositing entirely if it's
+ * fullscreen and opaque, which saves a copy per frame and some latency for
+ * games and video. But anything the WM draws over that window (the volume
+ * bar, notifications, dialogs, popups) then won't be seen, so
+ * unredirection is blocked while any of those are on the window's monitor.
+ * Users can also disable it entirely or per application.
+ *
+ * The top window is only re-examined when the stacking or fullscreen state
+ * changes; the overlay check is a few actor lookups and runs every frame,
+ * since anything appearing over the window causes a frame.
+ */
+
+#define WM_SETTINGS_SCHEMA "io.velt.desktop.wm"
+
+static GSettings *wmSettings = NULL;
+
+static gboolean window_class_in_list(MetaWindow *window, gchar **list)
+{
+	const gchar *wmClass = meta_window_get_wm_class(window);
+	const gchar *instance = meta_window_get_wm_class_instance(window);
+	for(guint i = 0; list[i]; ++i)
+		if((wmClass && g_ascii_strcasecmp(list[i], wmClass) == 0)
+		|| (instance && g_ascii_strcasecmp(list[i], instance) == 0))
+			return TRUE;
+	return FALSE;
+}
+
+static void update_unredirect_candidate(GrapheneWM *self)
+{
+	self->unredirectDirty = FALSE;
+	self->unredirectDenied = FALSE;
+	self->unredirectCandidate = FALSE;
+
+	// Mutter only ever unredirects the topmost window
+	GList *actors = meta_get_window_actors(screen);
+	GList *top = g_list_last(actors);
+	if(!top)
+		return;
+	MetaWindow *window = meta_window_actor_get_meta_window(META_WINDOW_ACTOR(top->data));
+	if(!window || !meta_window_is_fullscreen(window))
+		return;
+
+	gboolean allowed = TRUE;
+	if(wmSettings)
+	{
+		gchar **allow = g_settings_get_strv(wmSettings, "unredirect-allowlist");
+		gchar **deny = g_settings_get_strv(wmSettings, "unredirect-denylist");
+		// An empty allowlist allows everything
+		allowed = g_settings_get_boolean(wmSettings, "unredirect-fullscreen")
+			&& (!allow[0] || window_class_in_list(window, allow))
+			&& !window_class_in_list(window, deny);
+		g_strfreev(allow);
+		g_strfreev(deny);
+	}
+
+	if(!allowed)
+	{
+		self->unredirectDenied = TRUE;
+		return;
+	}
+
+	self->unredirectCandidate = TRUE;
+	meta_screen_get_monitor_geometry(screen, meta_window_get_monitor(window), &self->unredirectMonitor);
+}
+
+static gboolean actor_shown_on(ClutterActor *actor, const MetaRectangle *rect)
+{
+	if(!actor || !clutter_actor_is_mapped(actor) || clutter_actor_get_paint_opacity(actor) == 0)
+		return FALSE;
+	gfloat x, y, width, height;
+	clutter_actor_get_transformed_position(actor, &x, &y);
+	clutter_actor_get_transformed_size(actor, &width, &height);
+	return x < rect->x + rect->width && x + width > rect->x
+		&& y < rect->y + rect->height && y + height > rect->y;
+}
+
+static gboolean overlay_shown_on(GrapheneWM *self, const MetaRectangle *rect)
+{
+	// Dialogs, panel popups and the switcher are all modal
+	if(self->modalCount > 0)
+		return TRUE;
+	if(actor_shown_on(ACTOR(self->percentBar), rect))
+		return TRUE;
+	if(actor_shown_on(self->coverGroup, rect))
+		return TRUE;
+	if(clutter_actor_get_n_children(ACTOR(self->notificationBox)) > 0
+	&& actor_shown_on(ACTOR(self->notificationBox), rect))
+		return TRUE;
+	return FALSE;
+}
+
+static gboolean update_unredirect(GrapheneWM *self)
+{
+	if(self->unredirectDirty)
+		update_unredirect_candidate(self);
+
+	gboolean block = self->unredirectDenied
+		|| (self->unredirectCandidate && overlay_shown_on(self, &self->unredirectMonitor));
+
+	if(block && !self->unredirectDisabled)
+		meta_disable_unredirect_for_screen(screen);
+	else if(!block && self->unredirectDisabled)
+		meta_enable_unredirect_for_screen(screen);
+	self->unredirectDisabled = block;
+	return G_SOURCE_CONTINUE;
+}
+
+static void queue_unredirect_update(GrapheneWM *self)
+{
+	self->unredirectDirty = TRUE;
+	clutter_actor_queue_redraw(self->stage);
+}
+
+static void init_unredirect_policy(GrapheneWM *self)
+{
+	GSettingsSchema *schema = g_settings_schema_source_lookup(g_settings_schema_source_get_default(), WM_SETTINGS_SCHEMA, TRUE);
+	if(schema)
+	{
+		wmSettings = g_settings_new_full(schema, NULL, NULL);
+		g_settings_schema_unref(schema);
+		g_signal_connect_swapped(wmSettings, "changed", G_CALLBACK(queue_unredirect_update), self);
+	}
+
+	g_signal_connect_swapped(screen, "restacked", G_CALLBACK(queue_unredirect_update), self);
+	g_signal_connect_swapped(screen, "in-fullscreen-changed", G_CALLBACK(queue_unredirect_update), self);
+	g_signal_connect_swapped(screen, "monitors-changed", G_CALLBACK(queue_unredirect_update), self);
+
+	self->unredirectDirty = TRUE;
+	clutter_threads_add_repaint_func_full(CLUTTER_REPAINT_FLAGS_PRE_PAINT,
+		(GSourceFunc)update_unredirect, self, NULL);
+}
+
+
+
 /*
  * Based on shell-global.c:shell_global_set_stage_input_region from gnome-shell
  *
@@ -434,27 +885,40 @@ static void update_struts(GrapheneWM *self)
  *
  * Use the xfixes_add/remove_input_actor functions for this. They will
  * automatically handle watching for size/position changes. 
+ *
+ * Changes to the input actors only mark the region dirty; it is recalculated
+ * at most once per frame, after layout, and only sent to the X server if the
+ * rectangles actually changed. Animating the panel or a notification would
+ * otherwise cost a round trip for every property notification.
  */
 static void xfixes_calculate_input_region(GrapheneWM *self)
 {
 	if(meta_is_wayland_compositor())
 		return;
 
+	self->xInputDirty = FALSE;
+
 	MetaScreen *screen = meta_plugin_get_screen(META_PLUGIN(self));
 	Display *xDisplay = meta_display_get_xdisplay(meta_screen_get_display(screen));
 
-	guint numActors = g_list_length(self->xInputActors);
+	if(!self->xInputRects)
+		self->xInputRects = g_array_new(FALSE, FALSE, sizeof(XRectangle));
 
-	if(self->modalCount > 0 || numActors == 0)
+	if(self->modalCount > 0 || self->xInputActors == NULL)
 	{
+		if(self->xInputEmpty)
+			return;
 		meta_empty_stage_input_region(screen);
 		if(self->xInputRegion)
 			XFixesDestroyRegion(xDisplay, self->xInputRegion);
 		self->xInputRegion = 0;
+		g_array_set_size(self->xInputRects, 0);
+		self->xInputEmpty = TRUE;
 		return;
 	}
 
-	XRectangle *rects = g_new(XRectangle, numActors);
+	guint numActors = g_list_length(self->xInputActors);
+	XRectangle *rects = g_newa(XRectangle, numActors);
 	guint i = 0;
 
 	for(GList *it = self->xInputActors; it != NULL; it = it->next)
@@ -463,7 +927,7 @@ static void xfixes_calculate_input_region(GrapheneWM *self)
 			continue;
 		ClutterActor *actor = ACTOR(it->data);
 		if(!clutter_actor_is_mapped(actor) || !clutter_actor_get_reactive(actor))
-			return;
+			continue;
 		gfloat x, y, width, height;
 		clutter_actor_get_transformed_position(actor, &x, &y);
 		clutter_actor_get_transformed_size(actor, &width, &height);
@@ -474,14 +938,37 @@ static void xfixes_calculate_input_region(GrapheneWM *self)
 		i++;
 	}
 
+	if(!self->xInputEmpty
+	&& self->xInputRects->len == i
+	&& memcmp(self->xInputRects->data, rects, i * sizeof(XRectangle)) == 0)
+		return;
+
+	g_array_set_size(self->xInputRects, 0);
+	g_array_append_vals(self->xInputRects, rects, i);
+	self->xInputEmpty = FALSE;
+
 	if(self->xInputRegion)
 		XFixesDestroyRegion(xDisplay, self->xInputRegion);
 
 	self->xInputRegion = XFixesCreateRegion(xDisplay, rects, i);
-	g_free(rects);
 	meta_set_stage_input_region(screen, self->xInputRegion);
 }
 
+static gboolean xfixes_on_after_layout(GrapheneWM *self)
+{
+	if(self->xInputDirty)
+		xfixes_calculate_input_region(self);
+	return G_SOURCE_CONTINUE;
+}
+
+static void xfixes_on_input_actor_changed(ClutterActor *actor, UNUSED GParamSpec *pspec, GrapheneWM *self)
+{
+	self->xInputDirty = TRUE;
+	// Allocation and mapping changes already queue a redraw, but
+	// toggling reactive doesn't. Make sure a frame happens to flush this.
+	clutter_actor_queue_redraw(actor);
+}
+
 /*
  * Call this on any (reactive) actor which will show above windows.
  * This includes the Panel, modal popups, etc. You shouldn't need to manually
@@ -494,13 +981,19 @@ static void xfixes_add_input_actor(GrapheneWM *self, ClutterActor *actor)
 		return;
 	g_return_if_fail(CLUTTER_IS_ACTOR(actor));
 	self->xInputActors = g_list_prepend(self->xInputActors, actor);
+
+	// Post-paint rather than pre-paint, since layout happens between the
+	// two and the transformed positions are only correct afterwards.
+	if(!self->xInputRepaintId)
+		self->xInputRepaintId = clutter_threads_add_repaint_func_full(CLUTTER_REPAINT_FLAGS_POST_PAINT,
+			(GSourceFunc)xfixes_on_after_layout, self, NULL);
 	
-	g_signal_connect_swapped(actor, "notify::allocation", G_CALLBACK(xfixes_calculate_input_region), self);
-	g_signal_connect_swapped(actor, "notify::mapped", G_CALLBACK(xfixes_calculate_input_region), self);
-	g_signal_connect_swapped(actor, "notify::reactive", G_CALLBACK(xfixes_calculate_input_region), self);
+	g_signal_connect(actor, "notify::allocation", G_CALLBACK(xfixes_on_input_actor_changed), self);
+	g_signal_connect(actor, "notify::mapped", G_CALLBACK(xfixes_on_input_actor_changed), self);
+	g_signal_connect(actor, "notify::reactive", G_CALLBACK(xfixes_on_input_actor_changed), self);
 	g_signal_connect_swapped(actor, "destroy", G_CALLBACK(xfixes_remove_input_actor), self);
 
-	xfixes_calculate_input_region(self);
+	xfixes_on_input_actor_changed(actor, NULL, self);
 }
 
 static void xfixes_remove_input_actor(GrapheneWM *self, ClutterActor *actor)
@@ -515,7 +1008,7 @@ static void xfixes_remove_input_actor(GrapheneWM *self, ClutterActor *actor)
 		{
 			GList *temp = it;
 			it = it->next;
-			g_signal_handlers_disconnect_by_func(temp->data, xfixes_calculate_input_region, self);
+			g_signal_handlers_disconnect_by_func(temp->data, xfixes_on_input_actor_changed, self);
 			g_signal_handlers_disconnect_by_func(temp->data, xfixes_remove_input_actor, self);
 			self->xInputActors = g_list_delete_link(self->xInputActors, temp);
 			changed = TRUE;
@@ -524,8 +1017,12 @@ static void xfixes_remove_input_actor(GrapheneWM *self, ClutterActor *actor)
 			it = it->next;
 	}
 
-	if(changed)	
-		xfixes_calculate_input_region(self);
+	// The actor is going away, so it can't be relied on to queue a redraw
+	if(changed)
+	{
+		self->xInputDirty = TRUE;
+		clutter_actor_queue_redraw(self->stage);
+	}
 }
 
 static void graphene_wm_begin_modal(GrapheneWM *self)
@@ -669,6 +1166,62 @@ static void center_actor_on_primary(GrapheneWM *self, ClutterActor *actor)
 
 
 
+/*
+ * Animation governor
+ *
+ * Window effects are nice at 60fps and terrible at 5fps. Restoring a session
+ * can map dozens of windows at once, and software rendering on a VM can't
+ * keep up with even one. The governor watches how long recent frames took
+ * to draw (as recorded by frame-stats.c) and how many window animations are
+ * running, and shortens or skips effects when the compositor is falling
+ * behind. A skipped effect completes immediately, so the window just
+ * appears in its final state.
+ */
+
+#define GOVERNOR_HALF_ANIMATIONS 4 // Concurrent animations before halving duration
+#define GOVERNOR_MAX_ANIMATIONS 8 // Concurrent animations before skipping entirely
+
+/*
+ * Returns the duration to use for a window animation starting now, which
+ * may be 0 if it should be skipped.
+ */
+static guint animation_duration(GrapheneWM *self)
+{
+	// How long frames take to draw, not how often they're drawn; a
+	// rarely redrawn stage isn't a slow one
+	gdouble cost = graphene_frame_stats_get_average_cost();
+
+	if(self->activeAnimations >= GOVERNOR_MAX_ANIMATIONS
+	|| cost > 2 * GRAPHENE_FRAME_BUDGET)
+		return 0;
+	if(self->activeAnimations >= GOVERNOR_HALF_ANIMATIONS
+	|| cost > 1.5 * GRAPHENE_FRAME_BUDGET)
+		return WM_TRANSITION_TIME / 2;
+	return WM_TRANSITION_TIME;
+}
+
+static void animation_released(GrapheneWM *self)
+{
+	if(self->activeAnimations > 0)
+		self->activeAnimations --;
+}
+
+/*
+ * Counts an animation on the actor as running until animation_end is called
+ * on it or the actor is destroyed, whichever comes first. Starting a new
+ * animation on an actor replaces its old one.
+ */
+static void animation_begin(GrapheneWM *self, ClutterActor *actor)
+{
+	self->activeAnimations ++;
+	g_object_set_data_full(G_OBJECT(actor), "graphene-animation", self, (GDestroyNotify)animation_released);
+}
+
+static void animation_end(ClutterActor *actor)
+{
+	g_object_set_data(G_OBJECT(actor), "graphene-animation", NULL);
+}
+
 void graphene_wm_minimize(MetaPlugin *plugin, MetaWindowActor *windowActor)
 {
 	ClutterActor *actor = ACTOR(windowActor);
@@ -681,12 +1234,20 @@ void graphene_wm_minimize(MetaPlugin *plugin, MetaWindowActor *windowActor)
 	MetaRectangle rect = meta_rect(0,0,0,0);
 	meta_window_get_icon_geometry(window, &rect); // This is set by the Launcher applet
 	
-	// Ease the window into its minimized position
 	clutter_actor_remove_all_transitions(actor);
+	guint duration = animation_duration(GRAPHENE_WM(plugin));
+	if(duration == 0)
+	{
+		minimize_done(actor, plugin);
+		return;
+	}
+
+	// Ease the window into its minimized position
+	animation_begin(GRAPHENE_WM(plugin), actor);
 	clutter_actor_set_pivot_point(actor, 0, 0);
 	clutter_actor_save_easing_state(actor);
 	clutter_actor_set_easing_mode(actor, CLUTTER_EASE_IN_SINE);
-	clutter_actor_set_easing_duration(actor, WM_TRANSITION_TIME);
+	clutter_actor_set_easing_duration(actor, duration);
 	g_signal_connect(actor, "transitions_completed", G_CALLBACK(minimize_done), plugin);
 	clutter_actor_set_x(actor, rect.x);
 	clutter_actor_set_y(actor, rect.y);
@@ -702,6 +1263,7 @@ static void minimize_done(ClutterActor *actor, MetaPlugin *plugin)
 {
 	// End transition
 	g_signal_handlers_disconnect_by_func(actor, minimize_done, plugin);
+	animation_end(actor);
 	clutter_actor_set_scale(actor, 1, 1);
 	clutter_actor_hide(actor); // Actually hide the window
 	
@@ -717,6 +1279,16 @@ void graphene_wm_unminimize(MetaPlugin *plugin, MetaWindowActor *windowActor)
 		minimize_done(actor, plugin);
 	g_object_set_data(G_OBJECT(actor), "unminimizing", (gpointer)TRUE);
 
+	clutter_actor_remove_all_transitions(actor);
+	guint duration = animation_duration(GRAPHENE_WM(plugin));
+	if(duration == 0)
+	{
+		clutter_actor_set_scale(actor, 1, 1);
+		clutter_actor_show(actor);
+		unminimize_done(actor, plugin);
+		return;
+	}
+
 	// Get the unminimized position
 	gint x = clutter_actor_get_x(actor);
 	gint y = clutter_actor_get_y(actor);
@@ -731,11 +1303,11 @@ void graphene_wm_unminimize(MetaPlugin *plugin, MetaWindowActor *windowActor)
 	clutter_actor_show(actor);
 	
 	// Ease it into its unminimized position
-	clutter_actor_remove_all_transitions(actor);
+	animation_begin(GRAPHENE_WM(plugin), actor);
 	clutter_actor_set_pivot_point(actor, 0, 0);
 	clutter_actor_save_easing_state(actor);
 	clutter_actor_set_easing_mode(actor, CLUTTER_EASE_OUT_SINE);
-	clutter_actor_set_easing_duration(actor, WM_TRANSITION_TIME);
+	clutter_actor_set_easing_duration(actor, duration);
 	g_signal_connect(actor, "transitions_completed", G_CALLBACK(unminimize_done), plugin);
 	clutter_actor_set_x(actor, x);
 	clutter_actor_set_y(actor, y);
@@ -750,6 +1322,7 @@ void graphene_wm_unminimize(MetaPlugin *plugin, MetaWindowActor *windowActor)
 static void unminimize_done(ClutterActor *actor, MetaPlugin *plugin)
 {
 	g_signal_handlers_disconnect_by_func(actor, unminimize_done, plugin);
+	animation_end(actor);
 	meta_plugin_unminimize_completed(plugin, META_WINDOW_ACTOR(actor));
 	g_object_set_data(G_OBJECT(actor), "unminimizing", (gpointer)FALSE);
 }
@@ -760,6 +1333,7 @@ void graphene_wm_destroy(MetaPlugin *plugin, MetaWindowActor *windowActor)
 
 	clutter_actor_remove_all_transitions(actor);
 	MetaWindow *window = meta_window_actor_get_meta_window(windowActor);
+	guint duration = animation_duration(GRAPHENE_WM(plugin));
 
 	switch(meta_window_get_window_type(window))
 	{
@@ -767,10 +1341,16 @@ void graphene_wm_destroy(MetaPlugin *plugin, MetaWindowActor *windowActor)
 	case META_WINDOW_NOTIFICATION:
 	case META_WINDOW_DIALOG:
 	case META_WINDOW_MODAL_DIALOG:
+		if(duration == 0)
+		{
+			meta_plugin_destroy_completed(plugin, META_WINDOW_ACTOR(actor));
+			break;
+		}
+		animation_begin(GRAPHENE_WM(plugin), actor);
 		clutter_actor_set_pivot_point(actor, 0.5, 0.5);
 		clutter_actor_save_easing_state(actor);
 		clutter_actor_set_easing_mode(actor, CLUTTER_EASE_IN_SINE);
-		clutter_actor_set_easing_duration(actor, WM_TRANSITION_TIME);
+		clutter_actor_set_easing_duration(actor, duration);
 		g_signal_connect(actor, "transitions_completed", G_CALLBACK(destroy_done), plugin);
 		clutter_actor_set_scale(actor, 0, 0);
 		clutter_actor_restore_easing_state(actor);
@@ -788,6 +1368,7 @@ void graphene_wm_destroy(MetaPlugin *plugin, MetaWindowActor *windowActor)
 static void destroy_done(ClutterActor *actor, MetaPlugin *plugin)
 {
 	g_signal_handlers_disconnect_by_func(actor, destroy_done, plugin);
+	animation_end(actor);
 	meta_plugin_destroy_completed(plugin, META_WINDOW_ACTOR(actor));
 }
 
@@ -797,6 +1378,7 @@ void graphene_wm_map(MetaPlugin *plugin, MetaWindowActor *windowActor)
 
 	clutter_actor_remove_all_transitions(actor);
 	MetaWindow *window = meta_window_actor_get_meta_window(windowActor);
+	guint duration = animation_duration(GRAPHENE_WM(plugin));
 
 	switch(meta_window_get_window_type(window))
 	{
@@ -804,12 +1386,20 @@ void graphene_wm_map(MetaPlugin *plugin, MetaWindowActor *windowActor)
 	case META_WINDOW_NOTIFICATION:
 	case META_WINDOW_DIALOG:
 	case META_WINDOW_MODAL_DIALOG:
+		if(duration == 0)
+		{
+			clutter_actor_set_scale(actor, 1, 1);
+			clutter_actor_show(actor);
+			meta_plugin_map_completed(plugin, META_WINDOW_ACTOR(actor));
+			break;
+		}
+		animation_begin(GRAPHENE_WM(plugin), actor);
 		clutter_actor_set_pivot_point(actor, 0.5, 0.5);
 		clutter_actor_set_scale(actor, 0, 0);
 		clutter_actor_show(actor);
 		clutter_actor_save_easing_state(actor);
 		clutter_actor_set_easing_mode(actor, CLUTTER_EASE_OUT_SINE);
-		clutter_actor_set_easing_duration(actor, WM_TRANSITION_TIME);
+		clutter_actor_set_easing_duration(actor, duration);
 		g_signal_connect(actor, "transitions_completed", G_CALLBACK(map_done), plugin);
 		clutter_actor_set_scale(actor, 1, 1);
 		clutter_actor_restore_easing_state(actor);
@@ -832,6 +1422,7 @@ void graphene_wm_map(MetaPlugin *plugin, MetaWindowActor *windowActor)
 static void map_done(ClutterActor *actor, MetaPlugin *plugin)
 {
 	g_signal_handlers_disconnect_by_func(actor, map_done, plugin);
+	animation_end(actor);
 	meta_plugin_map_completed(plugin, META_WINDOW_ACTOR(actor));
 }
 
@@ -916,18 +1507,89 @@ static void on_key_backlight_down(UNUSED MetaDisplay *display, UNUSED MetaScreen
 	graphene_percent_floater_set_percent(self->percentBar, val);
 }
 
-static void on_key_kb_backlight_up(UNUSED MetaDisplay *display, UNUSED MetaScreen *screen, UNUSED MetaWindow *window, UNUSED ClutterKeyEvent *event, UNUSED MetaKeyBinding *binding, UNUSED GrapheneWM *self)
+static void on_key_kb_backlight_up(UNUSED MetaDisplay *display, UNUSED MetaScreen *screen, UNUSED MetaWindow *window, UNUSED ClutterKeyEvent *event, UNUSED MetaKeyBinding *binding, GrapheneWM *self)
+{
+	gfloat val = csk_keyboard_backlight_set_brightness(1.0/WM_PERCENT_BAR_STEPS, TRUE);
+	if(val >= 0)
+		graphene_percent_floater_set_percent(self->percentBar, val);
+}
+
+static void on_key_kb_backlight_down(UNUSED MetaDisplay *display, UNUSED MetaScreen *screen, UNUSED MetaWindow *window, UNUSED ClutterKeyEvent *event, UNUSED MetaKeyBinding *binding, GrapheneWM *self)
+{
+	gfloat val = csk_keyboard_backlight_set_brightness(-1.0/WM_PERCENT_BAR_STEPS, TRUE);
+	if(val >= 0)
+		graphene_percent_floater_set_percent(self->percentBar, val);
+}
+
+static void on_key_frame_stats_overlay(UNUSED MetaDisplay *display, UNUSED MetaScreen *screen, UNUSED MetaWindow *window, UNUSED ClutterKeyEvent *event, UNUSED MetaKeyBinding *binding, UNUSED GrapheneWM *self)
 {
-	// TODO
+	graphene_frame_stats_toggle_overlay();
 }
 
-// TODO: TEMP
-extern gboolean graphene_session_exit(gboolean failed);
+static void on_switcher_done(GrapheneSwitcher *switcher, MetaWindow *window, GrapheneWM *self)
+{
+	self->switcher = NULL;
+	graphene_wm_end_modal(self);
+
+	if(window)
+		meta_window_activate(window, meta_display_get_current_time(meta_window_get_display(window)));
+
+	// Can't destroy it right away, since this is called from its own
+	// event handlers
+	ClutterActor *actor = ACTOR(switcher);
+	clutter_actor_set_reactive(actor, FALSE);
+	g_signal_connect(actor, "transitions_completed", G_CALLBACK(clutter_actor_destroy), NULL);
+	clutter_actor_save_easing_state(actor);
+	clutter_actor_set_easing_mode(actor, CLUTTER_EASE_IN_SINE);
+	clutter_actor_set_easing_duration(actor, WM_TRANSITION_TIME/2);
+	clutter_actor_set_opacity(actor, 0);
+	clutter_actor_restore_easing_state(actor);
+	TRANSITION_MEMLEAK_FIX(actor, "opacity");
+}
 
-static void on_key_kb_backlight_down(UNUSED MetaDisplay *display, UNUSED MetaScreen *screen, UNUSED MetaWindow *window, UNUSED ClutterKeyEvent *event, UNUSED MetaKeyBinding *binding, UNUSED GrapheneWM *self)
+static void on_switcher_size_changed(ClutterActor *switcher, UNUSED GParamSpec *param, GrapheneWM *self)
 {
-	graphene_session_exit(TRUE);
-	// TODO
+	center_actor_on_primary(self, switcher);
+}
+
+static void on_key_switch_windows(MetaDisplay *display, MetaScreen *screen, UNUSED MetaWindow *window, ClutterKeyEvent *event, MetaKeyBinding *binding, GrapheneWM *self)
+{
+	// Don't switch out from under a dialog
+	if(self->switcher || self->modalCount > 0)
+		return;
+
+	GList *windows = meta_display_get_tab_list(display, META_TAB_LIST_NORMAL, meta_screen_get_active_workspace(screen));
+	if(!windows)
+		return;
+
+	gboolean backward = meta_key_binding_is_reversed(binding);
+	ClutterModifierType mask = meta_key_binding_get_mask(binding);
+	ClutterModifierType mods = 0;
+	meta_cursor_tracker_get_pointer(meta_cursor_tracker_get_for_screen(screen), NULL, NULL, &mods);
+
+	// If the modifiers were already released (a quick Alt+Tab), or there's
+	// only one window, just switch without showing anything
+	if(!windows->next || !(mods & mask))
+	{
+		GList *target = backward ? g_list_last(windows) : (windows->next ? windows->next : windows);
+		meta_window_activate(META_WINDOW(target->data), event->time);
+		g_list_free(windows);
+		return;
+	}
+
+	GrapheneSwitcher *switcher = graphene_switcher_new(windows, mask, backward, (GrapheneSwitcherCb)on_switcher_done, self);
+	g_list_free(windows);
+
+	self->switcher = ACTOR(switcher);
+	cmk_widget_set_style_parent(CMK_WIDGET(switcher), style);
+	clutter_actor_add_effect(self->switcher, cmk_shadow_effect_new_drop_shadow(20, 0, 0, 1, 0));
+	clutter_actor_insert_child_above(self->stage, self->switcher, NULL);
+	g_signal_connect(self->switcher, "notify::size", G_CALLBACK(on_switcher_size_changed), self);
+	center_actor_on_primary(self, self->switcher);
+	clutter_actor_show(self->switcher);
+
+	graphene_wm_begin_modal(self);
+	graphene_switcher_start(switcher);
 }
 
 static void on_panel_main_menu(UNUSED MetaDisplay *display, UNUSED MetaScreen *screen, UNUSED MetaWindow *window, UNUSED ClutterKeyEvent *event, UNUSED MetaKeyBinding *binding, GrapheneWM *self)
@@ -955,12 +1617,16 @@ static void init_keybindings(GrapheneWM *self)
 	bind("backlight-down", on_key_backlight_down);
 	bind("kb-backlight-up", on_key_kb_backlight_up);
 	bind("kb-backlight-down", on_key_kb_backlight_down);
+	bind("frame-stats-overlay", on_key_frame_stats_overlay);
 	#undef bind
 
 	g_object_unref(keybindings);
 
 	meta_keybindings_set_custom_handler("panel-main-menu", (MetaKeyHandlerFunc)on_panel_main_menu, self, NULL);
 	meta_keybindings_set_custom_handler("panel-run-dialog", (MetaKeyHandlerFunc)on_panel_main_menu, self, NULL);
-	// meta_keybindings_set_custom_handler("switch-windows", switch_windows);
-	// meta_keybindings_set_custom_handler("switch-applications", switch_windows);
+	// No grouping by application yet, so both switch between windows
+	meta_keybindings_set_custom_handler("switch-windows", (MetaKeyHandlerFunc)on_key_switch_windows, self, NULL);
+	meta_keybindings_set_custom_handler("switch-windows-backward", (MetaKeyHandlerFunc)on_key_switch_windows, self, NULL);
+	meta_keybindings_set_custom_handler("switch-applications", (MetaKeyHandlerFunc)on_key_switch_windows, self, NULL);
+	meta_keybindings_set_custom_handler("switch-applications-backward", (MetaKeyHandlerFunc)on_key_switch_windows, self, NULL);
 }
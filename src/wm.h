@@ -43,21 +43,50 @@ struct _GrapheneWM {
 	GraphenePercentFloater *percentBar;
 	CskAudioDeviceManager *audioManager;
 	ClutterActor *coverGroup;
+	GArray *monitors; // MetaRectangle of each monitor, as of the last monitors-changed
+	GPtrArray *backgrounds; // GrapheneWMBackground * per monitor, children of backgroundGroup
+	GPtrArray *covers; // ClutterActor * per monitor, children of coverGroup
 	ClutterActor *dialog;
+	ClutterActor *switcher; // GrapheneSwitcher, while open
 	GraphenePanel *panel;
 	GrapheneNotificationBox *notificationBox;
 	gint modalCount;
+
+	// Window model. Property changes are batched and sent to delegates
+	// once per frame; see graphene_window_queue_update (wm.c)
+	GPtrArray *windows; // GrapheneWindow *, owned
+	guint windowFlushId;
+
+	// Animation governor; see animation_duration (wm.c)
+	guint activeAnimations;
+
+	// Unredirection policy; see update_unredirect (wm.c)
+	gboolean unredirectDirty;
+	gboolean unredirectDenied; // Top window is fullscreen but policy says composite it
+	gboolean unredirectCandidate; // Top window is fullscreen and may be unredirected
+	MetaRectangle unredirectMonitor; // Monitor of the candidate
+	gboolean unredirectDisabled; // TRUE while we hold meta_disable_unredirect_for_screen
 	
 	// For fixing an input issue with the X backend
 	// See xfixes_calculate_input_region (wm.c) for more details
 	GList *xInputActors; // List of ClutterActors
 	XserverRegion xInputRegion;
+	GArray *xInputRects; // XRectangles last sent to the server
+	gboolean xInputEmpty; // TRUE if the input region was last set empty
+	gboolean xInputDirty;
+	guint xInputRepaintId;
 };
 
 void graphene_wm_show_dialog(GrapheneWM *wm, ClutterActor *actor);
 
 const MetaPluginInfo * graphene_wm_plugin_info(MetaPlugin *plugin);
 void graphene_wm_start(MetaPlugin *plugin);
+
+/*
+ * Frees what graphene_wm_start set up that outlives Mutter's windows. Call
+ * after meta_run returns.
+ */
+void graphene_wm_stop(GrapheneWM *wm);
 void graphene_wm_minimize(MetaPlugin *plugin, MetaWindowActor *windowActor);
 void graphene_wm_unminimize(MetaPlugin *plugin, MetaWindowActor *windowActor);
 void graphene_wm_destroy(MetaPlugin *plugin, MetaWindowActor *windowActor);
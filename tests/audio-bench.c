@@ -0,0 +1,507 @@
+/*
+ * This file is part of graphene-desktop, the desktop environment of VeltOS.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Benchmark of the audio device manager against a private PulseAudio daemon.
+ * Creates N null sinks and N null sources, changes their volumes at a high
+ * rate both from another client and through the manager, then removes them
+ * again. After each phase the manager's devices must converge on what the
+ * server reports. Prints how long each phase took to converge and the
+ * latency from loading a module to its device-added signal, followed by the
+ * manager's own event statistics.
+ *
+ * Run with --threaded to use the manager's threaded PulseAudio mainloop.
+ * Exits with 77 (skipped) if pulseaudio isn't available.
+ */
+
+#include "csk/audio.h"
+#include "util.h"
+#include "test-util.h"
+#include <pulse/pulseaudio.h>
+#include <pulse/glib-mainloop.h>
+#include <glib/gstdio.h>
+#include <signal.h>
+#include <stdio.h>
+
+#define EXIT_SKIP 77
+#define SINK_PREFIX "bench_sink"
+#define SOURCE_PREFIX "bench_source"
+#define STARTUP_TIMEOUT (10 * G_USEC_PER_SEC)
+#define CONVERGE_TIMEOUT (30 * G_USEC_PER_SEC)
+#define VOLUME_EPSILON 0.01
+
+static gint numDevices = 20;
+static gint numRounds = 50;
+static gboolean threaded = FALSE;
+
+static guint failures = 0;
+
+// The bench's own connection, acting as another PulseAudio client
+static pa_glib_mainloop *mainloop = NULL;
+static pa_context *context = NULL;
+static guint opsPending = 0;
+
+static GArray *modules = NULL; // guint32 module indices
+static GHashTable *loadTimes = NULL; // device name -> gint64 microseconds
+static GArray *addLatencies = NULL; // gint64 microseconds
+static GHashTable *serverVolumes = NULL; // device name -> float, from the last query
+static GHashTable *expectedVolumes = NULL; // device name -> float
+
+static gboolean ops_done(UNUSED gpointer userdata)
+{
+	return opsPending == 0;
+}
+
+static gboolean context_ready(UNUSED gpointer userdata)
+{
+	pa_context_state_t state = pa_context_get_state(context);
+	return state == PA_CONTEXT_READY || !PA_CONTEXT_IS_GOOD(state);
+}
+
+static gboolean manager_ready(gpointer manager)
+{
+	return csk_audio_device_manager_is_ready(manager);
+}
+
+static gboolean is_bench_device(CskAudioDevice *device)
+{
+	CskAudioDeviceType type = csk_audio_device_get_type_(device);
+	const char *name = csk_audio_device_get_name(device);
+	// Sink monitors are inputs too, but described as "Monitor of ..."
+	return (type == CSK_AUDIO_DEVICE_TYPE_OUTPUT && g_str_has_prefix(name, SINK_PREFIX))
+		|| (type == CSK_AUDIO_DEVICE_TYPE_INPUT && g_str_has_prefix(name, SOURCE_PREFIX));
+}
+
+static guint count_bench_devices(CskAudioDeviceManager *manager)
+{
+	guint count = 0;
+	for(GList *l = csk_audio_device_manager_get_devices(manager); l; l = l->next)
+		if(is_bench_device(l->data))
+			count++;
+	return count;
+}
+
+static gboolean all_devices_added(gpointer manager)
+{
+	return count_bench_devices(manager) == (guint)numDevices * 2;
+}
+
+static gboolean all_devices_removed(gpointer manager)
+{
+	return count_bench_devices(manager) == 0;
+}
+
+static void on_device_added(UNUSED CskAudioDeviceManager *manager, CskAudioDevice *device, UNUSED gpointer userdata)
+{
+	if(!is_bench_device(device))
+		return;
+	gint64 *loaded = g_hash_table_lookup(loadTimes, csk_audio_device_get_name(device));
+	if(!loaded)
+		return;
+	gint64 latency = g_get_monotonic_time() - *loaded;
+	g_array_append_val(addLatencies, latency);
+}
+
+static void on_module_loaded(UNUSED pa_context *c, uint32_t index, UNUSED gpointer userdata)
+{
+	opsPending--;
+	if(index == PA_INVALID_INDEX)
+	{
+		g_printerr("Failed to load a module: %s\n", pa_strerror(pa_context_errno(context)));
+		failures++;
+		return;
+	}
+	g_array_append_val(modules, index);
+}
+
+static void on_op_success(UNUSED pa_context *c, int success, UNUSED gpointer userdata)
+{
+	opsPending--;
+	if(!success)
+	{
+		g_printerr("Operation failed: %s\n", pa_strerror(pa_context_errno(context)));
+		failures++;
+	}
+}
+
+static void track_op(pa_operation *op)
+{
+	if(!op)
+	{
+		g_printerr("Failed to start operation: %s\n", pa_strerror(pa_context_errno(context)));
+		failures++;
+		return;
+	}
+	opsPending++;
+	pa_operation_unref(op);
+}
+
+static void load_device(const gchar *module, const gchar *prefix, gint i)
+{
+	gchar *name = g_strdup_printf("%s%i", prefix, i);
+	// The description is what the manager reports as the name
+	gboolean sink = (g_strcmp0(module, "module-null-sink") == 0);
+	gchar *args = sink
+		? g_strdup_printf("sink_name=%s sink_properties=device.description=%s", name, name)
+		: g_strdup_printf("source_name=%s description=%s", name, name);
+
+	gint64 *now = g_new(gint64, 1);
+	*now = g_get_monotonic_time();
+	g_hash_table_insert(loadTimes, name, now);
+	track_op(pa_context_load_module(context, module, args, on_module_loaded, NULL));
+	g_free(args);
+}
+
+static float random_volume(void)
+{
+	// Keep clear of 0, where rounding to pa_volume_t matters most
+	return g_random_double_range(0.1, 1.0);
+}
+
+static pa_cvolume * make_cvolume(pa_cvolume *cvolume, float volume)
+{
+	// Null sinks and sources default to stereo
+	return pa_cvolume_set(cvolume, 2, (pa_volume_t)(volume * (PA_VOLUME_NORM - PA_VOLUME_MUTED) + PA_VOLUME_MUTED));
+}
+
+static void expect_volume(const char *name, float volume)
+{
+	float *v = g_new(float, 1);
+	*v = volume;
+	g_hash_table_insert(expectedVolumes, g_strdup(name), v);
+}
+
+static void on_sink_info(UNUSED pa_context *c, const pa_sink_info *info, int eol, UNUSED gpointer userdata)
+{
+	if(eol)
+	{
+		opsPending--;
+		return;
+	}
+	float *v = g_new(float, 1);
+	*v = ((float)(pa_cvolume_max(&info->volume) - PA_VOLUME_MUTED)) / (PA_VOLUME_NORM - PA_VOLUME_MUTED);
+	g_hash_table_insert(serverVolumes, g_strdup(info->description), v);
+}
+
+static void on_source_info(UNUSED pa_context *c, const pa_source_info *info, int eol, UNUSED gpointer userdata)
+{
+	if(eol)
+	{
+		opsPending--;
+		return;
+	}
+	float *v = g_new(float, 1);
+	*v = ((float)(pa_cvolume_max(&info->volume) - PA_VOLUME_MUTED)) / (PA_VOLUME_NORM - PA_VOLUME_MUTED);
+	g_hash_table_insert(serverVolumes, g_strdup(info->description), v);
+}
+
+static void query_server_volumes(void)
+{
+	g_hash_table_remove_all(serverVolumes);
+	pa_operation *op = pa_context_get_sink_info_list(context, on_sink_info, NULL);
+	if(op)
+	{
+		opsPending++;
+		pa_operation_unref(op);
+	}
+	op = pa_context_get_source_info_list(context, on_source_info, NULL);
+	if(op)
+	{
+		opsPending++;
+		pa_operation_unref(op);
+	}
+	wait_for(ops_done, NULL, CONVERGE_TIMEOUT);
+}
+
+/*
+ * Converged once both the server and the manager report the expected
+ * volume for every bench device.
+ */
+static gboolean volumes_converged(gpointer manager)
+{
+	query_server_volumes();
+
+	guint matched = 0;
+	for(GList *l = csk_audio_device_manager_get_devices(manager); l; l = l->next)
+	{
+		if(!is_bench_device(l->data))
+			continue;
+		const char *name = csk_audio_device_get_name(l->data);
+		float *expected = g_hash_table_lookup(expectedVolumes, name);
+		float *server = g_hash_table_lookup(serverVolumes, name);
+		if(!expected || !server)
+			return FALSE;
+		if(ABS(*server - *expected) > VOLUME_EPSILON)
+			return FALSE;
+		if(ABS(csk_audio_device_get_volume(l->data) - *expected) > VOLUME_EPSILON)
+			return FALSE;
+		matched++;
+	}
+	return matched == g_hash_table_size(expectedVolumes);
+}
+
+static void print_latencies(const gchar *name, GArray *samples)
+{
+	guint n = samples->len;
+	gchar *percentiles = latency_percentiles(samples);
+	if(!percentiles)
+		return;
+	printf("%-24s %8u samples  %s\n", name, n, percentiles);
+	g_free(percentiles);
+}
+
+static gint64 phase_start(void)
+{
+	return g_get_monotonic_time();
+}
+
+static void phase_end(const gchar *name, gint64 start, gboolean converged, guint operations)
+{
+	gdouble elapsed = (g_get_monotonic_time() - start) / 1000.0;
+	if(!converged)
+	{
+		g_printerr("%s: manager did not converge\n", name);
+		failures++;
+	}
+	printf("%-24s %8u ops  %9.1fms%s\n", name, operations, elapsed, converged ? "" : "  (timed out)");
+}
+
+/*
+ * Creates every bench sink and source, and waits for the manager to add
+ * all of them.
+ */
+static void phase_create(CskAudioDeviceManager *manager)
+{
+	gint64 start = phase_start();
+	for(gint i = 0; i < numDevices; ++i)
+	{
+		load_device("module-null-sink", SINK_PREFIX, i);
+		load_device("module-null-source", SOURCE_PREFIX, i);
+	}
+	wait_for(ops_done, NULL, CONVERGE_TIMEOUT);
+	phase_end("create", start, wait_for(all_devices_added, manager, CONVERGE_TIMEOUT), numDevices * 2);
+}
+
+/*
+ * Another client changes every volume numRounds times without waiting,
+ * so the manager gets a burst of change events for each device.
+ */
+static void phase_external_volume(CskAudioDeviceManager *manager)
+{
+	gint64 start = phase_start();
+	for(gint r = 0; r < numRounds; ++r)
+	{
+		for(gint i = 0; i < numDevices; ++i)
+		{
+			pa_cvolume cvolume;
+			gchar *name = g_strdup_printf(SINK_PREFIX "%i", i);
+			float volume = random_volume();
+			expect_volume(name, volume);
+			track_op(pa_context_set_sink_volume_by_name(context, name, make_cvolume(&cvolume, volume), on_op_success, NULL));
+			g_free(name);
+
+			name = g_strdup_printf(SOURCE_PREFIX "%i", i);
+			volume = random_volume();
+			expect_volume(name, volume);
+			track_op(pa_context_set_source_volume_by_name(context, name, make_cvolume(&cvolume, volume), on_op_success, NULL));
+			g_free(name);
+		}
+		// Let events through between rounds, like a slider being dragged
+		g_main_context_iteration(NULL, FALSE);
+	}
+	wait_for(ops_done, NULL, CONVERGE_TIMEOUT);
+	phase_end("external volume", start, wait_for(volumes_converged, manager, CONVERGE_TIMEOUT), numRounds * numDevices * 2);
+}
+
+/*
+ * Volumes are set through the manager numRounds times per device, like
+ * volume keys being held. Most of these should be coalesced.
+ */
+static void phase_manager_volume(CskAudioDeviceManager *manager)
+{
+	gint64 start = phase_start();
+	guint operations = 0;
+	for(gint r = 0; r < numRounds; ++r)
+	{
+		// The list can change while iterating the main loop, so it's
+		// fetched again each round
+		for(GList *l = csk_audio_device_manager_get_devices(manager); l; l = l->next)
+		{
+			if(!is_bench_device(l->data))
+				continue;
+			float volume = random_volume();
+			expect_volume(csk_audio_device_get_name(l->data), volume);
+			csk_audio_device_set_volume(l->data, volume);
+			operations++;
+		}
+		g_main_context_iteration(NULL, FALSE);
+	}
+	phase_end("manager volume", start, wait_for(volumes_converged, manager, CONVERGE_TIMEOUT), operations);
+}
+
+/*
+ * Unloads every module, and waits for the manager to remove all devices.
+ */
+static void phase_remove(CskAudioDeviceManager *manager)
+{
+	gint64 start = phase_start();
+	for(guint i = 0; i < modules->len; ++i)
+		track_op(pa_context_unload_module(context, g_array_index(modules, guint32, i), on_op_success, NULL));
+	wait_for(ops_done, NULL, CONVERGE_TIMEOUT);
+	phase_end("remove", start, wait_for(all_devices_removed, manager, CONVERGE_TIMEOUT), modules->len);
+	g_array_set_size(modules, 0);
+}
+
+static GPid start_pulseaudio(const gchar *runtimeDir, gchar **server)
+{
+	gchar *socketPath = g_build_filename(runtimeDir, "native", NULL);
+	gchar *protocol = g_strdup_printf("module-native-protocol-unix auth-anonymous=1 socket=%s", socketPath);
+	const gchar *argv[] = {"pulseaudio", "--daemonize=no", "-n", "--exit-idle-time=-1",
+		"--use-pid-file=no", "--log-target=stderr", "--log-level=error",
+		"--load", protocol, NULL};
+
+	GPid pid = 0;
+	GError *error = NULL;
+	if(!g_spawn_async(NULL, (gchar **)argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, &pid, &error))
+	{
+		g_printerr("Cannot start pulseaudio: %s\n", error->message);
+		g_clear_error(&error);
+		pid = 0;
+	}
+	else
+	{
+		*server = g_strdup_printf("unix:%s", socketPath);
+	}
+	g_free(protocol);
+	g_free(socketPath);
+	return pid;
+}
+
+// Debug builds of the manager log through g_message
+static void discard_log(UNUSED const gchar *domain, UNUSED GLogLevelFlags level, UNUSED const gchar *message, UNUSED gpointer userdata)
+{
+}
+
+int main(int argc, char **argv)
+{
+	GOptionEntry entries[] = {
+		{"devices", 'n', 0, G_OPTION_ARG_INT, &numDevices, "Number of null sinks, and of null sources (default: 20)", "N"},
+		{"rounds", 'r', 0, G_OPTION_ARG_INT, &numRounds, "Volume changes per device and phase (default: 50)", "N"},
+		{"threaded", 't', 0, G_OPTION_ARG_NONE, &threaded, "Use the threaded PulseAudio mainloop", NULL},
+		{NULL}
+	};
+	GError *error = NULL;
+	GOptionContext *options = g_option_context_new("- audio device manager benchmark");
+	g_option_context_add_main_entries(options, entries, NULL);
+	if(!g_option_context_parse(options, &argc, &argv, &error))
+	{
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+	g_option_context_free(options);
+
+	gchar *daemon = g_find_program_in_path("pulseaudio");
+	if(!daemon)
+	{
+		g_printerr("pulseaudio not found, skipping\n");
+		return EXIT_SKIP;
+	}
+	g_free(daemon);
+
+	// Keep the daemon away from the user's configuration and sockets
+	gchar *runtimeDir = g_dir_make_tmp("audio-bench-XXXXXX", &error);
+	if(!runtimeDir)
+	{
+		g_printerr("Cannot create a runtime directory: %s\n", error->message);
+		return 1;
+	}
+	g_setenv("HOME", runtimeDir, TRUE);
+	g_setenv("XDG_RUNTIME_DIR", runtimeDir, TRUE);
+	g_setenv("XDG_CONFIG_HOME", runtimeDir, TRUE);
+	g_setenv("PULSE_RUNTIME_PATH", runtimeDir, TRUE);
+	g_setenv("PULSE_STATE_PATH", runtimeDir, TRUE);
+
+	gchar *server = NULL;
+	GPid pid = start_pulseaudio(runtimeDir, &server);
+	if(!pid)
+	{
+		g_rmdir(runtimeDir);
+		return EXIT_SKIP;
+	}
+	g_setenv("PULSE_SERVER", server, TRUE);
+	if(threaded)
+		g_setenv("CSK_AUDIO_THREADED", "1", TRUE);
+
+	modules = g_array_new(FALSE, FALSE, sizeof(guint32));
+	loadTimes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	addLatencies = g_array_new(FALSE, FALSE, sizeof(gint64));
+	serverVolumes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	expectedVolumes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	// The daemon takes a moment to create its socket, so retry connecting
+	// until it's up
+	mainloop = pa_glib_mainloop_new(g_main_context_default());
+	gint64 end = g_get_monotonic_time() + STARTUP_TIMEOUT;
+	while(TRUE)
+	{
+		context = pa_context_new(pa_glib_mainloop_get_api(mainloop), "audio-bench");
+		pa_context_connect(context, server, PA_CONTEXT_NOAUTOSPAWN, NULL);
+		wait_for(context_ready, NULL, STARTUP_TIMEOUT);
+		if(pa_context_get_state(context) == PA_CONTEXT_READY || g_get_monotonic_time() >= end)
+			break;
+		pa_context_unref(context);
+		g_usleep(100000);
+	}
+
+	gint ret = 0;
+	if(pa_context_get_state(context) != PA_CONTEXT_READY)
+	{
+		// Usually a sandbox without audio support rather than a bug here
+		g_printerr("Cannot connect to pulseaudio, skipping\n");
+		ret = EXIT_SKIP;
+	}
+	else
+	{
+		guint logHandler = g_log_set_handler(NULL, G_LOG_LEVEL_MESSAGE | G_LOG_LEVEL_INFO | G_LOG_LEVEL_DEBUG, discard_log, NULL);
+		CskAudioDeviceManager *manager = csk_audio_device_manager_get_default();
+		g_signal_connect(manager, "device-added", G_CALLBACK(on_device_added), NULL);
+		if(!wait_for(manager_ready, manager, STARTUP_TIMEOUT))
+		{
+			g_printerr("Audio device manager did not become ready\n");
+			failures++;
+		}
+		else
+		{
+			printf("%i sinks and %i sources, %i rounds, %s mainloop\n",
+				numDevices, numDevices, numRounds, threaded ? "threaded" : "GLib");
+			phase_create(manager);
+			phase_external_volume(manager);
+			phase_manager_volume(manager);
+			phase_remove(manager);
+			print_latencies("load to device-added", addLatencies);
+
+			// The manager's own statistics, in debug builds
+			g_log_remove_handler(NULL, logHandler);
+			csk_audio_device_manager_log_stats(manager);
+		}
+		g_object_unref(manager);
+		ret = failures ? 1 : 0;
+	}
+
+	pa_context_disconnect(context);
+	pa_context_unref(context);
+	pa_glib_mainloop_free(mainloop);
+	kill(pid, SIGTERM);
+	g_spawn_close_pid(pid);
+
+	g_array_unref(modules);
+	g_hash_table_unref(loadTimes);
+	g_array_unref(addLatencies);
+	g_hash_table_unref(serverVolumes);
+	g_hash_table_unref(expectedVolumes);
+	g_free(server);
+	g_rmdir(runtimeDir); // Only succeeds if pulseaudio cleaned up after itself
+	g_free(runtimeDir);
+	return ret;
+}
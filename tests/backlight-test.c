@@ -0,0 +1,225 @@
+/*
+ * This file is part of graphene-desktop, the desktop environment of VeltOS.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Tests the keyboard backlight against a fake UPower KbdBacklight service on
+ * a private bus (GTestDBus), which is used as the system bus. Checks that
+ * the brightness is cached from BrightnessChanged, that quick changes are
+ * coalesced into few SetBrightness calls, and that a failed write gets the
+ * real brightness again.
+ *
+ * Exits with 77 (skipped) if dbus-daemon isn't available.
+ */
+
+#include <gio/gio.h>
+#include <math.h>
+#include "csk/backlight.h"
+#include "test-util.h"
+
+#define UPOWER_DBUS_NAME "org.freedesktop.UPower"
+#define KBD_DBUS_PATH "/org/freedesktop/UPower/KbdBacklight"
+#define KBD_DBUS_IFACE "org.freedesktop.UPower.KbdBacklight"
+#define EXIT_SKIP 77
+
+#define FAKE_MAX 10
+#define SET_DELAY 100 // ms, how long the fake takes to apply a write
+#define WAIT_TIMEOUT (5 * G_USEC_PER_SEC)
+
+static const gchar *kbdXml =
+	"<node>"
+	"  <interface name='" KBD_DBUS_IFACE "'>"
+	"    <method name='GetMaxBrightness'><arg type='i' direction='out'/></method>"
+	"    <method name='GetBrightness'><arg type='i' direction='out'/></method>"
+	"    <method name='SetBrightness'><arg type='i' direction='in'/></method>"
+	"    <signal name='BrightnessChanged'><arg type='i'/></signal>"
+	"  </interface>"
+	"</node>";
+
+static GDBusConnection *serviceBus = NULL;
+static gboolean nameAcquired = FALSE;
+
+// Fake service state
+static gint fakeValue = 3;
+static guint getCalls = 0;
+static guint setCalls = 0;
+static guint setsPending = 0;
+static gint lastSet = -1;
+static gboolean failNextSet = FALSE;
+
+typedef struct
+{
+	GDBusMethodInvocation *invocation;
+	gint value;
+	gboolean fail;
+} PendingSet;
+
+static gboolean finish_set(PendingSet *set)
+{
+	if(set->fail)
+	{
+		g_dbus_method_invocation_return_error_literal(set->invocation,
+			G_DBUS_ERROR, G_DBUS_ERROR_FAILED, "Simulated write failure");
+	}
+	else
+	{
+		// UPower emits the signal before replying
+		fakeValue = set->value;
+		g_dbus_connection_emit_signal(serviceBus, NULL, KBD_DBUS_PATH, KBD_DBUS_IFACE,
+			"BrightnessChanged", g_variant_new("(i)", fakeValue), NULL);
+		g_dbus_method_invocation_return_value(set->invocation, NULL);
+	}
+	setsPending--;
+	g_free(set);
+	return G_SOURCE_REMOVE;
+}
+
+static void on_method_call(UNUSED GDBusConnection *connection, UNUSED const gchar *sender, UNUSED const gchar *path, UNUSED const gchar *iface, const gchar *method, GVariant *parameters, GDBusMethodInvocation *invocation, UNUSED gpointer userdata)
+{
+	if(g_strcmp0(method, "GetMaxBrightness") == 0)
+	{
+		g_dbus_method_invocation_return_value(invocation, g_variant_new("(i)", FAKE_MAX));
+	}
+	else if(g_strcmp0(method, "GetBrightness") == 0)
+	{
+		getCalls++;
+		g_dbus_method_invocation_return_value(invocation, g_variant_new("(i)", fakeValue));
+	}
+	else if(g_strcmp0(method, "SetBrightness") == 0)
+	{
+		PendingSet *set = g_new0(PendingSet, 1);
+		set->invocation = invocation;
+		g_variant_get(parameters, "(i)", &set->value);
+		set->fail = failNextSet;
+		failNextSet = FALSE;
+		setCalls++;
+		setsPending++;
+		lastSet = set->value;
+		g_timeout_add(SET_DELAY, (GSourceFunc)finish_set, set);
+	}
+}
+
+static const GDBusInterfaceVTable kbdVTable = {on_method_call, NULL, NULL, {0}};
+
+static void on_name_acquired(UNUSED GDBusConnection *connection, UNUSED const gchar *name, UNUSED gpointer userdata)
+{
+	nameAcquired = TRUE;
+}
+
+static gboolean brightness_known(UNUSED gpointer userdata)
+{
+	return csk_keyboard_backlight_get_brightness() >= 0;
+}
+
+static gboolean brightness_is_0_7(UNUSED gpointer userdata)
+{
+	return fabs(csk_keyboard_backlight_get_brightness() - 0.7) < 0.01;
+}
+
+static gboolean brightness_is_1(UNUSED gpointer userdata)
+{
+	return fabs(csk_keyboard_backlight_get_brightness() - 1.0) < 0.01;
+}
+
+static gboolean writes_settled(UNUSED gpointer userdata)
+{
+	return setsPending == 0 && fakeValue == FAKE_MAX;
+}
+
+static gboolean write_failed(UNUSED gpointer userdata)
+{
+	return setsPending == 0 && setCalls > 0;
+}
+
+static void test_cached_value(void)
+{
+	g_assert_true(wait_for(brightness_known, NULL, WAIT_TIMEOUT));
+	g_assert_cmpfloat(fabs(csk_keyboard_backlight_get_brightness() - 0.3), <, 0.01);
+
+	fakeValue = 7;
+	g_dbus_connection_emit_signal(serviceBus, NULL, KBD_DBUS_PATH, KBD_DBUS_IFACE,
+		"BrightnessChanged", g_variant_new("(i)", fakeValue), NULL);
+	g_assert_true(wait_for(brightness_is_0_7, NULL, WAIT_TIMEOUT));
+
+	// Only the initial read should have gone over the bus
+	g_assert_cmpuint(getCalls, ==, 1);
+}
+
+static void test_coalesce_writes(void)
+{
+	setCalls = 0;
+	for(gint i = 1; i <= 5; ++i)
+		csk_keyboard_backlight_set_brightness(i * 0.2, FALSE);
+
+	// The cache follows immediately, without waiting for the writes
+	g_assert_true(brightness_is_1(NULL));
+
+	g_assert_true(wait_for(writes_settled, NULL, WAIT_TIMEOUT));
+	g_assert_cmpint(lastSet, ==, FAKE_MAX);
+	// The first value goes out right away and the rest collapse into one
+	g_assert_cmpuint(setCalls, <=, 2);
+	g_assert_true(brightness_is_1(NULL));
+}
+
+static void test_resync_on_failure(void)
+{
+	setCalls = 0;
+	getCalls = 0;
+	failNextSet = TRUE;
+	csk_keyboard_backlight_set_brightness(0, FALSE);
+	g_assert_cmpfloat(csk_keyboard_backlight_get_brightness(), <, 0.01);
+
+	g_assert_true(wait_for(write_failed, NULL, WAIT_TIMEOUT));
+	g_assert_true(wait_for(brightness_is_1, NULL, WAIT_TIMEOUT));
+	g_assert_cmpuint(getCalls, ==, 1);
+	g_assert_cmpint(fakeValue, ==, FAKE_MAX);
+}
+
+int main(int argc, char **argv)
+{
+	gchar *daemon = g_find_program_in_path("dbus-daemon");
+	if(!daemon)
+	{
+		g_printerr("dbus-daemon not found, skipping\n");
+		return EXIT_SKIP;
+	}
+	g_free(daemon);
+
+	g_test_init(&argc, &argv, NULL);
+
+	GTestDBus *bus = g_test_dbus_new(G_TEST_DBUS_NONE);
+	g_test_dbus_up(bus);
+	const gchar *address = g_test_dbus_get_bus_address(bus);
+	// The backlight code talks to UPower on the system bus
+	g_setenv("DBUS_SYSTEM_BUS_ADDRESS", address, TRUE);
+
+	GError *error = NULL;
+	serviceBus = g_dbus_connection_new_for_address_sync(address,
+		G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+		NULL, NULL, &error);
+	g_assert_no_error(error);
+
+	GDBusNodeInfo *node = g_dbus_node_info_new_for_xml(kbdXml, &error);
+	g_assert_no_error(error);
+	g_dbus_connection_register_object(serviceBus, KBD_DBUS_PATH, node->interfaces[0],
+		&kbdVTable, NULL, NULL, &error);
+	g_assert_no_error(error);
+
+	guint ownerId = g_bus_own_name_on_connection(serviceBus, UPOWER_DBUS_NAME,
+		G_BUS_NAME_OWNER_FLAGS_NONE, on_name_acquired, NULL, NULL, NULL);
+	while(!nameAcquired)
+		g_main_context_iteration(NULL, TRUE);
+
+	// Each test continues from the state the previous one left
+	g_test_add_func("/backlight/keyboard/cached-value", test_cached_value);
+	g_test_add_func("/backlight/keyboard/coalesce-writes", test_coalesce_writes);
+	g_test_add_func("/backlight/keyboard/resync-on-failure", test_resync_on_failure);
+	gint ret = g_test_run();
+
+	g_bus_unown_name(ownerId);
+	g_dbus_node_info_unref(node);
+	g_object_unref(serviceBus);
+	g_test_dbus_down(bus);
+	g_object_unref(bus);
+	return ret;
+}
@@ -0,0 +1,332 @@
+/*
+ * This file is part of graphene-desktop, the desktop environment of VeltOS.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * session-bench.c
+ * Benchmark of the session manager's DBus methods. Starts a private
+ * dbus-daemon, runs the session manager on it, and has N simulated clients
+ * (each a thread with its own bus connection) register and then hammer the
+ * SessionManager methods. Prints the throughput and latency percentiles of
+ * each method, and fails if any call fails.
+ *
+ * Exits with 77 (skipped) if dbus-daemon isn't available.
+ */
+
+#include "session.h"
+#include "util.h"
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <signal.h>
+#include <stdio.h>
+
+#define SESSION_DBUS_NAME "org.gnome.SessionManager"
+#define SESSION_DBUS_PATH "/org/gnome/SessionManager"
+#define SESSION_DBUS_IFACE "org.gnome.SessionManager"
+#define EXIT_SKIP 77
+
+typedef enum
+{
+	METHOD_REGISTER_CLIENT,
+	METHOD_IS_INHIBITED,
+	METHOD_INHIBIT,
+	METHOD_UNINHIBIT,
+	METHOD_GET_CURRENT_CLIENT,
+	METHOD_GET_CLIENTS,
+	METHOD_IS_SESSION_RUNNING,
+	METHOD_UNREGISTER_CLIENT,
+	METHOD_COUNT
+} Method;
+
+static const gchar *methodNames[METHOD_COUNT] = {
+	"RegisterClient",
+	"IsInhibited",
+	"Inhibit",
+	"Uninhibit",
+	"GetCurrentClient",
+	"GetClients",
+	"IsSessionRunning",
+	"UnregisterClient",
+};
+
+static gint numClients = 50;
+static gint numRounds = 100;
+
+static GMainLoop *loop = NULL;
+static gchar *busAddress = NULL;
+
+static GMutex statsLock;
+static GArray *latencies[METHOD_COUNT]; // gint64 microseconds
+static guint failures = 0;
+static gint clientsRunning = 0;
+static gint64 benchStart = 0;
+static gint64 benchEnd = 0;
+
+typedef struct
+{
+	gint id;
+	GArray *latencies[METHOD_COUNT];
+	guint failures;
+} ClientData;
+
+static GVariant * timed_call(GDBusConnection *connection, ClientData *data, Method method, GVariant *params, const GVariantType *replyType)
+{
+	GError *error = NULL;
+	gint64 start = g_get_monotonic_time();
+	GVariant *ret = g_dbus_connection_call_sync(connection, SESSION_DBUS_NAME, SESSION_DBUS_PATH, SESSION_DBUS_IFACE,
+		methodNames[method], params, replyType, G_DBUS_CALL_FLAGS_NONE, -1, NULL, &error);
+	gint64 latency = g_get_monotonic_time() - start;
+	g_array_append_val(data->latencies[method], latency);
+
+	if(!ret)
+	{
+		g_printerr("Client %i: %s failed: %s\n", data->id, methodNames[method], error->message);
+		g_clear_error(&error);
+		data->failures++;
+	}
+	return ret;
+}
+
+static gboolean on_client_thread_done(UNUSED gpointer userdata)
+{
+	if(--clientsRunning == 0)
+	{
+		benchEnd = g_get_monotonic_time();
+		g_main_loop_quit(loop);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+static void run_client(GDBusConnection *connection, ClientData *data)
+{
+	gchar *appId = g_strdup_printf("session-bench-%i", data->id);
+	gchar *clientPath = NULL;
+
+	GVariant *ret = timed_call(connection, data, METHOD_REGISTER_CLIENT, g_variant_new("(ss)", appId, ""), G_VARIANT_TYPE("(o)"));
+	if(ret)
+	{
+		g_variant_get(ret, "(o)", &clientPath);
+		g_variant_unref(ret);
+	}
+
+	for(gint i = 0; i < numRounds; ++i)
+	{
+		if((ret = timed_call(connection, data, METHOD_IS_INHIBITED, g_variant_new("(u)", 4), NULL)))
+			g_variant_unref(ret);
+
+		guint cookie = 0;
+		if((ret = timed_call(connection, data, METHOD_INHIBIT, g_variant_new("(susu)", appId, 0, "benchmark", 4), G_VARIANT_TYPE("(u)"))))
+		{
+			g_variant_get(ret, "(u)", &cookie);
+			g_variant_unref(ret);
+		}
+
+		if((ret = timed_call(connection, data, METHOD_UNINHIBIT, g_variant_new("(u)", cookie), NULL)))
+			g_variant_unref(ret);
+		if((ret = timed_call(connection, data, METHOD_GET_CURRENT_CLIENT, NULL, G_VARIANT_TYPE("(o)"))))
+			g_variant_unref(ret);
+		if((ret = timed_call(connection, data, METHOD_GET_CLIENTS, NULL, G_VARIANT_TYPE("(ao)"))))
+			g_variant_unref(ret);
+		if((ret = timed_call(connection, data, METHOD_IS_SESSION_RUNNING, NULL, G_VARIANT_TYPE("(b)"))))
+			g_variant_unref(ret);
+	}
+
+	if(clientPath)
+	{
+		if((ret = timed_call(connection, data, METHOD_UNREGISTER_CLIENT, g_variant_new("(o)", clientPath), NULL)))
+			g_variant_unref(ret);
+	}
+
+	g_free(clientPath);
+	g_free(appId);
+}
+
+static gpointer client_thread(ClientData *data)
+{
+	GError *error = NULL;
+	GDBusConnection *connection = g_dbus_connection_new_for_address_sync(busAddress,
+		G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT | G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+		NULL, NULL, &error);
+	if(connection)
+	{
+		run_client(connection, data);
+		g_dbus_connection_close_sync(connection, NULL, NULL);
+		g_object_unref(connection);
+	}
+	else
+	{
+		g_printerr("Client %i: failed to connect: %s\n", data->id, error->message);
+		g_clear_error(&error);
+		data->failures++;
+	}
+
+	g_mutex_lock(&statsLock);
+	for(guint m = 0; m < METHOD_COUNT; ++m)
+		g_array_append_vals(latencies[m], data->latencies[m]->data, data->latencies[m]->len);
+	failures += data->failures;
+	g_mutex_unlock(&statsLock);
+
+	for(guint m = 0; m < METHOD_COUNT; ++m)
+		g_array_unref(data->latencies[m]);
+	g_free(data);
+
+	g_idle_add(on_client_thread_done, NULL);
+	return NULL;
+}
+
+static void on_session_startup_complete(UNUSED gpointer userdata)
+{
+	benchStart = g_get_monotonic_time();
+	clientsRunning = numClients;
+	for(gint i = 0; i < numClients; ++i)
+	{
+		ClientData *data = g_new0(ClientData, 1);
+		data->id = i;
+		for(guint m = 0; m < METHOD_COUNT; ++m)
+			data->latencies[m] = g_array_new(FALSE, FALSE, sizeof(gint64));
+		g_thread_unref(g_thread_new("bench-client", (GThreadFunc)client_thread, data));
+	}
+}
+
+static void on_show_dialog(UNUSED const gchar *message, UNUSED const gchar * const *buttons, UNUSED gpointer userdata)
+{
+}
+
+static void on_session_quit(gboolean failed, UNUSED gpointer userdata)
+{
+	g_printerr("Session quit unexpectedly (%s)\n", failed ? "failed" : "successfully");
+	failures++;
+	g_main_loop_quit(loop);
+}
+
+static gboolean on_timeout(UNUSED gpointer userdata)
+{
+	g_printerr("Benchmark timed out\n");
+	failures++;
+	g_main_loop_quit(loop);
+	return G_SOURCE_REMOVE;
+}
+
+// The session manager logs every registration; that isn't what's measured
+static void discard_log(UNUSED const gchar *domain, UNUSED GLogLevelFlags level, UNUSED const gchar *message, UNUSED gpointer userdata)
+{
+}
+
+static void print_report()
+{
+	gdouble elapsed = (benchEnd - benchStart) / (gdouble)G_USEC_PER_SEC;
+	guint total = 0;
+
+	printf("%i clients, %i rounds each, %.2fs\n", numClients, numRounds, elapsed);
+	for(guint m = 0; m < METHOD_COUNT; ++m)
+	{
+		guint n = latencies[m]->len;
+		total += n;
+		gchar *percentiles = latency_percentiles(latencies[m]);
+		if(!percentiles)
+			continue;
+		printf("%-20s %8u calls  %9.1f/s  %s\n", methodNames[m], n, n / elapsed, percentiles);
+		g_free(percentiles);
+	}
+	printf("%-20s %8u calls  %9.1f/s\n", "Total", total, total / elapsed);
+}
+
+static GPid start_bus(void)
+{
+	const gchar *argv[] = {"dbus-daemon", "--session", "--nofork", "--print-address=1", NULL};
+	GPid pid = 0;
+	gint out = -1;
+	GError *error = NULL;
+	if(!g_spawn_async_with_pipes(NULL, (gchar **)argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, &pid, NULL, &out, NULL, &error))
+	{
+		g_printerr("Cannot start dbus-daemon: %s\n", error->message);
+		g_clear_error(&error);
+		return 0;
+	}
+
+	GIOChannel *channel = g_io_channel_unix_new(out);
+	g_io_channel_set_close_on_unref(channel, TRUE);
+	g_io_channel_read_line(channel, &busAddress, NULL, NULL, NULL);
+	g_io_channel_unref(channel);
+
+	if(busAddress)
+		g_strstrip(busAddress);
+	if(!busAddress || !*busAddress)
+	{
+		g_printerr("dbus-daemon did not print an address\n");
+		kill(pid, SIGTERM);
+		g_spawn_close_pid(pid);
+		return 0;
+	}
+	return pid;
+}
+
+int main(int argc, char **argv)
+{
+	GOptionEntry entries[] = {
+		{"clients", 'n', 0, G_OPTION_ARG_INT, &numClients, "Number of simulated clients (default: 50)", "N"},
+		{"rounds", 'r', 0, G_OPTION_ARG_INT, &numRounds, "Method call rounds per client (default: 100)", "N"},
+		{NULL}
+	};
+
+	GError *error = NULL;
+	GOptionContext *opt = g_option_context_new(NULL);
+	g_option_context_add_main_entries(opt, entries, NULL);
+	if(!g_option_context_parse(opt, &argc, &argv, &error))
+	{
+		g_printerr("%s\n", error->message);
+		return 1;
+	}
+	g_option_context_free(opt);
+
+	GPid busPid = start_bus();
+	if(!busPid)
+		return EXIT_SKIP;
+
+	// The session manager gets both buses from the private daemon, and an
+	// empty XDG environment so that it has no autostarts to launch
+	gchar *xdgDir = g_dir_make_tmp("session-bench-XXXXXX", NULL);
+	g_setenv("DBUS_SESSION_BUS_ADDRESS", busAddress, TRUE);
+	g_setenv("DBUS_SYSTEM_BUS_ADDRESS", busAddress, TRUE);
+	g_setenv("XDG_CONFIG_HOME", xdgDir, TRUE);
+	g_setenv("XDG_CONFIG_DIRS", xdgDir, TRUE);
+	g_setenv("XDG_DATA_HOME", xdgDir, TRUE);
+	g_setenv("XDG_DATA_DIRS", xdgDir, TRUE);
+	g_setenv("GSETTINGS_BACKEND", "memory", TRUE);
+
+	g_log_set_handler(NULL, G_LOG_LEVEL_MESSAGE | G_LOG_LEVEL_INFO | G_LOG_LEVEL_DEBUG, discard_log, NULL);
+
+	for(guint m = 0; m < METHOD_COUNT; ++m)
+		latencies[m] = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+	loop = g_main_loop_new(NULL, FALSE);
+	graphene_session_init(on_session_startup_complete, on_show_dialog, on_session_quit, NULL);
+	g_timeout_add_seconds(120, on_timeout, NULL);
+	g_main_loop_run(loop);
+
+	if(benchEnd)
+		print_report();
+
+	kill(busPid, SIGTERM);
+	g_spawn_close_pid(busPid);
+	g_rmdir(xdgDir);
+	g_free(xdgDir);
+
+	if(failures)
+	{
+		g_printerr("%u failed calls\n", failures);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,27 @@
+/*
+ * This file is part of graphene-desktop, the desktop environment of VeltOS.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ */
+
+#include "test-util.h"
+
+#define WAIT_TICK 5 // ms
+
+// Wakes the context regularly, so cond and the timeout are checked even
+// when nothing else happens
+static gboolean on_wait_tick(UNUSED gpointer userdata)
+{
+	return G_SOURCE_CONTINUE;
+}
+
+gboolean wait_for(gboolean (*cond)(gpointer userdata), gpointer userdata, gint64 timeout)
+{
+	guint tick = g_timeout_add(WAIT_TICK, on_wait_tick, NULL);
+	gint64 end = g_get_monotonic_time() + timeout;
+	gboolean met;
+	while(!(met = cond(userdata)) && g_get_monotonic_time() < end)
+		g_main_context_iteration(NULL, TRUE);
+	g_source_remove(tick);
+	return met;
+}
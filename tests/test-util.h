@@ -0,0 +1,20 @@
+/*
+ * This file is part of graphene-desktop, the desktop environment of VeltOS.
+ * Copyright (C) 2016 Velt Technologies, Aidan Shafran <zelbrium@gmail.com>
+ * Licensed under the Apache License 2 <www.apache.org/licenses/LICENSE-2.0>.
+ *
+ * Helpers shared by the tests and benchmarks.
+ */
+
+#ifndef __GRAPHENE_TEST_UTIL_H__
+#define __GRAPHENE_TEST_UTIL_H__
+
+#include <glib.h>
+
+/*
+ * Runs the default main context until cond returns TRUE. Returns FALSE if
+ * that didn't happen within timeout microseconds.
+ */
+gboolean wait_for(gboolean (*cond)(gpointer userdata), gpointer userdata, gint64 timeout);
+
+#endif /* __GRAPHENE_TEST_UTIL_H__ */